@@ -2,18 +2,42 @@
 // Copyright (c) 2015 SanDisk Corporation
 // Copyright (c) 2016-2018 Western Digital Corporation or its affiliates
 
+#include <algorithm>   // std::min()
 #include <cassert>
 #include <cstdint>     // uintptr_t
 #include <cstring>     // memset()
+#include <ctime>       // clock_gettime()
 #include <fcntl.h>     // O_RDONLY
+#include <fstream>
+#include <getopt.h>    // getopt_long()
 #include <iomanip>
 #include <iostream>
+#include <climits>     // PATH_MAX
+#include <linux/bsg.h> // struct sg_io_v4
 #include <linux/fs.h>  // BLKSSZGET
+#include <poll.h>
+#include <random>
 #include <scsi/sg.h>   // sg_io_hdr_t
 #include <sys/ioctl.h>
+#include <sys/mman.h>  // mmap()
+#include <sys/resource.h> // getrusage()
+#include <sys/stat.h>  // fstat()
+#include <sys/sysmacros.h> // major()
 #include <unistd.h>    // open()
 #include <vector>
 
+/* Not in glibc's <scsi/sg.h>. */
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO 4
+#endif
+
+/* Multi-command interface of the sg v4 driver, not in every kernel. */
+#ifndef SG_IOSUBMIT
+#define SG_IOCTL_MAGIC_NUM 0x22
+#define SG_IOSUBMIT _IOWR(SG_IOCTL_MAGIC_NUM, 0x41, struct sg_io_v4)
+#define SG_IORECEIVE _IOWR(SG_IOCTL_MAGIC_NUM, 0x42, struct sg_io_v4)
+#endif
+
 class file_descriptor {
 public:
 	file_descriptor(int fd = -1)
@@ -31,9 +55,14 @@ private:
 	int m_fd;
 };
 
+/*
+ * A list of user space buffer segments. The total length is cached since
+ * it is needed several times for every command.
+ */
 class iovec_t {
 public:
 	iovec_t()
+		: m_len(0)
 	{ }
 	~iovec_t()
 	{ }
@@ -41,22 +70,55 @@ public:
 	{ return m_v.size(); }
 	const sg_iovec_t& operator[](const int i) const
 	{ return m_v[i]; }
-	sg_iovec_t& operator[](const int i)
-	{ return m_v[i]; }
+	void set_len(const int i, size_t len) {
+		m_len += len - m_v[i].iov_len;
+		m_v[i].iov_len = len;
+	}
 	void append(void *addr, size_t len) {
 		m_v.resize(m_v.size() + 1);
 		auto p = m_v.end() - 1;
 		p->iov_base = addr;
 		p->iov_len = len;
+		m_len += len;
+	}
+	void clear() {
+		m_v.clear();
+		m_len = 0;
 	}
 	const void *address() const {
 		return &*m_v.begin();
 	}
 	size_t data_len() const {
-		size_t len = 0;
-		for (auto p = m_v.begin(); p != m_v.end(); ++p)
-			len += p->iov_len;
-		return len;
+		return m_len;
+	}
+	/*
+	 * Make this the next up to @len bytes of @src from the cursor
+	 * (@seg, @off), limited to @max_segs segments and rounded down to a
+	 * multiple of @align bytes, and advance the cursor past them.
+	 * Returns the number of bytes.
+	 */
+	size_t slice(const iovec_t &src, size_t &seg, size_t &off, size_t len,
+		     size_t max_segs, size_t align) {
+		size_t n = 0, left;
+
+		for (size_t i = seg, o = off;
+		     i < src.size() && n < len && i - seg < max_segs;
+		     i++, o = 0)
+			n += std::min(src[i].iov_len - o, len - n);
+		n -= n % align;
+
+		clear();
+		for (left = n; left; seg++, off = 0) {
+			size_t k = std::min(src[seg].iov_len - off, left);
+
+			append((uint8_t *)src[seg].iov_base + off, k);
+			left -= k;
+			if (off + k < src[seg].iov_len) {
+				off += k;
+				break;
+			}
+		}
+		return n;
 	}
 	void trunc(size_t len) {
 		size_t s = 0;
@@ -67,6 +129,7 @@ public:
 				assert(p->iov_len > 0 ||
 				       (p->iov_len == 0 && len == 0));
 				m_v.resize(p - m_v.begin() + 1);
+				m_len = len;
 				break;
 			}
 		}
@@ -82,10 +145,9 @@ private:
 	iovec_t &operator=(const iovec_t &);
 
 	std::vector<sg_iovec_t> m_v;
+	size_t m_len;
 };
 
-static unsigned block_size;
-
 static void dumphex(std::ostream &os, const void *a, size_t len)
 {
 	for (int i = 0; i < len; i += 16) {
@@ -109,220 +171,1681 @@ static void dumphex(std::ostream &os, const void *a, size_t len)
 enum {
 	MAX_READ_WRITE_6_LBA = 0x1fffff,
 	MAX_READ_WRITE_6_LENGTH = 0xff,
+	MAX_READ_WRITE_10_LBA = 0xffffffffu,
+	MAX_READ_WRITE_10_LENGTH = 0xffff,
+	MAX_READ_WRITE_16_LENGTH = 0xffffffffu,
 };
 
-static ssize_t sg_read(const file_descriptor &fd, uint32_t lba,
-		       const iovec_t &v)
-{
-	if (lba > MAX_READ_WRITE_6_LBA)
-		return -1;
+/* Used if the maximum transfer size of the device can't be queried. */
+static const size_t default_max_transfer = 512 * 1024;
 
-	if (v.data_len() == 0 || (v.data_len() % block_size) != 0)
-		return -1;
+/* UIO_MAXIOV, the most iovecs the kernel accepts for one command. */
+static const size_t max_iovecs = 1024;
 
-	if (v.data_len() / block_size > MAX_READ_WRITE_6_LENGTH)
-		return -1;
+static void put_be(uint8_t *p, uint64_t v, int bytes)
+{
+	for (int i = bytes - 1; i >= 0; i--, v >>= 8)
+		p[i] = v;
+}
 
-	int sg_version;
-	if (ioctl(fd, SG_GET_VERSION_NUM, &sg_version) < 0 ||
-	    sg_version < 30000)
-		return -1;
+/*
+ * Build the smallest READ or WRITE CDB that can address @lba and transfer
+ * @blocks blocks. Returns the CDB length.
+ */
+static int build_rw_cdb(uint8_t *cdb, bool write, uint64_t lba,
+			uint32_t blocks)
+{
+	if (lba <= MAX_READ_WRITE_6_LBA &&
+	    blocks <= MAX_READ_WRITE_6_LENGTH) {
+		memset(cdb, 0, 6);
+		cdb[0] = write ? 0x0a : 0x08;
+		put_be(cdb + 1, lba, 3);
+		cdb[4] = blocks;
+		return 6;
+	}
+	if (lba <= MAX_READ_WRITE_10_LBA &&
+	    blocks <= MAX_READ_WRITE_10_LENGTH) {
+		memset(cdb, 0, 10);
+		cdb[0] = write ? 0x2a : 0x28;
+		put_be(cdb + 2, lba, 4);
+		put_be(cdb + 7, blocks, 2);
+		return 10;
+	}
+	memset(cdb, 0, 16);
+	cdb[0] = write ? 0x8a : 0x88;
+	put_be(cdb + 2, lba, 8);
+	put_be(cdb + 10, blocks, 4);
+	return 16;
+}
 
-	uint8_t read6[6] = {
-		0x08, (uint8_t)(lba >> 16), (uint8_t)(lba >> 8),
-		(uint8_t)(lba), (uint8_t)(v.data_len() / block_size),
-		0
-	};
-	unsigned char sense_buffer[32];
-	sg_io_hdr_t h;
-
-	memset(&h, 0, sizeof(h));
-	h.interface_id = 'S';
-	h.cmdp = read6;
-	h.cmd_len = sizeof(read6);
-	h.dxfer_direction = SG_DXFER_FROM_DEV;
-	h.iovec_count = v.size();
-	h.dxfer_len = v.data_len();
-	h.dxferp = const_cast<void*>(v.address());
-	h.sbp = sense_buffer;
-	h.mx_sb_len = sizeof(sense_buffer);
-	h.timeout = 1000;     /* 1000 millisecs == 1 second */
-	if (ioctl(fd, SG_IO, &h) < 0) {
-		std::cerr << "READ(6) ioctl failed with errno " << errno
-			  << '\n';
-		return -1;
+static const char *cdb_name(const uint8_t *cdb)
+{
+	switch (cdb[0]) {
+	case 0x08: return "READ(6)";
+	case 0x0a: return "WRITE(6)";
+	case 0x25: return "READ CAPACITY(10)";
+	case 0x28: return "READ(10)";
+	case 0x2a: return "WRITE(10)";
+	case 0x88: return "READ(16)";
+	case 0x8a: return "WRITE(16)";
+	case 0x9e: return "READ CAPACITY(16)";
 	}
+	return "?";
+}
+
+/*
+ * Report a failed command. Returns the number of bytes transferred or -1 if
+ * the command failed.
+ */
+static ssize_t rw_result(const sg_io_hdr_t &h)
+{
 	uint32_t result = h.status | (h.msg_status << 8) |
 		(h.host_status << 16) | (h.driver_status << 24);
 	if (result) {
-		std::cerr << "READ(6) failed with status 0x" << std::hex
-			  << result << "\n";
+		std::cerr << cdb_name(h.cmdp) << " failed with status 0x"
+			  << std::hex << result << std::dec << "\n";
 		if (h.status == 2) {
 			std::cerr << "Sense buffer:\n";
-			dumphex(std::cerr, sense_buffer, h.sb_len_wr);
+			dumphex(std::cerr, h.sbp, h.sb_len_wr);
 		}
 		return -1;
 	}
-	return v.data_len() - h.resid;
+	return h.dxfer_len - h.resid;
 }
 
-static ssize_t sg_write(const file_descriptor &fd, uint32_t lba,
-			const iovec_t &v)
+static ssize_t rw_result(const struct sg_io_v4 &h)
 {
-	if (lba > MAX_READ_WRITE_6_LBA)
+	uint32_t result = h.device_status | (h.transport_status << 16) |
+		(h.driver_status << 24);
+	if (result) {
+		std::cerr << cdb_name((const uint8_t *)(uintptr_t)h.request)
+			  << " failed with status 0x" << std::hex << result
+			  << std::dec << "\n";
+		if (h.device_status == 2) {
+			std::cerr << "Sense buffer:\n";
+			dumphex(std::cerr, (const void *)(uintptr_t)h.response,
+				h.response_len);
+		}
 		return -1;
+	}
+	if (h.din_xfer_len)
+		return h.din_xfer_len - h.din_resid;
+	return h.dout_xfer_len - h.dout_resid;
+}
+
+/*
+ * SCSI generic session on an open sg, bsg or SCSI block device. The driver
+ * and the device limits are probed once, and every command slot has its own
+ * header, CDB and sense buffer, so issuing a command only fills in what
+ * differs between commands. Slot numbers double as pack_id for the
+ * asynchronous interface.
+ *
+ * Commands use the sg v3 header (sg_io_hdr_t) unless the session is set to
+ * v4 (struct sg_io_v4), which bsg devices require.
+ */
+class sg_session {
+public:
+	sg_session(const file_descriptor &fd, unsigned nr_slots = 1)
+		: m_fd(fd), m_block_size(0), m_max_transfer(0),
+		  m_max_segments(0), m_capacity(0), m_is_chr(false),
+		  m_is_bsg(false), m_v4(false), m_slots(nr_slots)
+	{ }
+
+	/* Returns false, after reporting why, if the device can't be used. */
+	bool probe(const char *dev, bool v4) {
+		int sg_version;
+		struct stat st;
+
+		m_is_chr = fstat(m_fd, &st) == 0 && S_ISCHR(st.st_mode);
+		if (ioctl(m_fd, SG_GET_VERSION_NUM, &sg_version) == 0) {
+			if (sg_version < 30000) {
+				std::cerr << "Error: sg version 3 is not supported\n";
+				return false;
+			}
+		} else if (m_is_chr && is_bsg(st)) {
+			m_is_bsg = true;
+			v4 = true;
+		} else {
+			std::cerr << "SG_GET_VERSION_NUM ioctl failed with errno "
+				  << errno << '\n';
+			return false;
+		}
+		m_v4 = v4;
 
+		memset(&m_template, 0, sizeof(m_template));
+		m_template.interface_id = 'S';
+		m_template.mx_sb_len = sizeof(m_slots[0].sense);
+		m_template.timeout = 1000;     /* 1000 millisecs == 1 second */
+		memset(&m_template4, 0, sizeof(m_template4));
+		m_template4.guard = 'Q';
+		m_template4.protocol = BSG_PROTOCOL_SCSI;
+		m_template4.subprotocol = BSG_SUB_PROTOCOL_SCSI_CMD;
+		m_template4.max_response_len = sizeof(m_slots[0].sense);
+		m_template4.timeout = 1000;
+
+		/* sg and bsg nodes don't know BLKSSZGET */
+		if (ioctl(m_fd, BLKSSZGET, &m_block_size) < 0 &&
+		    !read_capacity()) {
+			std::cerr << "Failed to query block size of " << dev
+				  << "\n";
+			return false;
+		}
+		m_max_transfer = query_max_transfer();
+		m_max_segments = query_max_segments();
+		return true;
+	}
+
+	unsigned block_size() const
+	{ return m_block_size; }
+	size_t max_transfer() const
+	{ return m_max_transfer; }
+	/* The asynchronous and mmap interfaces only exist on sg devices. */
+	bool is_sg() const
+	{ return m_is_chr && !m_is_bsg; }
+	bool is_bsg() const
+	{ return m_is_bsg; }
+	bool v4() const
+	{ return m_v4; }
+	unsigned nr_slots() const
+	{ return m_slots.size(); }
+	/* bsg ignores the v4 iovec counts, so it only takes flat buffers. */
+	size_t max_segs_per_cmd() const
+	{ return m_is_bsg ? 1 : max_iovecs; }
+	/* Segments per command the device takes without bouncing. */
+	size_t max_segments() const
+	{ return m_max_segments; }
+
+	/* Number of logical blocks, 0 if it can't be queried. */
+	uint64_t capacity() {
+		if (!m_capacity)
+			read_capacity();
+		return m_capacity;
+	}
+
+	/* Set up @slot for a READ or WRITE of the data in @v at @lba. */
+	sg_io_hdr_t &prep(unsigned slot, bool write, uint64_t lba,
+			  const iovec_t &v) {
+		slot_t &s = m_slots[slot];
+
+		prep_cdb(slot, build_rw_cdb(s.cdb, write, lba,
+					    v.data_len() / m_block_size),
+			 write, v, false);
+		return s.hdr;
+	}
+
+	/* The same with an sg v4 header. */
+	struct sg_io_v4 &prep_v4(unsigned slot, bool write, uint64_t lba,
+				 const iovec_t &v) {
+		slot_t &s = m_slots[slot];
+
+		prep_cdb(slot, build_rw_cdb(s.cdb, write, lba,
+					    v.data_len() / m_block_size),
+			 write, v, true);
+		return s.hdr4;
+	}
+
+	/* Set up @slot with the header version of the session. */
+	void prep_rw(unsigned slot, bool write, uint64_t lba,
+		     const iovec_t &v) {
+		if (m_v4)
+			prep_v4(slot, write, lba, v);
+		else
+			prep(slot, write, lba, v);
+	}
+
+	/* Issue the command in @slot synchronously. */
+	ssize_t execute(unsigned slot) {
+		slot_t &s = m_slots[slot];
+
+		if (s.v4 && !m_is_bsg)
+			return execute_v4_as_v3(s);
+		if (ioctl(m_fd, SG_IO, s.v4 ? (void *)&s.hdr4 :
+			  (void *)&s.hdr) < 0) {
+			std::cerr << cdb_name(s.cdb)
+				  << " ioctl failed with errno " << errno
+				  << '\n';
+			return -1;
+		}
+		return s.v4 ? rw_result(s.hdr4) : rw_result(s.hdr);
+	}
+
+	/*
+	 * Queue the command in @slot. Returns 0, -EAGAIN if the driver can't
+	 * take more commands right now or -1 on failure.
+	 */
+	int submit(unsigned slot) {
+		sg_io_hdr_t &h = m_slots[slot].hdr;
+
+		if (::write(m_fd, &h, sizeof(h)) < 0) {
+			if (errno == EAGAIN || errno == EDOM)
+				return -EAGAIN;
+			std::cerr << cdb_name(h.cmdp)
+				  << " write failed with errno " << errno
+				  << '\n';
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 * Reap one completed command. Returns its slot and stores the result
+	 * in @res, -EAGAIN if none has completed or -1 on failure.
+	 */
+	int complete(ssize_t &res) {
+		sg_io_hdr_t h = m_template;
+
+		h.pack_id = -1;
+		if (::read(m_fd, &h, sizeof(h)) < 0) {
+			if (errno == EAGAIN)
+				return -EAGAIN;
+			std::cerr << "read failed with errno " << errno
+				  << '\n';
+			return -1;
+		}
+		if (h.pack_id < 0 || (unsigned)h.pack_id >= m_slots.size()) {
+			std::cerr << "Unexpected pack_id " << h.pack_id
+				  << '\n';
+			return -1;
+		}
+		res = rw_result(h);
+		return h.pack_id;
+	}
+
+	/*
+	 * Queue the v4 command in @slot with SG_IOSUBMIT. Returns 0,
+	 * -EOPNOTSUPP if the driver doesn't have SG_IOSUBMIT, -EAGAIN if it
+	 * can't take more commands right now or -1 on failure.
+	 */
+	int submit_v4(unsigned slot) {
+		struct sg_io_v4 &h = m_slots[slot].hdr4;
+
+		if (ioctl(m_fd, SG_IOSUBMIT, &h) < 0) {
+			if (errno == ENOTTY || errno == EINVAL ||
+			    errno == ENOSYS)
+				return -EOPNOTSUPP;
+			if (errno == EAGAIN || errno == EDOM)
+				return -EAGAIN;
+			std::cerr << cdb_name(m_slots[slot].cdb)
+				  << " SG_IOSUBMIT failed with errno " << errno
+				  << '\n';
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 * Wait for a v4 command with SG_IORECEIVE. Returns its slot, from
+	 * usr_ptr, and stores the result in @res or returns -1 on failure.
+	 */
+	int receive_v4(ssize_t &res) {
+		struct sg_io_v4 h = m_template4;
+
+		if (ioctl(m_fd, SG_IORECEIVE, &h) < 0) {
+			std::cerr << "SG_IORECEIVE failed with errno " << errno
+				  << '\n';
+			return -1;
+		}
+		if (h.usr_ptr >= m_slots.size()) {
+			std::cerr << "Unexpected usr_ptr " << h.usr_ptr
+				  << '\n';
+			return -1;
+		}
+		res = rw_result(h);
+		return h.usr_ptr;
+	}
+
+	/* Wait until a command has completed. */
+	int wait() {
+		struct pollfd pfd = { m_fd, POLLIN, 0 };
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			std::cerr << "poll failed with errno " << errno
+				  << '\n';
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 * Transfer the data described by @v starting at @lba. Transfers
+	 * larger than max_transfer() are split into back-to-back commands,
+	 * each of which gets a slice of @v. Returns the number of bytes
+	 * transferred.
+	 */
+	ssize_t rw(bool write, uint64_t lba, const iovec_t &v) {
+		const size_t len = v.data_len();
+		const size_t max_segs = max_segs_per_cmd();
+
+		/* splitting can't make a scattered buffer flat */
+		if (m_is_bsg && v.size() > 1) {
+			std::cerr << "bsg doesn't support scattered buffers.\n";
+			return -1;
+		}
+
+		if (len <= m_max_transfer && v.size() <= max_segs) {
+			prep_rw(0, write, lba, v);
+			return execute(0);
+		}
+
+		size_t done = 0, seg = 0, off = 0;
+		while (done < len) {
+			size_t n = m_chunk.slice(v, seg, off, m_max_transfer,
+						 max_segs, m_block_size);
+			if (!n) {
+				std::cerr << max_segs
+					  << " segments are less than a block.\n";
+				return done ? done : -1;
+			}
+			prep_rw(0, write, lba + done / m_block_size, m_chunk);
+			ssize_t ret = execute(0);
+			if (ret < 0)
+				return done ? done : -1;
+			done += ret;
+			if ((size_t)ret < n)
+				break;
+		}
+		return done;
+	}
+
+private:
+	sg_session(const sg_session &);
+	sg_session &operator=(const sg_session &);
+
+	struct slot_t {
+		sg_io_hdr_t hdr;
+		struct sg_io_v4 hdr4;
+		bool v4;
+		uint8_t cdb[16];
+		unsigned char sense[32];
+	};
+
+	/*
+	 * Only bsg takes v4 headers with SG_IO, sg and SCSI block devices
+	 * fail anything but a v3 header. Issue the v4 command in @s as the
+	 * same v3 command there and copy the result back.
+	 */
+	ssize_t execute_v4_as_v3(slot_t &s) {
+		struct sg_io_v4 &h4 = s.hdr4;
+		sg_io_hdr_t &h = s.hdr;
+		const bool write = h4.dout_xfer_len != 0;
+
+		h = m_template;
+		h.cmdp = s.cdb;
+		h.cmd_len = h4.request_len;
+		h.sbp = s.sense;
+		h.pack_id = h4.usr_ptr;
+		h.timeout = h4.timeout;
+		h.dxfer_len = write ? h4.dout_xfer_len : h4.din_xfer_len;
+		h.iovec_count = write ? h4.dout_iovec_count :
+			h4.din_iovec_count;
+		h.dxferp = (void *)(uintptr_t)(write ? h4.dout_xferp :
+					       h4.din_xferp);
+		h.dxfer_direction = !h.dxfer_len ? SG_DXFER_NONE :
+			write ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
+		if (ioctl(m_fd, SG_IO, &h) < 0) {
+			std::cerr << cdb_name(s.cdb)
+				  << " ioctl failed with errno " << errno
+				  << '\n';
+			return -1;
+		}
+		h4.device_status = h.status;
+		h4.transport_status = h.host_status;
+		h4.driver_status = h.driver_status;
+		h4.response_len = h.sb_len_wr;
+		if (write)
+			h4.dout_resid = h.resid;
+		else
+			h4.din_resid = h.resid;
+		return rw_result(h4);
+	}
+
+	static bool is_bsg(const struct stat &st) {
+		char path[64], link[PATH_MAX];
+		ssize_t n;
+
+		snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/subsystem",
+			 major(st.st_rdev), minor(st.st_rdev));
+		n = readlink(path, link, sizeof(link) - 1);
+		if (n < 0)
+			return false;
+		link[n] = '\0';
+		const char *p = strrchr(link, '/');
+		return !strcmp(p ? p + 1 : link, "bsg");
+	}
+
+	/*
+	 * Set up @slot for the CDB of @cdb_len bytes in its CDB buffer, with
+	 * the data in @v going to the device if @write. v4 commands with a
+	 * single segment use a flat buffer, which bsg requires.
+	 */
+	void prep_cdb(unsigned slot, int cdb_len, bool write, const iovec_t &v,
+		      bool v4) {
+		slot_t &s = m_slots[slot];
+
+		s.v4 = v4;
+		if (!v4) {
+			sg_io_hdr_t &h = s.hdr;
+
+			h = m_template;
+			h.cmdp = s.cdb;
+			h.cmd_len = cdb_len;
+			h.dxfer_direction = !v.data_len() ? SG_DXFER_NONE :
+				write ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
+			h.iovec_count = v.size();
+			h.dxfer_len = v.data_len();
+			h.dxferp = const_cast<void*>(v.address());
+			h.sbp = s.sense;
+			h.pack_id = slot;
+			return;
+		}
+
+		struct sg_io_v4 &h = s.hdr4;
+		bool flat = v.size() == 1;
+		uint64_t xferp = flat ? (uintptr_t)v[0].iov_base :
+			(uintptr_t)v.address();
+
+		h = m_template4;
+		h.request = (uintptr_t)s.cdb;
+		h.request_len = cdb_len;
+		h.response = (uintptr_t)s.sense;
+		h.usr_ptr = slot;
+		h.request_extra = slot;
+		if (write) {
+			h.dout_iovec_count = flat ? 0 : v.size();
+			h.dout_xfer_len = v.data_len();
+			h.dout_xferp = xferp;
+		} else {
+			h.din_iovec_count = flat ? 0 : v.size();
+			h.din_xfer_len = v.data_len();
+			h.din_xferp = xferp;
+		}
+	}
+
+	/*
+	 * BLKSECTGET reports bytes for sg character devices and 512-byte
+	 * sectors for block devices. bsg doesn't have it.
+	 */
+	size_t query_max_transfer() const {
+		size_t max = 0;
+
+		if (m_is_chr) {
+			int bytes;
+
+			if (ioctl(m_fd, BLKSECTGET, &bytes) == 0 && bytes > 0)
+				max = bytes;
+		} else {
+			unsigned short sectors;
+
+			if (ioctl(m_fd, BLKSECTGET, &sectors) == 0 &&
+			    sectors > 0)
+				max = (size_t)sectors << 9;
+		}
+		if (max == 0)
+			max = default_max_transfer;
+		max -= max % m_block_size;
+		if (max / m_block_size > MAX_READ_WRITE_16_LENGTH)
+			max = (size_t)MAX_READ_WRITE_16_LENGTH * m_block_size;
+		return max ? max : m_block_size;
+	}
+
+	size_t query_max_segments() const {
+		struct stat st;
+		char path[128];
+		size_t max = 0;
+		int n;
+
+		if (m_is_chr) {
+			if (!m_is_bsg &&
+			    ioctl(m_fd, SG_GET_SG_TABLESIZE, &n) == 0 && n > 0)
+				max = n;
+		} else if (fstat(m_fd, &st) == 0) {
+			snprintf(path, sizeof(path),
+				 "/sys/dev/block/%u:%u/queue/max_segments",
+				 major(st.st_rdev), minor(st.st_rdev));
+			std::ifstream f(path);
+			if (f >> n && n > 0)
+				max = n;
+		}
+		return std::min(max ? max : max_iovecs, max_segs_per_cmd());
+	}
+
+	/*
+	 * Query the capacity and, if not known yet, the block size with READ
+	 * CAPACITY(10) or, for large devices, READ CAPACITY(16).
+	 */
+	bool read_capacity() {
+		uint8_t data[32];
+		uint64_t last_lba;
+		uint32_t bs;
+		iovec_t v;
+
+		v.append(data, 8);
+		memset(m_slots[0].cdb, 0, sizeof(m_slots[0].cdb));
+		m_slots[0].cdb[0] = 0x25;
+		prep_cdb(0, 10, false, v, m_v4);
+		if (execute(0) < 0)
+			return false;
+		last_lba = (uint32_t)(data[0] << 24 | data[1] << 16 |
+				      data[2] << 8 | data[3]);
+		bs = data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+
+		if (last_lba == MAX_READ_WRITE_10_LBA) {
+			v.clear();
+			v.append(data, sizeof(data));
+			memset(m_slots[0].cdb, 0, sizeof(m_slots[0].cdb));
+			m_slots[0].cdb[0] = 0x9e;
+			m_slots[0].cdb[1] = 0x10;
+			m_slots[0].cdb[13] = sizeof(data);
+			prep_cdb(0, 16, false, v, m_v4);
+			if (execute(0) < 0)
+				return false;
+			last_lba = 0;
+			for (int i = 0; i < 8; i++)
+				last_lba = last_lba << 8 | data[i];
+			bs = data[8] << 24 | data[9] << 16 | data[10] << 8 |
+				data[11];
+		}
+		if (!m_block_size)
+			m_block_size = bs;
+		m_capacity = last_lba + 1;
+		return m_block_size != 0;
+	}
+
+	const file_descriptor &m_fd;
+	unsigned m_block_size;
+	size_t m_max_transfer;
+	size_t m_max_segments;
+	uint64_t m_capacity;
+	bool m_is_chr;
+	bool m_is_bsg;
+	bool m_v4;
+	sg_io_hdr_t m_template;
+	struct sg_io_v4 m_template4;
+	std::vector<slot_t> m_slots;
+	iovec_t m_chunk;
+};
+
+static ssize_t sg_read(sg_session &s, uint64_t lba, const iovec_t &v)
+{
+	if (v.data_len() == 0 || (v.data_len() % s.block_size()) != 0)
+		return -1;
+
+	return s.rw(false, lba, v);
+}
+
+static ssize_t sg_write(sg_session &s, uint64_t lba, const iovec_t &v)
+{
 	if (v.data_len() == 0) {
 		std::cerr << "Write buffer is empty.\n";
 		return -1;
 	}
 
-	if ((v.data_len() % block_size) != 0) {
+	if ((v.data_len() % s.block_size()) != 0) {
 		std::cerr << "Write buffer size " << v.data_len()
 			  << " is not a multiple of the block size "
-			  << block_size << ".\n";
+			  << s.block_size() << ".\n";
 		return -1;
 	}
 
-	if (v.data_len() / block_size > MAX_READ_WRITE_6_LENGTH) {
-		std::cerr << "Write buffer size " << v.data_len()
-			  << " > " << MAX_READ_WRITE_6_LENGTH << ".\n";
+	return s.rw(true, lba, v);
+}
+
+/*
+ * Layout of the segments of a scattered buffer. By default, 4-byte
+ * segments at an 8-byte stride, each preceded by a 4-byte gap.
+ */
+struct scatter_pattern {
+	size_t seg_size = 4;
+	size_t stride = 8;
+	/* segment start alignment */
+	size_t align = 1;
+	/* let every segment straddle a page boundary */
+	bool page_cross = false;
+	/*
+	 * random segment sizes up to twice seg_size and random gaps up to
+	 * stride - seg_size
+	 */
+	bool random = false;
+	unsigned seed = 0;
+};
+
+static size_t round_up(size_t v, size_t a)
+{
+	return (v + a - 1) / a * a;
+}
+
+/*
+ * The (offset, length) pairs of the segments @pat spreads @len bytes over.
+ * Returns the end of the last segment.
+ */
+static size_t scatter_layout(size_t len, const scatter_pattern *pat,
+			     std::vector<std::pair<size_t, size_t> > &segs)
+{
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t end = 0;
+
+	segs.clear();
+	if (!pat) {
+		segs.push_back(std::make_pair(0, len));
+		end = len;
+	} else if (pat->random) {
+		std::mt19937 rng(pat->seed);
+		size_t max_gap = pat->stride > pat->seg_size ?
+			pat->stride - pat->seg_size : 0;
+		std::uniform_int_distribution<size_t>
+			size_dist(1, 2 * pat->seg_size),
+			gap_dist(0, max_gap);
+
+		for (size_t done = 0; done < len; ) {
+			size_t start = round_up(end + gap_dist(rng),
+						pat->align);
+			size_t n = std::min(size_dist(rng), len - done);
+
+			segs.push_back(std::make_pair(start, n));
+			end = start + n;
+			done += n;
+		}
+	} else {
+		size_t seg_size = std::max(pat->seg_size, (size_t)1);
+		size_t first, stride;
+
+		if (pat->page_cross) {
+			first = page_size - std::max(seg_size / 2, (size_t)1);
+			stride = round_up(seg_size + page_size, page_size);
+		} else {
+			first = pat->stride > seg_size ?
+				pat->stride - seg_size : 0;
+			stride = std::max(pat->stride, seg_size);
+		}
+		first = round_up(first, pat->align);
+		stride = round_up(stride, pat->align);
+		for (size_t done = 0; done < len; done += seg_size) {
+			size_t n = std::min(seg_size, len - done);
+
+			segs.push_back(std::make_pair(first, n));
+			end = first + n;
+			first += stride;
+		}
+	}
+	return end;
+}
+
+/*
+ * Set up @iov to describe @len bytes in @buf, either contiguous or, if
+ * @pat is not NULL, scattered as described by @pat. Resizes @buf as needed;
+ * the first segment is page aligned before applying the pattern.
+ */
+static void build_iov(std::vector<uint8_t> &buf, size_t len,
+		      const scatter_pattern *pat, iovec_t &iov)
+{
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	std::vector<std::pair<size_t, size_t> > segs;
+	size_t end = scatter_layout(len, pat, segs);
+
+	iov.clear();
+	buf.resize(end + page_size);
+	uint8_t *base = (uint8_t *)round_up((uintptr_t)&*buf.begin(),
+					    page_size);
+	for (auto p = segs.begin(); p != segs.end(); ++p)
+		iov.append(base + p->first, p->second);
+}
+
+/*
+ * A shared mapping of a payload file. The iovecs of a command point
+ * straight into it, so that the data doesn't go through iostreams.
+ */
+class file_mapping {
+public:
+	file_mapping()
+		: m_addr(MAP_FAILED), m_len(0)
+	{ }
+	~file_mapping()
+	{ if (m_addr != MAP_FAILED) munmap(m_addr, m_len); }
+	bool map(int fd, size_t len, bool writable) {
+		m_addr = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE :
+			      PROT_READ, MAP_SHARED, fd, 0);
+		if (m_addr == MAP_FAILED) {
+			perror("mmap");
+			return false;
+		}
+		m_len = len;
+		madvise(m_addr, m_len, MADV_SEQUENTIAL);
+		return true;
+	}
+	uint8_t *data() const
+	{ return (uint8_t *)m_addr; }
+
+private:
+	file_mapping(const file_mapping &);
+	file_mapping &operator=(const file_mapping &);
+
+	void *m_addr;
+	size_t m_len;
+};
+
+/*
+ * Like build_iov(), but the payload is contiguous at @base: only the
+ * segment sizes of @pat are kept, back to back.
+ */
+static void map_iov(uint8_t *base, size_t len, const scatter_pattern *pat,
+		    iovec_t &iov)
+{
+	std::vector<std::pair<size_t, size_t> > segs;
+	size_t off = 0;
+
+	scatter_layout(len, pat, segs);
+	iov.clear();
+	for (auto p = segs.begin(); p != segs.end(); ++p) {
+		iov.append(base + off, p->second);
+		off += p->second;
+	}
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* CPU time used by this process so far. */
+struct cpu_usage {
+	uint64_t usr_ns, sys_ns;
+
+	static cpu_usage now() {
+		struct rusage ru;
+
+		getrusage(RUSAGE_SELF, &ru);
+		return cpu_usage{ tv_ns(ru.ru_utime), tv_ns(ru.ru_stime) };
+	}
+	cpu_usage operator-(const cpu_usage &o) const {
+		return cpu_usage{ usr_ns - o.usr_ns, sys_ns - o.sys_ns };
+	}
+
+private:
+	static uint64_t tv_ns(const struct timeval &tv) {
+		return tv.tv_sec * 1000000000ull + tv.tv_usec * 1000ull;
+	}
+};
+
+/* Summary of a benchmark run, latencies and CPU times in microseconds. */
+struct bench_result {
+	size_t count, len;
+	double secs, iops, mibs;
+	double lat_min, lat_avg, lat_p50, lat_p99, lat_max;
+	double usr, sys;
+};
+
+/*
+ * Summarize the run of the commands of @len bytes whose latencies are in
+ * @lat. Returns false if nothing completed.
+ */
+static bool summarize(std::vector<uint64_t> &lat, size_t len,
+		      uint64_t elapsed_ns, const cpu_usage &cpu,
+		      bench_result &r)
+{
+	if (lat.empty() || !elapsed_ns)
+		return false;
+
+	std::sort(lat.begin(), lat.end());
+	uint64_t sum = 0;
+	for (auto l : lat)
+		sum += l;
+	auto pct = [&](double p) {
+		return lat[std::min(lat.size() - 1,
+				    (size_t)(lat.size() * p / 100))] / 1e3;
+	};
+
+	r.count = lat.size();
+	r.len = len;
+	r.secs = elapsed_ns / 1e9;
+	r.iops = r.count / r.secs;
+	r.mibs = r.count * len / r.secs / (1 << 20);
+	r.lat_min = lat.front() / 1e3;
+	r.lat_avg = sum / r.count / 1e3;
+	r.lat_p50 = pct(50);
+	r.lat_p99 = pct(99);
+	r.lat_max = lat.back() / 1e3;
+	r.usr = cpu.usr_ns / 1e3 / r.count;
+	r.sys = cpu.sys_ns / 1e3 / r.count;
+	return true;
+}
+
+static void print_summary(const char *what, const bench_result &r,
+			  const char *units = "commands",
+			  const char *unit = "command")
+{
+	std::cout << std::fixed << std::setprecision(1)
+		  << what << ": " << r.count << " " << units << " of " << r.len
+		  << " bytes in " << r.secs << " s, "
+		  << r.iops << (strcmp(unit, "command") ? " per s, " : " IOPS, ")
+		  << r.mibs << " MiB/s\n"
+		  << "latency (us): min " << r.lat_min
+		  << " avg " << r.lat_avg
+		  << " p50 " << r.lat_p50 << " p99 " << r.lat_p99
+		  << " max " << r.lat_max << '\n'
+		  << std::setprecision(2)
+		  << "cpu per " << unit << " (us): usr " << r.usr
+		  << " sys " << r.sys << '\n';
+}
+
+/*
+ * Check that commands of @len bytes in @segs segments can be issued as
+ * single commands starting at @lba for the benchmark modes.
+ */
+static bool check_bench_args(sg_session &s, uint64_t lba, size_t len,
+			     size_t segs, const char *mode)
+{
+	if (!s.is_sg() && !s.is_bsg()) {
+		std::cerr << mode << " mode requires an sg or bsg device.\n";
+		return false;
+	}
+	if (len == 0 || len % s.block_size() || len > s.max_transfer()) {
+		std::cerr << "Transfer size " << len
+			  << " must be a non-zero multiple of the block size "
+			  << s.block_size() << " and at most "
+			  << s.max_transfer() << ".\n";
+		return false;
+	}
+	if (segs > s.max_segs_per_cmd()) {
+		std::cerr << segs << " segments exceed the limit of "
+			  << s.max_segs_per_cmd() << " per command.\n";
+		return false;
+	}
+	if (s.capacity() < lba + len / s.block_size()) {
+		std::cerr << "Failed to query the capacity or LBA beyond "
+			  << "the end of the device.\n";
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Issue @count commands of @len bytes each through the sg v3 write()/read()
+ * interface, keeping up to one command per session slot outstanding.
+ * Commands go to consecutive LBAs starting at @lba and wrap around at the
+ * end of the device.
+ */
+static int sg_rw_async(sg_session &s, bool write, uint64_t lba, size_t len,
+		       const scatter_pattern *pat, unsigned long count)
+{
+	const unsigned depth = s.nr_slots();
+	const uint64_t blocks = len / s.block_size();
+	std::vector<std::vector<uint8_t> > bufs(depth);
+	std::vector<iovec_t> iovs(depth);
+	std::vector<uint64_t> start_ns(depth);
+	std::vector<unsigned> free_slots;
+	std::vector<uint64_t> lat;
+	unsigned long submitted = 0, completed = 0;
+	uint64_t next = lba, start;
+	bench_result r;
+	cpu_usage cpu;
+
+	for (unsigned i = 0; i < depth; i++) {
+		build_iov(bufs[i], len, pat, iovs[i]);
+		memset(&*bufs[i].begin(), 0xa5 ^ i, bufs[i].size());
+		free_slots.push_back(depth - 1 - i);
+	}
+	if (!check_bench_args(s, lba, len, iovs[0].size(), "Asynchronous"))
+		return -1;
+	if (!s.is_sg()) {
+		std::cerr << "Asynchronous mode requires an sg device.\n";
+		return -1;
+	}
+	lat.reserve(count);
+
+	cpu = cpu_usage::now();
+	start = now_ns();
+	while (completed < count) {
+		while (submitted < count && !free_slots.empty()) {
+			unsigned i = free_slots.back();
+			int ret;
+
+			if (next + blocks > s.capacity())
+				next = lba;
+			s.prep(i, write, next, iovs[i]);
+			start_ns[i] = now_ns();
+			ret = s.submit(i);
+			if (ret == -EAGAIN)
+				break;
+			if (ret < 0)
+				return -1;
+			free_slots.pop_back();
+			next += blocks;
+			submitted++;
+		}
+		if (free_slots.size() == depth) {
+			std::cerr << "Failed to queue any command.\n";
+			return -1;
+		}
+
+		if (s.wait() < 0)
+			return -1;
+
+		for (;;) {
+			ssize_t res;
+			int i = s.complete(res);
+
+			if (i == -EAGAIN)
+				break;
+			if (i < 0)
+				return -1;
+			lat.push_back(now_ns() - start_ns[i]);
+			if (res != (ssize_t)len)
+				return -1;
+			free_slots.push_back(i);
+			completed++;
+		}
+	}
+	if (summarize(lat, len, now_ns() - start, cpu_usage::now() - cpu, r))
+		print_summary(write ? "Async write" : "Async read", r);
+	return 0;
+}
+
+/* Generate the payload of a write, one byte per block suffices. */
+static void produce(const iovec_t &iov, uint8_t seed)
+{
+	for (size_t i = 0; i < iov.size(); i++)
+		memset(iov[i].iov_base, seed, iov[i].iov_len);
+}
+
+/* Consume the payload of a read. */
+static unsigned consume(const iovec_t &iov)
+{
+	unsigned sum = 0;
+
+	for (size_t i = 0; i < iov.size(); i++) {
+		const uint8_t *p = (const uint8_t *)iov[i].iov_base;
+
+		for (size_t j = 0; j < iov[i].iov_len; j++)
+			sum += p[j];
+	}
+	return sum;
+}
+
+/*
+ * Issue @count synchronous commands to consecutive LBAs from @lba, with the
+ * payload in @iov or, if @mmap_io, in the reserved buffer that @iov maps.
+ * If @touch, the payload is produced before each write and consumed after
+ * each read.
+ */
+static bool sg_rw_bench(sg_session &s, bool write, uint64_t lba,
+			const iovec_t &iov, bool mmap_io, bool touch,
+			unsigned long count, bench_result &r)
+{
+	const size_t len = iov.data_len();
+	const uint64_t blocks = len / s.block_size();
+	const uint64_t capacity = s.capacity();
+	std::vector<uint64_t> lat;
+	unsigned sum = 0;
+	uint64_t next = lba, start;
+	cpu_usage cpu;
+
+	lat.reserve(count);
+	cpu = cpu_usage::now();
+	start = now_ns();
+	for (unsigned long i = 0; i < count; i++) {
+		uint64_t t = now_ns();
+
+		if (next + blocks > capacity)
+			next = lba;
+		if (write && touch)
+			produce(iov, i);
+		if (mmap_io) {
+			sg_io_hdr_t &h = s.prep(0, write, next, iov);
+
+			h.flags |= SG_FLAG_MMAP_IO;
+			h.iovec_count = 0;
+			h.dxferp = NULL;
+		} else {
+			s.prep_rw(0, write, next, iov);
+		}
+		if (s.execute(0) != (ssize_t)len)
+			return false;
+		if (!write && touch)
+			sum += consume(iov);
+		lat.push_back(now_ns() - t);
+		next += blocks;
+	}
+	/* keep the compiler from optimizing consume() away */
+	if (sum == 1)
+		std::cerr << '\n';
+	return summarize(lat, len, now_ns() - start, cpu_usage::now() - cpu,
+			 r);
+}
+
+/*
+ * Compare SG_FLAG_MMAP_IO, where the payload is produced and consumed in
+ * the mmap()ed reserved buffer of the sg device, with transfers from and to
+ * a user space buffer described by an iovec list.
+ */
+static int sg_rw_mmap(const file_descriptor &fd, sg_session &s, bool write,
+		      uint64_t lba, size_t len, const scatter_pattern *pat,
+		      unsigned long count)
+{
+	std::vector<uint8_t> buf;
+	bench_result mmap_r, iov_r;
+	iovec_t iov;
+	int reserved;
+
+	build_iov(buf, len, pat, iov);
+	if (!check_bench_args(s, lba, len, iov.size(), "mmap"))
+		return -1;
+	if (!s.is_sg()) {
+		std::cerr << "mmap mode requires an sg device.\n";
 		return -1;
 	}
 
-	int sg_version;
-	if (ioctl(fd, SG_GET_VERSION_NUM, &sg_version) < 0) {
-		std::cerr << "SG_GET_VERSION_NUM ioctl failed with errno "
-			  << errno << '\n';
+	reserved = len;
+	if (ioctl(fd, SG_SET_RESERVED_SIZE, &reserved) < 0 ||
+	    ioctl(fd, SG_GET_RESERVED_SIZE, &reserved) < 0 ||
+	    (size_t)reserved < len) {
+		std::cerr << "Failed to reserve " << len << " bytes.\n";
 		return -1;
 	}
 
-	if (sg_version < 30000) {
-		std::cerr << "Error: sg version 3 is not supported\n";
+	void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			  0);
+	if (addr == MAP_FAILED) {
+		std::cerr << "mmap failed with errno " << errno << '\n';
 		return -1;
 	}
 
-	uint8_t write6[6] = {
-		0x0a, (uint8_t)(lba >> 16), (uint8_t)(lba >> 8),
-		(uint8_t)(lba), (uint8_t)(v.data_len() / block_size),
-		0
-	};
-	unsigned char sense_buffer[32];
-	sg_io_hdr_t h;
-
-	memset(&h, 0, sizeof(h));
-	h.interface_id = 'S';
-	h.cmdp = write6;
-	h.cmd_len = sizeof(write6);
-	h.dxfer_direction = SG_DXFER_TO_DEV;
-	h.iovec_count = v.size();
-	h.dxfer_len = v.data_len();
-	h.dxferp = const_cast<void*>(v.address());
-	h.sbp = sense_buffer;
-	h.mx_sb_len = sizeof(sense_buffer);
-	h.timeout = 1000;     /* 1000 millisecs == 1 second */
-	if (ioctl(fd, SG_IO, &h) < 0) {
-		std::cerr << "WRITE(6) ioctl failed with errno " << errno
+	iovec_t mapped;
+	mapped.append(addr, len);
+	bool ok = sg_rw_bench(s, write, lba, mapped, true, true, count,
+			      mmap_r);
+	munmap(addr, len);
+	if (!ok)
+		return -1;
+	print_summary(write ? "mmap write" : "mmap read", mmap_r);
+
+	if (!sg_rw_bench(s, write, lba, iov, false, true, count, iov_r))
+		return -1;
+	print_summary(write ? "iovec write" : "iovec read", iov_r);
+
+	std::cout << std::fixed << std::setprecision(2)
+		  << "mmap/iovec throughput: " << mmap_r.mibs / iov_r.mibs
+		  << "\n";
+	return 0;
+}
+
+/*
+ * Replay @count identical-size commands back to back without touching the
+ * payload, so that the CPU time per command is dominated by the submission
+ * path.
+ */
+static int sg_rw_loop(sg_session &s, bool write, uint64_t lba, size_t len,
+		      const scatter_pattern *pat, unsigned long count)
+{
+	std::vector<uint8_t> buf;
+	bench_result r;
+	iovec_t iov;
+
+	build_iov(buf, len, pat, iov);
+	if (!check_bench_args(s, lba, len, iov.size(), "Loop") ||
+	    !sg_rw_bench(s, write, lba, iov, false, false, count, r))
+		return -1;
+	print_summary(write ? "Loop write" : "Loop read", r);
+	return 0;
+}
+
+/*
+ * Replay @count commands of @len bytes for segment counts from 1 up to the
+ * device's max_segments, doubling each step. The segment size is @len
+ * divided by the segment count, and the gap between segments and their
+ * alignment come from @pat.
+ */
+static int sg_rw_sweep(sg_session &s, bool write, uint64_t lba, size_t len,
+		       const scatter_pattern &pat, unsigned long count)
+{
+	const size_t max_segs = std::min(s.max_segments(), len);
+	size_t gap = pat.stride > pat.seg_size ? pat.stride - pat.seg_size : 0;
+	std::vector<uint8_t> buf;
+	iovec_t iov;
+
+	if (!check_bench_args(s, lba, len, 1, "Sweep"))
+		return -1;
+
+	std::cout << "# max_segments " << s.max_segments() << '\n'
+		  << "segments\tseg_size\tIOPS\tavg_us\tp50_us\tp99_us\tusr_us\tsys_us\n";
+	for (size_t segs = 1; segs <= max_segs; segs *= 2) {
+		scatter_pattern p = pat;
+		bench_result r;
+
+		p.random = false;
+		p.page_cross = false;
+		p.seg_size = (len + segs - 1) / segs;
+		p.stride = p.seg_size + gap;
+		build_iov(buf, len, &p, iov);
+		if (!sg_rw_bench(s, write, lba, iov, false, false, count, r))
+			return -1;
+		std::cout << std::fixed << std::setprecision(1)
+			  << iov.size() << '\t' << p.seg_size << '\t'
+			  << r.iops << '\t' << r.lat_avg << '\t'
+			  << r.lat_p50 << '\t' << r.lat_p99 << '\t'
+			  << std::setprecision(2) << r.usr << '\t' << r.sys
 			  << '\n';
+	}
+	return 0;
+}
+
+/*
+ * Fill @len bytes at @p with the verify pattern of the blocks starting at
+ * @lba: every 8-byte word holds its LBA in the upper and its byte offset in
+ * the block in the lower 32 bits, so that misplaced data can be told apart
+ * from corrupted data.
+ */
+static void fill_verify_pattern(uint8_t *p, size_t len, uint64_t lba,
+				unsigned block_size)
+{
+	for (size_t off = 0; off + 8 <= len; off += 8) {
+		uint64_t v = (lba + off / block_size) << 32 | off % block_size;
+
+		memcpy(p + off, &v, sizeof(v));
+	}
+}
+
+/* Copy @len bytes from @src into the segments of @iov. */
+static void copy_to_iov(const iovec_t &iov, const uint8_t *src)
+{
+	for (size_t i = 0; i < iov.size(); i++) {
+		memcpy(iov[i].iov_base, src, iov[i].iov_len);
+		src += iov[i].iov_len;
+	}
+}
+
+/*
+ * Compare the segments of @iov with @exp. memcmp() is vectorized by the C
+ * library, so only a mismatching segment is compared byte by byte to find
+ * the first difference. Returns true if all data matches, otherwise stores
+ * the segment and byte offset in the transfer of the first mismatch.
+ */
+static bool compare_iov(const iovec_t &iov, const uint8_t *exp,
+			size_t &seg, size_t &offs)
+{
+	size_t pos = 0;
+
+	for (size_t i = 0; i < iov.size(); i++) {
+		const uint8_t *p = (const uint8_t *)iov[i].iov_base;
+		size_t n = iov[i].iov_len;
+
+		if (memcmp(p, exp + pos, n)) {
+			size_t j = 0;
+
+			while (p[j] == exp[pos + j])
+				j++;
+			seg = i;
+			offs = pos + j;
+			return false;
+		}
+		pos += n;
+	}
+	return true;
+}
+
+/*
+ * Write the verify pattern through the segments of @pat (or a contiguous
+ * buffer), read it back through a different layout and compare. Returns 0
+ * if the data read back matches.
+ */
+static int sg_verify(sg_session &s, uint64_t lba, size_t len,
+		     const scatter_pattern *pat)
+{
+	const unsigned bs = s.block_size();
+	std::vector<uint8_t> exp(len), wbuf, rbuf;
+	scatter_pattern rpat;
+	iovec_t wiov, riov;
+	size_t seg, offs;
+
+	if (len == 0 || len % bs) {
+		std::cerr << "Transfer size " << len
+			  << " must be a non-zero multiple of the block size "
+			  << bs << ".\n";
 		return -1;
 	}
-	uint32_t result = h.status | (h.msg_status << 8) |
-		(h.host_status << 16) | (h.driver_status << 24);
-	if (result) {
-		std::cerr << "WRITE(6) failed with status 0x" << std::hex
-			  << result << "\n";
-		if (h.status == 2) {
-			std::cerr << "Sense buffer:\n";
-			dumphex(std::cerr, sense_buffer, h.sb_len_wr);
+
+	/*
+	 * Never read back through the layout written with, a segment mapping
+	 * bug would cancel out: scattered writes are read back with random
+	 * segments of the same average size and contiguous ones with random
+	 * segments of unaligned sizes, about 8 per transfer. Sessions which
+	 * only take flat buffers read back into a separate flat buffer in
+	 * two commands, split a third of the way in, instead.
+	 */
+	const bool flat = s.max_segs_per_cmd() == 1;
+	if (pat) {
+		rpat = *pat;
+		rpat.seed = pat->seed + 1;
+	} else {
+		rpat.seg_size = std::max(len / 8, (size_t)1);
+		rpat.stride = rpat.seg_size + 64;
+	}
+	rpat.random = true;
+	build_iov(wbuf, len, pat, wiov);
+	build_iov(rbuf, len, flat ? NULL : &rpat, riov);
+
+	fill_verify_pattern(&*exp.begin(), len, lba, bs);
+	copy_to_iov(wiov, &*exp.begin());
+	memset(&*rbuf.begin(), 0, rbuf.size());
+
+	if (s.rw(true, lba, wiov) != (ssize_t)len) {
+		std::cerr << "Writing " << len << " bytes at LBA " << lba
+			  << " failed.\n";
+		return -1;
+	}
+	ssize_t read;
+	const size_t head = len / bs / 3 * bs;
+	if (flat && head) {
+		uint8_t *p = (uint8_t *)riov[0].iov_base;
+		iovec_t r1, r2;
+
+		r1.append(p, head);
+		r2.append(p + head, len - head);
+		read = s.rw(false, lba, r1);
+		if (read == (ssize_t)head) {
+			ssize_t n = s.rw(false, lba + head / bs, r2);
+
+			read = n < 0 ? -1 : read + n;
 		}
+	} else {
+		read = s.rw(false, lba, riov);
+	}
+	if (read < 0) {
+		std::cerr << "Reading " << len << " bytes at LBA " << lba
+			  << " failed.\n";
 		return -1;
 	}
-	return v.data_len() - h.resid;
+	if ((size_t)read < len)
+		riov.trunc(read);
+
+	if (!compare_iov(riov, &*exp.begin(), seg, offs)) {
+		const uint8_t *p = (const uint8_t *)riov[seg].iov_base;
+		size_t seg_start = 0;
+
+		for (size_t i = 0; i < seg; i++)
+			seg_start += riov[i].iov_len;
+		std::cout << "Mismatch in read segment " << seg << " of "
+			  << riov.size() << " at byte " << offs
+			  << " (LBA " << lba + offs / bs << " offset "
+			  << offs % bs << "): expected 0x" << std::hex
+			  << std::setfill('0') << std::setw(2)
+			  << (unsigned)exp[offs] << ", got 0x" << std::setw(2)
+			  << (unsigned)p[offs - seg_start] << std::dec
+			  << '\n';
+		return 1;
+	}
+	if ((size_t)read < len) {
+		std::cout << "Short read of " << read << "/" << len
+			  << " bytes\n";
+		return 1;
+	}
+	std::cout << "Verified " << len << " bytes at LBA " << lba << " ("
+		  << wiov.size() << " write segments, " << riov.size()
+		  << " read segments)\n";
+	return 0;
+}
+
+/*
+ * Issue @count v4 commands of @len bytes in batches of one command per
+ * session slot: queue the whole batch with SG_IOSUBMIT and then collect it
+ * with SG_IORECEIVE. Drivers without SG_IOSUBMIT, such as bsg and mainline
+ * sg, get every command of the batch issued with SG_IO instead, which sg
+ * only takes as a v3 header. Latencies are per batch.
+ */
+static int sg_v4_batch(sg_session &s, bool write, uint64_t lba, size_t len,
+		       const scatter_pattern *pat, unsigned long count)
+{
+	const unsigned batch = s.nr_slots();
+	const uint64_t blocks = len / s.block_size();
+	std::vector<std::vector<uint8_t> > bufs(batch);
+	std::vector<iovec_t> iovs(batch);
+	std::vector<uint64_t> lat;
+	bool async = true;
+	uint64_t next = lba, start;
+	unsigned long done = 0;
+	bench_result r;
+	cpu_usage cpu;
+
+	for (unsigned i = 0; i < batch; i++) {
+		build_iov(bufs[i], len, pat, iovs[i]);
+		memset(&*bufs[i].begin(), 0xa5 ^ i, bufs[i].size());
+	}
+	if (!check_bench_args(s, lba, len, iovs[0].size(), "Batch"))
+		return -1;
+	lat.reserve(count / batch + 1);
+
+	cpu = cpu_usage::now();
+	start = now_ns();
+	while (done < count) {
+		unsigned n = std::min<unsigned long>(batch, count - done);
+		uint64_t t = now_ns();
+		unsigned i;
+
+		for (i = 0; i < n; i++) {
+			if (next + blocks > s.capacity())
+				next = lba;
+			s.prep_v4(i, write, next, iovs[i]);
+			next += blocks;
+		}
+
+		for (i = 0; async && i < n; i++) {
+			int ret = s.submit_v4(i);
+
+			if (ret == -EOPNOTSUPP && i == 0 && done == 0) {
+				std::cerr << "SG_IOSUBMIT is not supported, "
+					  << "falling back to SG_IO.\n";
+				async = false;
+			} else if (ret < 0) {
+				return -1;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			ssize_t res;
+
+			if (async) {
+				if (s.receive_v4(res) < 0)
+					return -1;
+			} else {
+				res = s.execute(i);
+			}
+			if (res != (ssize_t)len)
+				return -1;
+		}
+		lat.push_back(now_ns() - t);
+		done += n;
+	}
+	if (!summarize(lat, batch * len, now_ns() - start,
+		       cpu_usage::now() - cpu, r))
+		return -1;
+	print_summary(write ? "v4 write" : "v4 read", r, "batches", "batch");
+	std::cout << std::fixed << std::setprecision(1)
+		  << "commands per second: " << done / r.secs
+		  << (async ? " (SG_IOSUBMIT)\n" : " (SG_IO)\n");
+	return 0;
 }
 
 static void usage()
 {
-	std::cout << "Usage: [-h] [-l <length_in_bytes>] [-o <lba_in_bytes>] [-s] [-w] <dev>\n";
+	std::cout << "Usage: [-h] [-l <length_in_bytes>] [-o <lba_in_bytes>] [-s] [-w] [-a <queue_depth> | -L | -m | --sweep | --verify | --batch <n>] [-n <count>]\n"
+		"       [--v4] [--seg-size <bytes>] [--stride <bytes>] [--align <bytes>] [--page-cross] [--seed <seed>]\n"
+		"       [--in-file <file> | --out-file <file>] <dev>\n"
+		"  -a: submit <count> (default 1000) commands of <length_in_bytes> to\n"
+		"      consecutive LBAs through the asynchronous sg v3 interface, keeping\n"
+		"      up to <queue_depth> outstanding, and print a throughput and\n"
+		"      latency summary. Requires an sg device.\n"
+		"  -L: replay <count> commands of <length_in_bytes> one at a time and\n"
+		"      report the CPU time per command. Requires an sg device.\n"
+		"  -m: submit <count> commands of <length_in_bytes> one at a time with\n"
+		"      SG_FLAG_MMAP_IO from the mmap()ed reserved buffer, then the same\n"
+		"      with the -s or contiguous iovec layout, and compare throughput.\n"
+		"      Requires an sg device.\n"
+		"  --sweep: like -L for 1, 2, 4, ... segments up to the max_segments of\n"
+		"      the device, printing one line per segment count.\n"
+		"  --verify: write an LBA-tagged pattern through the -s or contiguous\n"
+		"      layout, read it back through random segments that differ from\n"
+		"      the written ones and report the first mismatch. Exits with 1\n"
+		"      on a mismatch.\n"
+		"  --v4: use sg v4 headers, which are always used on bsg devices.\n"
+		"  --batch: submit <count> commands in batches of <n> with SG_IOSUBMIT\n"
+		"      and SG_IORECEIVE, or SG_IO where those aren't supported, and\n"
+		"      report per-batch latency. Implies --v4.\n"
+		"  -s: scatter the data over <seg-size> (default 4) byte segments at a\n"
+		"      <stride> (default 8) byte stride, each segment start aligned to\n"
+		"      <align> bytes. --page-cross lets every segment straddle a page\n"
+		"      boundary, --seed randomizes segment sizes and gaps. All of these\n"
+		"      imply -s.\n"
+		"  --in-file: write the payload from the mmap()ed file instead of\n"
+		"      stdin, all of it unless -l is given.\n"
+		"  --out-file: read into the mmap()ed file instead of to stdout.\n"
+		"      With either, the -s segment sizes are kept but the segments\n"
+		"      are laid out back to back in the mapping.\n";
 }
 
 int main(int argc, char **argv)
 {
-	bool scattered = false, write = false;
-	uint32_t offs = 0;
+	enum {
+		OPT_SEG_SIZE = 256,
+		OPT_STRIDE,
+		OPT_ALIGN,
+		OPT_PAGE_CROSS,
+		OPT_SEED,
+		OPT_SWEEP,
+		OPT_VERIFY,
+		OPT_V4,
+		OPT_BATCH,
+		OPT_IN_FILE,
+		OPT_OUT_FILE,
+	};
+	static const struct option longopts[] = {
+		{ "seg-size",	required_argument,	NULL, OPT_SEG_SIZE },
+		{ "stride",	required_argument,	NULL, OPT_STRIDE },
+		{ "align",	required_argument,	NULL, OPT_ALIGN },
+		{ "page-cross",	no_argument,		NULL, OPT_PAGE_CROSS },
+		{ "seed",	required_argument,	NULL, OPT_SEED },
+		{ "sweep",	no_argument,		NULL, OPT_SWEEP },
+		{ "verify",	no_argument,		NULL, OPT_VERIFY },
+		{ "v4",		no_argument,		NULL, OPT_V4 },
+		{ "batch",	required_argument,	NULL, OPT_BATCH },
+		{ "in-file",	required_argument,	NULL, OPT_IN_FILE },
+		{ "out-file",	required_argument,	NULL, OPT_OUT_FILE },
+		{ NULL, 0, NULL, 0 }
+	};
+	bool scattered = false, write = false, mmap_io = false, loop = false;
+	bool sweep = false, verify = false, v4 = false;
+	unsigned batch = 0;
+	scatter_pattern pat;
+	uint64_t offs = 0;
 	const char *dev;
 	int c;
 	std::vector<uint8_t> buf;
 	unsigned long len = 512;
+	bool have_len = false;
+	const char *in_file = NULL, *out_file = NULL;
+	unsigned depth = 0;
+	unsigned long count = 1000;
+	int ret = 0;
 
-	while ((c = getopt(argc, argv, "hl:o:sw")) != EOF) {
+	while ((c = getopt_long(argc, argv, "a:hl:Lmn:o:sw", longopts,
+				NULL)) != EOF) {
 		switch (c) {
-		case 'l': len = strtoul(optarg, NULL, 0); break;
-		case 'o': offs = strtoul(optarg, NULL, 0); break;
+		case 'a': depth = strtoul(optarg, NULL, 0); break;
+		case 'L': loop = true; break;
+		case 'm': mmap_io = true; break;
+		case 'n': count = strtoul(optarg, NULL, 0); break;
+		case 'l':
+			len = strtoul(optarg, NULL, 0);
+			have_len = true;
+			break;
+		case 'o': offs = strtoull(optarg, NULL, 0); break;
 		case 's': scattered = true; break;
 		case 'w': write = true; break;
-		default: usage(); goto out;
+		case OPT_SEG_SIZE:
+			pat.seg_size = strtoul(optarg, NULL, 0);
+			scattered = true;
+			break;
+		case OPT_STRIDE:
+			pat.stride = strtoul(optarg, NULL, 0);
+			scattered = true;
+			break;
+		case OPT_ALIGN:
+			pat.align = strtoul(optarg, NULL, 0);
+			scattered = true;
+			break;
+		case OPT_PAGE_CROSS:
+			pat.page_cross = true;
+			scattered = true;
+			break;
+		case OPT_SEED:
+			pat.seed = strtoul(optarg, NULL, 0);
+			pat.random = true;
+			scattered = true;
+			break;
+		case OPT_SWEEP: sweep = true; break;
+		case OPT_VERIFY: verify = true; break;
+		case OPT_V4: v4 = true; break;
+		case OPT_BATCH:
+			batch = strtoul(optarg, NULL, 0);
+			v4 = true;
+			break;
+		case OPT_IN_FILE: in_file = optarg; break;
+		case OPT_OUT_FILE: out_file = optarg; break;
+		default:
+			usage();
+			ret = c != 'h';
+			goto out;
 		}
 	}
 
 	if (argc - optind < 1) {
 		std::cerr << "Too few arguments.\n";
+		ret = 1;
+		goto out;
+	}
+	if (!pat.seg_size || !pat.align) {
+		std::cerr << "Segment size and alignment must not be zero.\n";
+		ret = 1;
 		goto out;
 	}
 
 	dev = argv[optind];
-	buf.resize(len);
 	{
-		file_descriptor fd(open(dev, O_RDONLY));
+		file_descriptor fd(open(dev, depth ? O_RDWR | O_NONBLOCK :
+					mmap_io || loop || sweep || verify ||
+					batch ?
+					O_RDWR :
+					O_RDONLY));
 		if (fd < 0) {
 			std::cerr << "Failed to open " << dev << "\n";
+			ret = 1;
 			goto out;
 		}
-		if (ioctl(fd, BLKSSZGET, &block_size) < 0) {
-			std::cerr << "Failed to query block size of " << dev
-				  << "\n";
+		sg_session s(fd, depth ? depth : batch ? batch : 1);
+		if (!s.probe(dev, v4)) {
+			ret = 1;
 			goto out;
 		}
-		if (offs % block_size) {
+		if (offs % s.block_size()) {
 			std::cerr << "LBA is not a multiple of the block size.\n";
+			ret = 1;
+			goto out;
+		}
+		const uint64_t lba = offs / s.block_size();
+		const scatter_pattern *p = scattered ? &pat : NULL;
+		if (depth) {
+			ret = sg_rw_async(s, write, lba, len, p, count) != 0;
+			goto out;
+		}
+		if (batch) {
+			ret = sg_v4_batch(s, write, lba, len, p, count) != 0;
+			goto out;
+		}
+		if (mmap_io) {
+			ret = sg_rw_mmap(fd, s, write, lba, len, p, count) != 0;
+			goto out;
+		}
+		if (loop) {
+			ret = sg_rw_loop(s, write, lba, len, p, count) != 0;
+			goto out;
+		}
+		if (sweep) {
+			ret = sg_rw_sweep(s, write, lba, len, pat, count) != 0;
+			goto out;
+		}
+		if (verify) {
+			ret = sg_verify(s, lba, len, p) != 0;
 			goto out;
 		}
 		iovec_t iov;
-		if (scattered) {
-			buf.resize(buf.size() * 2);
-			unsigned char *p = &*buf.begin();
-			for (int i = 0; i < len / 4; i++)
-				iov.append(p + 4 + i * 8,
-					   std::min(4ul, len - i * 4));
-		} else {
-			iov.append(&*buf.begin(), buf.size());
+		if (write && in_file) {
+			file_descriptor in(open(in_file, O_RDONLY));
+			file_mapping m;
+			struct stat st;
+
+			if (in < 0 || fstat(in, &st) < 0) {
+				std::cerr << "Failed to open " << in_file
+					  << "\n";
+				ret = 1;
+				goto out;
+			}
+			if (!have_len || (uint64_t)st.st_size < len)
+				len = st.st_size;
+			if (!len || !m.map(in, len, false)) {
+				ret = 1;
+				goto out;
+			}
+			map_iov(m.data(), len, p, iov);
+			ssize_t written = sg_write(s, lba, iov);
+			if (written >= 0)
+				std::cout << "Wrote " << written << "/"
+					  << iov.data_len()
+					  << " bytes of data.\n";
+			else
+				ret = 1;
+			goto out;
 		}
+		if (!write && out_file) {
+			file_descriptor o(open(out_file,
+					       O_RDWR | O_CREAT | O_TRUNC,
+					       0644));
+			file_mapping m;
+
+			if (o < 0 || ftruncate(o, len) < 0) {
+				std::cerr << "Failed to create " << out_file
+					  << "\n";
+				ret = 1;
+				goto out;
+			}
+			if (!m.map(o, len, true)) {
+				ret = 1;
+				goto out;
+			}
+			map_iov(m.data(), len, p, iov);
+			ssize_t read = sg_read(s, lba, iov);
+			if (read >= 0) {
+				std::cerr << "Read " << read
+					  << " bytes of data.\n";
+				if (ftruncate(o, read) < 0)
+					perror("ftruncate");
+			} else {
+				ret = 1;
+			}
+			goto out;
+		}
+		build_iov(buf, len, p, iov);
 		if (write) {
 			for (int i = 0; i < iov.size(); i++) {
-				sg_iovec_t& e = iov[i];
+				const sg_iovec_t& e = iov[i];
 				size_t prevgcount = std::cin.gcount();
 				if (!std::cin.read((char *)e.iov_base,
 						   e.iov_len)) {
-					e.iov_len = std::cin.gcount() -
-						prevgcount;
+					iov.set_len(i, std::cin.gcount() -
+						    prevgcount);
 					break;
 				}
 			}
-			ssize_t written = sg_write(fd, offs / block_size, iov);
+			ssize_t written = sg_write(s, lba, iov);
 			if (written >= 0)
 				std::cout << "Wrote " << written << "/"
 					  << iov.data_len()
 					  << " bytes of data.\n";
+			else
+				ret = 1;
 		} else {
-			ssize_t read = sg_read(fd, offs / block_size, iov);
+			ssize_t read = sg_read(s, lba, iov);
 			if (read >= 0) {
 				std::cerr << "Read " << read
 					  << " bytes of data:\n";
 				iov.trunc(read);
 				iov.write(std::cout);
+			} else {
+				ret = 1;
 			}
 		}
 	}
 
  out:
-	return 0;
+	return ret;
 }
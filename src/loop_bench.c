@@ -0,0 +1,578 @@
+// SPDX-License-Identifier: GPL-3.0+
+
+/*
+ * Loop device performance matrix.
+ *
+ * For every backing FILE, runs a time based random I/O workload with native
+ * Linux AIO against the file itself (O_DIRECT) and against a loop device on
+ * top of it, for every combination of loop logical block size, loop direct
+ * I/O on or off, I/O size and queue depth. Each cell reports IOPS,
+ * bandwidth and CPU usage, and the loop cells their IOPS relative to the raw
+ * file with the same I/O size and queue depth.
+ *
+ * The loop workers run in kernel threads, so besides the CPU time of this
+ * process the CPU time of the whole system during the cell is reported, both
+ * in percent of one CPU. The backing files should be fully written
+ * beforehand, reads of holes do not measure much.
+ */
+
+#define _GNU_SOURCE		/* O_DIRECT */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/aio_abi.h>
+#include <linux/fs.h>		/* BLKGETSIZE64 */
+#include <linux/loop.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+	__u32			fd;
+	__u32			block_size;
+	struct loop_info64	info;
+	__u64			__reserved[8];
+};
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+#define MAX_LIST	16
+
+struct bench_opts {
+	unsigned int block_sizes[MAX_LIST];
+	int nr_block_sizes;
+	unsigned int dio[MAX_LIST];
+	int nr_dio;
+	unsigned int io_sizes[MAX_LIST];
+	int nr_io_sizes;
+	unsigned int depths[MAX_LIST];
+	int nr_depths;
+	double runtime;
+	int write;
+};
+
+struct cell_result {
+	unsigned long long ios;
+	double secs;
+	double proc_cpu;	/* % of one CPU used by this process */
+	double sys_cpu;		/* % of one CPU used by the whole system */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long nr,
+			struct io_event *events)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+/* busy and total jiffies of all CPUs from the first line of /proc/stat */
+static int read_cpu_jiffies(unsigned long long *busy)
+{
+	unsigned long long v[8] = { };
+	FILE *f;
+	int n;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return -1;
+	n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+		   &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(f);
+	if (n < 4)
+		return -1;
+	/* everything but idle and iowait */
+	*busy = v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+	return 0;
+}
+
+static double rusage_secs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static unsigned long long xorshift64(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void prep_io(struct iocb *cb, int fd, int write, void *buf,
+		    unsigned int io_size, unsigned long long nr_blocks,
+		    unsigned long long *rnd)
+{
+	unsigned long long off = xorshift64(rnd) % nr_blocks * io_size;
+
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = fd;
+	cb->aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	cb->aio_buf = (unsigned long)buf;
+	cb->aio_nbytes = io_size;
+	cb->aio_offset = off;
+	cb->aio_data = (unsigned long)cb;
+}
+
+/* random I/O of io_size bytes at depth qd for runtime seconds */
+static int run_cell(int fd, unsigned long long size, unsigned int io_size,
+		    unsigned int qd, const struct bench_opts *o,
+		    struct cell_result *r)
+{
+	unsigned long long nr_blocks = size / io_size, rnd = 0x9e3779b97f4a7c15ULL;
+	unsigned long long busy_start, busy_end;
+	double start, cpu_start, end;
+	struct io_event *events;
+	struct iocb *cbs, **cbp;
+	aio_context_t ctx = 0;
+	unsigned int i, inflight = 0;
+	char *bufs = NULL;
+	int n, ret = -1, stop = 0;
+
+	if (!nr_blocks) {
+		fprintf(stderr, "%llu bytes are too small for %u byte I/O\n",
+			size, io_size);
+		return -1;
+	}
+
+	cbs = calloc(qd, sizeof(*cbs));
+	cbp = calloc(qd, sizeof(*cbp));
+	events = calloc(qd, sizeof(*events));
+	if (!cbs || !cbp || !events ||
+	    posix_memalign((void **)&bufs, 4096, (size_t)qd * io_size)) {
+		perror("alloc");
+		goto free;
+	}
+	memset(bufs, 0xa5, (size_t)qd * io_size);
+	if (io_setup(qd, &ctx) < 0) {
+		perror("io_setup");
+		goto free;
+	}
+
+	read_cpu_jiffies(&busy_start);
+	cpu_start = rusage_secs();
+	start = now();
+	end = start + o->runtime;
+	memset(r, 0, sizeof(*r));
+
+	for (i = 0; i < qd; i++) {
+		prep_io(&cbs[i], fd, o->write, bufs + (size_t)i * io_size,
+			io_size, nr_blocks, &rnd);
+		cbp[i] = &cbs[i];
+	}
+	if (io_submit(ctx, qd, cbp) != (int)qd) {
+		perror("io_submit");
+		goto destroy;
+	}
+	inflight = qd;
+
+	while (inflight) {
+		int nr_resubmit = 0;
+
+		n = io_getevents(ctx, 1, qd, events);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("io_getevents");
+			goto destroy;
+		}
+		inflight -= n;
+		if (!stop && now() >= end)
+			stop = 1;
+		for (i = 0; i < (unsigned int)n; i++) {
+			struct iocb *cb = (struct iocb *)(unsigned long)events[i].data;
+
+			if (events[i].res != io_size) {
+				fprintf(stderr, "I/O at %llu returned %lld\n",
+					(unsigned long long)cb->aio_offset,
+					(long long)events[i].res);
+				stop = 1;
+				ret = -2;
+				continue;
+			}
+			r->ios++;
+			if (stop)
+				continue;
+			prep_io(cb, fd, o->write, (void *)(unsigned long)cb->aio_buf,
+				io_size, nr_blocks, &rnd);
+			cbp[nr_resubmit++] = cb;
+		}
+		if (nr_resubmit) {
+			if (io_submit(ctx, nr_resubmit, cbp) != nr_resubmit) {
+				perror("io_submit");
+				/* what was submitted before is still inflight */
+				stop = 1;
+				ret = -2;
+				continue;
+			}
+			inflight += nr_resubmit;
+		}
+	}
+
+	r->secs = now() - start;
+	r->proc_cpu = (rusage_secs() - cpu_start) / r->secs * 100;
+	if (!read_cpu_jiffies(&busy_end))
+		r->sys_cpu = (busy_end - busy_start) /
+			(double)sysconf(_SC_CLK_TCK) / r->secs * 100;
+	if (ret == -1)
+		ret = 0;
+
+destroy:
+	io_destroy(ctx);
+free:
+	free(bufs);
+	free(events);
+	free(cbp);
+	free(cbs);
+	return ret;
+}
+
+static const char *fs_name(const char *path)
+{
+	static const struct {
+		unsigned long magic;
+		const char *name;
+	} fs[] = {
+		{ EXT4_SUPER_MAGIC, "ext4" },
+		{ XFS_SUPER_MAGIC, "xfs" },
+		{ BTRFS_SUPER_MAGIC, "btrfs" },
+		{ TMPFS_MAGIC, "tmpfs" },
+		{ F2FS_SUPER_MAGIC, "f2fs" },
+		{ NFS_SUPER_MAGIC, "nfs" },
+		{ OVERLAYFS_SUPER_MAGIC, "overlay" },
+	};
+	struct statfs sfs;
+	size_t i;
+
+	if (statfs(path, &sfs))
+		return "unknown";
+	for (i = 0; i < sizeof(fs) / sizeof(fs[0]); i++)
+		if ((unsigned long)sfs.f_type == fs[i].magic)
+			return fs[i].name;
+	return "unknown";
+}
+
+/* attach file_fd to a free loop device, returns the open loop device */
+static int loop_attach(int ctl, int file_fd, unsigned int block_size, int dio,
+		       int *nr)
+{
+	struct loop_config config;
+	char path[32];
+	int fd;
+
+	*nr = ioctl(ctl, LOOP_CTL_GET_FREE);
+	if (*nr < 0) {
+		perror("LOOP_CTL_GET_FREE");
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/dev/loop%d", *nr);
+	fd = open(path, O_RDWR | O_DIRECT | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.fd = file_fd;
+	config.block_size = block_size;
+	if (dio)
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+	if (!ioctl(fd, LOOP_CONFIGURE, &config))
+		return fd;
+	if (errno != EINVAL && errno != ENOTTY) {
+		perror("LOOP_CONFIGURE");
+		goto close;
+	}
+
+	/* kernels before 5.8 */
+	if (ioctl(fd, LOOP_SET_FD, file_fd) < 0) {
+		perror("LOOP_SET_FD");
+		goto close;
+	}
+	if (ioctl(fd, LOOP_SET_BLOCK_SIZE, block_size) < 0) {
+		perror("LOOP_SET_BLOCK_SIZE");
+		goto clear;
+	}
+	if (dio && ioctl(fd, LOOP_SET_DIRECT_IO, 1) < 0) {
+		perror("LOOP_SET_DIRECT_IO");
+		goto clear;
+	}
+	return fd;
+
+clear:
+	ioctl(fd, LOOP_CLR_FD);
+close:
+	close(fd);
+	return -1;
+}
+
+static void loop_detach(int ctl, int fd, int nr)
+{
+	ioctl(fd, LOOP_CLR_FD);
+	close(fd);
+	ioctl(ctl, LOOP_CTL_REMOVE, nr);
+}
+
+static void print_cell(const char *target, unsigned int block_size, int dio,
+		       unsigned int io_size, unsigned int qd,
+		       const struct cell_result *r, double raw_iops)
+{
+	double iops = r->ios / r->secs;
+	char lbs[16], ratio[16];
+
+	if (block_size)
+		snprintf(lbs, sizeof(lbs), "%u", block_size);
+	else
+		strcpy(lbs, "-");
+	if (raw_iops > 0)
+		snprintf(ratio, sizeof(ratio), "%.2f", iops / raw_iops);
+	else
+		strcpy(ratio, "-");
+	printf("%-6s %5s %4s %8u %4u %10.0f %9.1f %7.1f %7.1f %7s\n", target,
+	       lbs, block_size ? (dio ? "on" : "off") : "-", io_size, qd,
+	       iops, iops * io_size / (1 << 20), r->proc_cpu, r->sys_cpu,
+	       ratio);
+	fflush(stdout);
+}
+
+static int bench_file(const char *file, const struct bench_opts *o)
+{
+	double raw_iops[MAX_LIST][MAX_LIST];
+	struct cell_result r;
+	unsigned long long size;
+	int ctl, raw_fd, file_fd = -1, ret = 0;
+	int b, d, s, q;
+	struct stat st;
+
+	raw_fd = open(file, (o->write ? O_RDWR : O_RDONLY) | O_DIRECT |
+		      O_CLOEXEC);
+	if (raw_fd < 0 || fstat(raw_fd, &st)) {
+		perror(file);
+		return -1;
+	}
+	size = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(raw_fd, BLKGETSIZE64, &size)) {
+		perror("BLKGETSIZE64");
+		close(raw_fd);
+		return -1;
+	}
+
+	printf("# %s: %s, %llu bytes, random %s, %.1f s per cell\n", file,
+	       S_ISBLK(st.st_mode) ? "block device" : fs_name(file), size,
+	       o->write ? "writes" : "reads", o->runtime);
+	printf("%-6s %5s %4s %8s %4s %10s %9s %7s %7s %7s\n", "target", "lbs",
+	       "dio", "iosize", "qd", "IOPS", "MiB/s", "proc%", "sys%",
+	       "vs-raw");
+
+	for (s = 0; s < o->nr_io_sizes; s++) {
+		for (q = 0; q < o->nr_depths; q++) {
+			raw_iops[s][q] = 0;
+			posix_fadvise(raw_fd, 0, 0, POSIX_FADV_DONTNEED);
+			if (run_cell(raw_fd, size, o->io_sizes[s],
+				     o->depths[q], o, &r)) {
+				ret = -1;
+				continue;
+			}
+			raw_iops[s][q] = r.ios / r.secs;
+			print_cell("raw", 0, 0, o->io_sizes[s], o->depths[q],
+				   &r, 0);
+		}
+	}
+
+	ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+	if (ctl < 0) {
+		perror("/dev/loop-control");
+		close(raw_fd);
+		return -1;
+	}
+	/* buffered loop needs a backing fd without O_DIRECT */
+	file_fd = open(file, (o->write ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (file_fd < 0) {
+		perror(file);
+		ret = -1;
+		goto close;
+	}
+
+	for (b = 0; b < o->nr_block_sizes; b++) {
+		for (d = 0; d < o->nr_dio; d++) {
+			int loop_fd, nr;
+
+			loop_fd = loop_attach(ctl, file_fd, o->block_sizes[b],
+					      o->dio[d], &nr);
+			if (loop_fd < 0) {
+				ret = -1;
+				continue;
+			}
+			for (s = 0; s < o->nr_io_sizes; s++) {
+				if (o->io_sizes[s] % o->block_sizes[b])
+					continue;
+				for (q = 0; q < o->nr_depths; q++) {
+					/* start each cell with a cold page cache */
+					ioctl(loop_fd, BLKFLSBUF, 0);
+					posix_fadvise(file_fd, 0, 0,
+						      POSIX_FADV_DONTNEED);
+					if (run_cell(loop_fd, size,
+						     o->io_sizes[s],
+						     o->depths[q], o, &r)) {
+						ret = -1;
+						continue;
+					}
+					print_cell("loop", o->block_sizes[b],
+						   o->dio[d], o->io_sizes[s],
+						   o->depths[q], &r,
+						   raw_iops[s][q]);
+				}
+			}
+			loop_detach(ctl, loop_fd, nr);
+		}
+	}
+
+	close(file_fd);
+close:
+	close(ctl);
+	close(raw_fd);
+	return ret;
+}
+
+/* parse a comma separated list of unsigned integers */
+static int parse_list(const char *arg, unsigned int *list, int *nr)
+{
+	const char *p = arg;
+	char *end;
+
+	*nr = 0;
+	for (;;) {
+		unsigned long v;
+
+		errno = 0;
+		v = strtoul(p, &end, 0);
+		if (errno || end == p || *nr == MAX_LIST)
+			return -1;
+		list[(*nr)++] = v;
+		if (!*end)
+			return 0;
+		if (*end != ',')
+			return -1;
+		p = end + 1;
+	}
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [-b BLOCK_SIZES] [-D DIO] [-s IO_SIZES] [-q DEPTHS] [-t SECONDS] [-w] FILE [FILE...]\n"
+		"  Random I/O with native AIO against each FILE and against loop\n"
+		"  devices on it, for every combination of the comma separated\n"
+		"  lists of loop block sizes (default 512,1024,2048,4096), loop\n"
+		"  direct I/O settings (default 0,1), I/O sizes (default\n"
+		"  4096,65536) and queue depths (default 1,32), SECONDS (default\n"
+		"  5) per combination. -w writes instead of reading.\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o = {
+		.block_sizes = { 512, 1024, 2048, 4096 },
+		.nr_block_sizes = 4,
+		.dio = { 0, 1 },
+		.nr_dio = 2,
+		.io_sizes = { 4096, 65536 },
+		.nr_io_sizes = 2,
+		.depths = { 1, 32 },
+		.nr_depths = 2,
+		.runtime = 5,
+	};
+	int i, opt, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "b:D:q:s:t:w")) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_list(optarg, o.block_sizes, &o.nr_block_sizes))
+				usage(argv[0]);
+			break;
+		case 'D':
+			if (parse_list(optarg, o.dio, &o.nr_dio))
+				usage(argv[0]);
+			break;
+		case 'q':
+			if (parse_list(optarg, o.depths, &o.nr_depths))
+				usage(argv[0]);
+			break;
+		case 's':
+			if (parse_list(optarg, o.io_sizes, &o.nr_io_sizes))
+				usage(argv[0]);
+			break;
+		case 't':
+			o.runtime = strtod(optarg, NULL);
+			break;
+		case 'w':
+			o.write = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || o.runtime <= 0)
+		usage(argv[0]);
+	for (i = 0; i < o.nr_block_sizes; i++)
+		if (!o.block_sizes[i])
+			usage(argv[0]);
+	for (i = 0; i < o.nr_io_sizes; i++)
+		if (!o.io_sizes[i] || o.io_sizes[i] % 512)
+			usage(argv[0]);
+	for (i = 0; i < o.nr_depths; i++)
+		if (!o.depths[i])
+			usage(argv[0]);
+
+	for (i = optind; i < argc; i++) {
+		if (i > optind)
+			printf("\n");
+		if (bench_file(argv[i], &o))
+			ret = EXIT_FAILURE;
+	}
+	return ret;
+}
@@ -1,35 +1,299 @@
+#define _GNU_SOURCE		/* O_DIRECT */
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <linux/fs.h>		/* BLKGETSIZE64 */
 #include <linux/loop.h>
 
+/*
+ * With -n, readers keep random O_DIRECT reads running on LOOPDEV while the
+ * main thread swaps its backing file between the PATHs SWAPS times. The swap
+ * sequence number is odd while a LOOP_CHANGE_FD is in progress, so a reader
+ * can tell which swaps its read overlapped and account its latency as the
+ * stall of those swaps.
+ */
+struct swap_load {
+	int loop_fd;
+	unsigned long long size;
+	unsigned int bs;
+	int nr_swaps;
+
+	unsigned long seq;
+	int stop;
+	unsigned long long *stall_ns;	/* per swap */
+};
+
+struct reader {
+	pthread_t thread;
+	struct swap_load *load;
+	unsigned int seed;
+
+	unsigned long long reads, errors;
+	unsigned long long max_swap_ns, max_quiet_ns;
+	int first_err;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void atomic_max(unsigned long long *p, unsigned long long v)
+{
+	unsigned long long old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while (v > old &&
+	       !__atomic_compare_exchange_n(p, &old, v, 0, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+static void *reader_fn(void *arg)
+{
+	struct reader *r = arg;
+	struct swap_load *l = r->load;
+	unsigned long long nr_blocks = l->size / l->bs;
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, l->bs)) {
+		r->first_err = ENOMEM;
+		r->errors++;
+		return NULL;
+	}
+
+	while (!__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE)) {
+		off_t off = (off_t)(rand_r(&r->seed) % nr_blocks) * l->bs;
+		unsigned long seq0, seq1, s;
+		unsigned long long start, lat;
+		ssize_t ret;
+
+		seq0 = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+		start = now_ns();
+		ret = pread(l->loop_fd, buf, l->bs, off);
+		lat = now_ns() - start;
+		seq1 = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+
+		if (ret != (ssize_t)l->bs) {
+			if (!r->errors)
+				r->first_err = ret < 0 ? errno : EIO;
+			r->errors++;
+			continue;
+		}
+		r->reads++;
+
+		if (seq0 == seq1 && !(seq0 & 1)) {
+			if (lat > r->max_quiet_ns)
+				r->max_quiet_ns = lat;
+			continue;
+		}
+		if (lat > r->max_swap_ns)
+			r->max_swap_ns = lat;
+		/* swap k runs while seq is 2k + 1 */
+		for (s = seq0 / 2; s <= (seq1 - 1) / 2 && s < l->nr_swaps; s++)
+			atomic_max(&l->stall_ns[s], lat);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void print_lat(const char *what, const unsigned long long *ns, int n)
+{
+	unsigned long long min = ns[0], max = ns[0], sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (ns[i] < min)
+			min = ns[i];
+		if (ns[i] > max)
+			max = ns[i];
+		sum += ns[i];
+	}
+	printf("%s (us): min %.1f avg %.1f max %.1f\n", what, min / 1e3,
+	       sum / 1e3 / n, max / 1e3);
+}
+
+static int swap_under_load(const char *loopdev, char **paths, int nr_paths,
+			   int nr_swaps, int nr_threads, unsigned int bs,
+			   unsigned int interval_ms)
+{
+	struct swap_load l = { .bs = bs, .nr_swaps = nr_swaps };
+	unsigned long long *freeze_ns, reads = 0, errors = 0;
+	unsigned long long max_swap_ns = 0, max_quiet_ns = 0;
+	struct reader *readers;
+	int i, swap_errors = 0, ret = EXIT_FAILURE;
+
+	freeze_ns = calloc(nr_swaps, sizeof(*freeze_ns));
+	l.stall_ns = calloc(nr_swaps, sizeof(*l.stall_ns));
+	readers = calloc(nr_threads, sizeof(*readers));
+	if (!freeze_ns || !l.stall_ns || !readers) {
+		perror("calloc");
+		goto free;
+	}
+
+	/* LOOP_CHANGE_FD requires a read-only loop device */
+	l.loop_fd = open(loopdev, O_RDONLY | O_DIRECT);
+	if (l.loop_fd == -1) {
+		perror("open");
+		goto free;
+	}
+	if (ioctl(l.loop_fd, BLKGETSIZE64, &l.size) == -1) {
+		perror("BLKGETSIZE64");
+		goto close;
+	}
+	if (l.size < bs) {
+		fprintf(stderr, "%s is smaller than %u bytes\n", loopdev, bs);
+		goto close;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		readers[i].load = &l;
+		readers[i].seed = i + 1;
+		errno = pthread_create(&readers[i].thread, NULL, reader_fn,
+				       &readers[i]);
+		if (errno) {
+			perror("pthread_create");
+			nr_threads = i;
+			__atomic_store_n(&l.stop, 1, __ATOMIC_RELEASE);
+			goto join;
+		}
+	}
+
+	for (i = 0; i < nr_swaps; i++) {
+		const char *path = paths[i % nr_paths];
+		unsigned long long start;
+		int filefd;
+
+		usleep(interval_ms * 1000);
+		filefd = open(path, O_RDONLY);
+		if (filefd == -1) {
+			perror(path);
+			swap_errors++;
+			break;
+		}
+		__atomic_store_n(&l.seq, 2 * i + 1, __ATOMIC_RELEASE);
+		start = now_ns();
+		if (ioctl(l.loop_fd, LOOP_CHANGE_FD, filefd) == -1) {
+			fprintf(stderr, "LOOP_CHANGE_FD to %s: %s\n", path,
+				strerror(errno));
+			swap_errors++;
+		}
+		freeze_ns[i] = now_ns() - start;
+		__atomic_store_n(&l.seq, 2 * i + 2, __ATOMIC_RELEASE);
+		close(filefd);
+		if (swap_errors)
+			break;
+	}
+	nr_swaps = i;
+	usleep(interval_ms * 1000);
+	__atomic_store_n(&l.stop, 1, __ATOMIC_RELEASE);
+
+join:
+	for (i = 0; i < nr_threads; i++) {
+		struct reader *r = &readers[i];
+
+		pthread_join(r->thread, NULL);
+		reads += r->reads;
+		errors += r->errors;
+		if (r->errors)
+			fprintf(stderr, "reader %d: %llu errors, first: %s\n",
+				i, r->errors, strerror(r->first_err));
+		if (r->max_swap_ns > max_swap_ns)
+			max_swap_ns = r->max_swap_ns;
+		if (r->max_quiet_ns > max_quiet_ns)
+			max_quiet_ns = r->max_quiet_ns;
+	}
+
+	printf("%d swaps on %d threads, %llu read errors\n", nr_swaps,
+	       nr_threads, errors);
+	printf("reads: %llu, longest %.1f us during a swap, %.1f us otherwise\n",
+	       reads, max_swap_ns / 1e3, max_quiet_ns / 1e3);
+	if (nr_swaps) {
+		print_lat("freeze", freeze_ns, nr_swaps);
+		print_lat("stall", l.stall_ns, nr_swaps);
+	}
+	if (!errors && !swap_errors)
+		ret = EXIT_SUCCESS;
+
+close:
+	close(l.loop_fd);
+free:
+	free(readers);
+	free(l.stall_ns);
+	free(freeze_ns);
+	return ret;
+}
+
 void usage(const char *progname)
 {
-	fprintf(stderr, "usage: %s LOOPDEV PATH\n", progname);
+	fprintf(stderr,
+		"usage: %s LOOPDEV PATH\n"
+		"       %s -n SWAPS [-t THREADS] [-i INTERVAL_MS] [-b BS] LOOPDEV PATH [PATH...]\n"
+		"  With -n, keep BS (default 4096) byte random direct reads\n"
+		"  running on the read-only LOOPDEV from THREADS (default 4)\n"
+		"  threads while switching its backing file between the PATHs\n"
+		"  SWAPS times, INTERVAL_MS (default 10) apart, and report the\n"
+		"  LOOP_CHANGE_FD (freeze) time and the longest read overlapping\n"
+		"  each swap (stall).\n",
+		progname, progname);
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv)
 {
+	int nr_swaps = 0, nr_threads = 4, opt;
+	unsigned int bs = 4096, interval_ms = 10;
 	int ret;
 	int fd, filefd;
 
-	if (argc != 3)
+	while ((opt = getopt(argc, argv, "b:i:n:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_swaps = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nr_swaps) {
+		if (argc - optind < 2 || nr_swaps < 0 || nr_threads < 1 ||
+		    !bs || bs % 512)
+			usage(argv[0]);
+		return swap_under_load(argv[optind], argv + optind + 1,
+				       argc - optind - 1, nr_swaps, nr_threads,
+				       bs, interval_ms);
+	}
+
+	if (argc - optind != 2)
 		usage(argv[0]);
 
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open");
 		return EXIT_FAILURE;
 	}
 
-	filefd = open(argv[2], O_RDWR);
+	filefd = open(argv[optind + 1], O_RDWR);
 	if (filefd == -1) {
 		perror("open");
 		return EXIT_FAILURE;
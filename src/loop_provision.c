@@ -0,0 +1,418 @@
+// SPDX-License-Identifier: GPL-3.0+
+
+/*
+ * Loop device provisioning benchmark.
+ *
+ * Attaches a backing file to a number of loop devices allocated through
+ * /dev/loop-control, then detaches and removes them again, either with
+ * LOOP_CONFIGURE, which sets block size and direct I/O atomically, or with
+ * the legacy LOOP_SET_FD + LOOP_SET_STATUS64 + LOOP_SET_BLOCK_SIZE (+
+ * LOOP_SET_DIRECT_IO) sequence. Reports per-device latency of the setup
+ * ioctls, of the time until the device is ready, that is the setup ioctls
+ * have returned (including the partition scan with -P) and udev has
+ * processed every uevent they sent for the device and its partitions, and
+ * of the teardown.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/loop.h>
+#include <linux/netlink.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+	__u32			fd;
+	__u32			block_size;
+	struct loop_info64	info;
+	__u64			__reserved[8];
+};
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+/* how long to wait for a uevent before giving up on it */
+#define UEVENT_TIMEOUT_MS	5000
+
+/* uevent multicast groups: as sent by the kernel, and once udev is done */
+#define UEVENT_GROUP_KERNEL	1
+#define UEVENT_GROUP_UDEV	2
+
+struct prov_opts {
+	const char *file;
+	int nr_devs;
+	unsigned int block_size;
+	int direct_io;
+	int partscan;
+};
+
+struct prov_dev {
+	int nr;
+	int fd;
+	unsigned long long ioctl_ns, ready_ns, teardown_ns;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int uevent_open(int group)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = group,
+	};
+	int sock;
+
+	sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		      NETLINK_KOBJECT_UEVENT);
+	if (sock < 0)
+		return -1;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* drop the uevents of earlier devices */
+static void uevent_drain(int sock)
+{
+	char buf[8192];
+
+	while (recv(sock, buf, sizeof(buf), 0) > 0)
+		;
+}
+
+/*
+ * The value of property @key of the uevent in @buf, or NULL. Kernel and
+ * udev uevents both carry NUL separated KEY=value properties, after an
+ * "<action>@<devpath>" line or a binary header respectively.
+ */
+static const char *uevent_prop(const char *buf, size_t len, const char *key)
+{
+	size_t klen = strlen(key);
+	const char *p;
+
+	for (p = buf; p < buf + len; p += strlen(p) + 1)
+		if (!strncmp(p, key, klen) && p[klen] == '=')
+			return p + klen + 1;
+	return NULL;
+}
+
+/* The SEQNUM of a uevent about loop<nr> or one of its partitions, or 0. */
+static unsigned long long uevent_loop_seqnum(const char *buf, size_t len,
+					     int nr)
+{
+	const char *devpath = uevent_prop(buf, len, "DEVPATH");
+	const char *seqnum = uevent_prop(buf, len, "SEQNUM");
+	char name[32];
+	int nlen;
+
+	if (!devpath || !seqnum)
+		return 0;
+	nlen = snprintf(name, sizeof(name), "/block/loop%d", nr);
+	devpath = strstr(devpath, name);
+	if (!devpath || (devpath[nlen] && devpath[nlen] != '/'))
+		return 0;
+	return strtoull(seqnum, NULL, 10);
+}
+
+/*
+ * The last SEQNUM of the kernel uevents about loop<nr> queued on @sock, or
+ * 0. The kernel queues them synchronously, so once the setup ioctls have
+ * returned all of theirs are there.
+ */
+static unsigned long long uevent_last_seqnum(int sock, int nr)
+{
+	unsigned long long seqnum, last = 0;
+	char buf[8192];
+	ssize_t len;
+
+	while ((len = recv(sock, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		seqnum = uevent_loop_seqnum(buf, len, nr);
+		if (seqnum > last)
+			last = seqnum;
+	}
+	return last;
+}
+
+/*
+ * Wait until udev has processed the uevent @seqnum of loop<nr>. udev handles
+ * the uevents of a device and its partitions in order, so all earlier ones
+ * are done too. Returns 0 once it has, -1 on timeout or error.
+ */
+static int uevent_wait_udev(int sock, int nr, unsigned long long seqnum)
+{
+	unsigned long long deadline = now_ns() + UEVENT_TIMEOUT_MS * 1000000ULL;
+	char buf[8192];
+	ssize_t len;
+
+	for (;;) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		unsigned long long now = now_ns();
+
+		if (now >= deadline)
+			return -1;
+		if (poll(&pfd, 1, (deadline - now) / 1000000 + 1) <= 0)
+			return -1;
+		len = recv(sock, buf, sizeof(buf) - 1, 0);
+		if (len <= 0)
+			continue;
+		buf[len] = '\0';
+		if (uevent_loop_seqnum(buf, len, nr) >= seqnum)
+			return 0;
+	}
+}
+
+static int setup_configure(const struct prov_opts *o, int dev_fd, int file_fd)
+{
+	struct loop_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.fd = file_fd;
+	config.block_size = o->block_size;
+	if (o->direct_io)
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+	if (o->partscan)
+		config.info.lo_flags |= LO_FLAGS_PARTSCAN;
+	return ioctl(dev_fd, LOOP_CONFIGURE, &config);
+}
+
+static int setup_legacy(const struct prov_opts *o, int dev_fd, int file_fd)
+{
+	struct loop_info64 info;
+
+	if (ioctl(dev_fd, LOOP_SET_FD, file_fd) < 0)
+		return -1;
+	memset(&info, 0, sizeof(info));
+	if (o->partscan)
+		info.lo_flags |= LO_FLAGS_PARTSCAN;
+	if (ioctl(dev_fd, LOOP_SET_STATUS64, &info) < 0)
+		return -1;
+	if (o->block_size &&
+	    ioctl(dev_fd, LOOP_SET_BLOCK_SIZE, o->block_size) < 0)
+		return -1;
+	if (o->direct_io && ioctl(dev_fd, LOOP_SET_DIRECT_IO, 1) < 0)
+		return -1;
+	return 0;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_lat(const char *what, unsigned long long *lat, int n)
+{
+	unsigned long long sum = 0;
+	int i;
+
+	if (!n) {
+		printf("  %-9s n/a\n", what);
+		return;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_ull);
+	for (i = 0; i < n; i++)
+		sum += lat[i];
+	printf("  %-9s latency (us): min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+	       what, lat[0] / 1e3, sum / 1e3 / n, lat[n / 2] / 1e3,
+	       lat[(long long)n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+}
+
+static int run(const struct prov_opts *o, const char *mode,
+	       int (*setup)(const struct prov_opts *, int, int))
+{
+	struct prov_dev *devs;
+	unsigned long long *lat, start, t, setup_ns, teardown_ns;
+	int ctl, file_fd, kernel = -1, udev = -1, i, n, nr_ready = 0;
+	unsigned long long seqnum;
+	int ret = -1;
+	char path[32];
+
+	devs = calloc(o->nr_devs, sizeof(*devs));
+	lat = calloc(o->nr_devs, sizeof(*lat));
+	if (!devs || !lat) {
+		perror("calloc");
+		goto free;
+	}
+
+	ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+	if (ctl < 0) {
+		perror("/dev/loop-control");
+		goto free;
+	}
+	file_fd = open(o->file, O_RDWR | O_CLOEXEC);
+	if (file_fd < 0) {
+		perror(o->file);
+		goto close_ctl;
+	}
+	/* without udev there is nothing to wait for */
+	if (!access("/run/udev/control", F_OK)) {
+		kernel = uevent_open(UEVENT_GROUP_KERNEL);
+		udev = uevent_open(UEVENT_GROUP_UDEV);
+		if (kernel < 0 || udev < 0)
+			perror("uevent socket, not waiting for udev");
+	}
+
+	start = now_ns();
+	for (n = 0; n < o->nr_devs; n++) {
+		struct prov_dev *d = &devs[n];
+
+		d->nr = ioctl(ctl, LOOP_CTL_GET_FREE);
+		if (d->nr < 0) {
+			perror("LOOP_CTL_GET_FREE");
+			goto teardown;
+		}
+		snprintf(path, sizeof(path), "/dev/loop%d", d->nr);
+		d->fd = open(path, O_RDWR | O_CLOEXEC);
+		if (d->fd < 0) {
+			perror(path);
+			goto teardown;
+		}
+		if (kernel >= 0 && udev >= 0) {
+			uevent_drain(kernel);
+			uevent_drain(udev);
+		}
+
+		t = now_ns();
+		if (setup(o, d->fd, file_fd) < 0) {
+			fprintf(stderr, "%s: %s setup failed: %s\n", path, mode,
+				strerror(errno));
+			/* a half set up legacy device still needs LOOP_CLR_FD */
+			n++;
+			goto teardown;
+		}
+		d->ioctl_ns = now_ns() - t;
+		if (kernel >= 0 && udev >= 0 &&
+		    (seqnum = uevent_last_seqnum(kernel, d->nr)) &&
+		    !uevent_wait_udev(udev, d->nr, seqnum)) {
+			d->ready_ns = now_ns() - t;
+			nr_ready++;
+		}
+	}
+	setup_ns = now_ns() - start;
+	ret = 0;
+
+teardown:
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		struct prov_dev *d = &devs[i];
+		int tries;
+
+		if (d->fd < 0)
+			continue;
+		t = now_ns();
+		ioctl(d->fd, LOOP_CLR_FD);
+		close(d->fd);
+		/* the detach may complete on the last close, asynchronously */
+		for (tries = 0; tries < 1000; tries++) {
+			if (ioctl(ctl, LOOP_CTL_REMOVE, d->nr) >= 0 ||
+			    errno != EBUSY)
+				break;
+			usleep(1000);
+		}
+		d->teardown_ns = now_ns() - t;
+	}
+	teardown_ns = now_ns() - start;
+
+	if (!ret) {
+		printf("%s: %d devices, setup %.3f s, teardown %.3f s\n", mode,
+		       n, setup_ns / 1e9, teardown_ns / 1e9);
+		for (i = 0; i < n; i++)
+			lat[i] = devs[i].ioctl_ns;
+		print_lat("ioctl", lat, n);
+		for (i = 0, nr_ready = 0; i < n; i++)
+			if (devs[i].ready_ns)
+				lat[nr_ready++] = devs[i].ready_ns;
+		print_lat("ready", lat, nr_ready);
+		for (i = 0; i < n; i++)
+			lat[i] = devs[i].teardown_ns;
+		print_lat("teardown", lat, n);
+	}
+
+	if (udev >= 0)
+		close(udev);
+	if (kernel >= 0)
+		close(kernel);
+	close(file_fd);
+close_ctl:
+	close(ctl);
+free:
+	free(lat);
+	free(devs);
+	return ret;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [-n DEVICES] [-m configure|legacy|both] [-b BLOCK_SIZE] [-d] [-P] FILE\n"
+		"  Attach FILE to DEVICES (default 100) loop devices and tear them\n"
+		"  down again, with LOOP_CONFIGURE, the legacy ioctl sequence or\n"
+		"  both (default), with BLOCK_SIZE, direct I/O (-d) and partition\n"
+		"  scanning (-P), and report setup, ready and teardown latencies.\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct prov_opts o = { .nr_devs = 100 };
+	const char *mode = "both";
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "b:dm:n:P")) != -1) {
+		switch (opt) {
+		case 'b':
+			o.block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			o.direct_io = 1;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 'n':
+			o.nr_devs = atoi(optarg);
+			break;
+		case 'P':
+			o.partscan = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || o.nr_devs < 1 ||
+	    (strcmp(mode, "both") && strcmp(mode, "configure") &&
+	     strcmp(mode, "legacy")))
+		usage(argv[0]);
+	o.file = argv[optind];
+
+	if (strcmp(mode, "legacy"))
+		ret |= run(&o, "configure", setup_configure);
+	if (strcmp(mode, "configure"))
+		ret |= run(&o, "legacy", setup_legacy);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1220 @@
+// SPDX-License-Identifier: GPL-3.0+
+
+/*
+ * Minimal NBD server built on io_uring.
+ *
+ * Serves a single export from a file, a block device or anonymous memory.
+ * The fixed newstyle handshake (NBD_OPT_EXPORT_NAME, NBD_OPT_INFO,
+ * NBD_OPT_GO and NBD_OPT_LIST) is done with blocking I/O by the accepting
+ * thread, which then hands the connection to one of the worker threads. Each
+ * worker drives all of its connections through a single ring. Requests of a
+ * connection are received one after the other, executed concurrently and
+ * answered in completion order. Any export name is accepted and the export
+ * advertises NBD_FLAG_CAN_MULTI_CONN, so the kernel client can spread its
+ * connections over the workers.
+ *
+ * Payloads of file backed exports are read and written through buffers
+ * registered with the ring; memory backed exports receive and send payloads
+ * directly from the exported memory.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <liburing.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>		/* BLKGETSIZE64 */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * NBD protocol, see doc/proto.md of the NBD project. linux/nbd.h only
+ * describes what the kernel client needs, and older versions of it lack
+ * WRITE_ZEROES, so the server side is spelled out here.
+ */
+#define NBD_INIT_MAGIC		0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC		0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC	0x67446698
+
+/* handshake flags and client flags */
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+#define NBD_FLAG_C_NO_ZEROES	(1 << 1)
+
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+
+#define NBD_REP_ACK		1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_REP_ERR_INVALID	0x80000003
+
+#define NBD_INFO_EXPORT		0
+
+/* transmission flags */
+#define NBD_FLAG_HAS_FLAGS		(1 << 0)
+#define NBD_FLAG_READ_ONLY		(1 << 1)
+#define NBD_FLAG_SEND_FLUSH		(1 << 2)
+#define NBD_FLAG_SEND_FUA		(1 << 3)
+#define NBD_FLAG_SEND_TRIM		(1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES	(1 << 6)
+#define NBD_FLAG_CAN_MULTI_CONN		(1 << 8)
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+#define NBD_CMD_TRIM		4
+#define NBD_CMD_WRITE_ZEROES	6
+
+#define NBD_CMD_FLAG_FUA	(1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE	(1 << 1)
+
+/* longest option the handshake accepts */
+#define NBD_MAX_OPT_LEN		4096
+#define HANDSHAKE_TIMEOUT_S	10
+
+struct nbd_request {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	char cookie[8];
+	uint64_t from;
+	uint32_t len;
+} __attribute__((packed));
+
+struct nbd_simple_reply {
+	uint32_t magic;
+	uint32_t error;
+	char cookie[8];
+} __attribute__((packed));
+
+struct nbd_export {
+	const char *name;
+	int fd;			/* -1 for a memory backed export */
+	char *mem;
+	uint64_t size;
+	uint16_t flags;
+};
+
+enum slot_state {
+	SLOT_RECV_HDR,
+	SLOT_RECV_DATA,
+	SLOT_IO,
+	SLOT_IO_SYNC,		/* fdatasync after TRIM/WRITE_ZEROES with FUA */
+	SLOT_IO_ZERO,		/* WRITE_ZEROES emulated with writes */
+	SLOT_SEND,
+};
+
+struct nbd_conn;
+
+/* one request from its header to its reply */
+struct nbd_slot {
+	enum slot_state state;
+	struct nbd_conn *conn;
+	struct nbd_slot *next;		/* free list or send queue */
+
+	struct nbd_request req;
+	struct nbd_simple_reply reply;
+	uint16_t type, flags;
+	uint64_t from;
+	uint32_t len;
+	int error;
+
+	char *buf;			/* registered buffer of this slot */
+	int buf_index;			/* -1 if not registered */
+	char *tmp;			/* payloads larger than buf */
+	char *payload;
+	size_t done;
+
+	struct iovec iov[2];
+	struct msghdr msg;
+};
+
+struct nbd_conn {
+	int fd;
+	struct nbd_worker *w;
+	unsigned int refs;		/* slots working on this connection */
+	int closing, disc, waiting;
+	struct nbd_conn *next_waiting;
+	struct nbd_slot *send_head, *send_tail;
+	int sending;
+};
+
+struct nbd_worker {
+	pthread_t thread;
+	int idx;
+	const struct nbd_export *exp;
+	struct io_uring ring;
+	int pipe[2];			/* connections from the accepting thread */
+	int new_fd;
+
+	struct nbd_slot *slots, *free_slots;
+	struct nbd_conn *wait_head, *wait_tail;
+	unsigned int nr_slots;
+	size_t buf_size;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t ret = recv(fd, p, len, 0);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int send_opt_reply(int fd, uint32_t opt, uint32_t type,
+			  const void *data, uint32_t len)
+{
+	struct {
+		uint64_t magic;
+		uint32_t opt;
+		uint32_t type;
+		uint32_t len;
+	} __attribute__((packed)) hdr = {
+		.magic = htobe64(NBD_REP_MAGIC),
+		.opt = htobe32(opt),
+		.type = htobe32(type),
+		.len = htobe32(len),
+	};
+
+	if (write_all(fd, &hdr, sizeof(hdr)))
+		return -1;
+	return len ? write_all(fd, data, len) : 0;
+}
+
+/* returns 0 once the client entered the transmission phase, -1 otherwise */
+static int handshake(const struct nbd_export *exp, int fd)
+{
+	struct {
+		uint64_t magic;
+		uint64_t opts_magic;
+		uint16_t flags;
+	} __attribute__((packed)) greeting = {
+		.magic = htobe64(NBD_INIT_MAGIC),
+		.opts_magic = htobe64(NBD_OPTS_MAGIC),
+		.flags = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+	};
+	char data[NBD_MAX_OPT_LEN];
+	uint32_t client_flags;
+
+	if (write_all(fd, &greeting, sizeof(greeting)) ||
+	    read_all(fd, &client_flags, sizeof(client_flags)))
+		return -1;
+	client_flags = be32toh(client_flags);
+
+	for (;;) {
+		struct {
+			uint64_t magic;
+			uint32_t opt;
+			uint32_t len;
+		} __attribute__((packed)) hdr;
+		uint32_t opt, len;
+		int ret;
+
+		if (read_all(fd, &hdr, sizeof(hdr)) ||
+		    be64toh(hdr.magic) != NBD_OPTS_MAGIC)
+			return -1;
+		opt = be32toh(hdr.opt);
+		len = be32toh(hdr.len);
+		if (len > sizeof(data) || read_all(fd, data, len))
+			return -1;
+
+		switch (opt) {
+		case NBD_OPT_EXPORT_NAME: {
+			struct {
+				uint64_t size;
+				uint16_t flags;
+				char zeroes[124];
+			} __attribute__((packed)) reply = {
+				.size = htobe64(exp->size),
+				.flags = htobe16(exp->flags),
+			};
+
+			return write_all(fd, &reply,
+					 client_flags & NBD_FLAG_C_NO_ZEROES ?
+					 10 : sizeof(reply));
+		}
+		case NBD_OPT_ABORT:
+			send_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+			return -1;
+		case NBD_OPT_LIST: {
+			uint32_t name_len = strlen(exp->name);
+			char server[4 + NBD_MAX_OPT_LEN];
+
+			name_len = name_len < NBD_MAX_OPT_LEN ? name_len :
+				NBD_MAX_OPT_LEN;
+			*(uint32_t *)server = htobe32(name_len);
+			memcpy(server + 4, exp->name, name_len);
+			ret = send_opt_reply(fd, opt, NBD_REP_SERVER, server,
+					     4 + name_len) ||
+				send_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+			break;
+		}
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO: {
+			struct {
+				uint16_t type;
+				uint64_t size;
+				uint16_t flags;
+			} __attribute__((packed)) info = {
+				.type = htobe16(NBD_INFO_EXPORT),
+				.size = htobe64(exp->size),
+				.flags = htobe16(exp->flags),
+			};
+			uint32_t name_len;
+
+			/* name length, name, number of info requests, requests */
+			if (len < 6 ||
+			    (name_len = be32toh(*(uint32_t *)data)) > len - 6) {
+				ret = send_opt_reply(fd, opt, NBD_REP_ERR_INVALID,
+						     NULL, 0);
+				break;
+			}
+			if (send_opt_reply(fd, opt, NBD_REP_INFO, &info,
+					   sizeof(info)) ||
+			    send_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0))
+				return -1;
+			if (opt == NBD_OPT_GO)
+				return 0;
+			ret = 0;
+			break;
+		}
+		default:
+			ret = send_opt_reply(fd, opt, NBD_REP_ERR_UNSUP, NULL, 0);
+			break;
+		}
+		if (ret)
+			return -1;
+	}
+}
+
+static struct io_uring_sqe *get_sqe(struct nbd_worker *w)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&w->ring);
+
+	if (!sqe) {
+		io_uring_submit(&w->ring);
+		sqe = io_uring_get_sqe(&w->ring);
+	}
+	return sqe;
+}
+
+static void conn_recv_next(struct nbd_conn *conn);
+static void conn_send_next(struct nbd_conn *conn);
+
+static void conn_maybe_close(struct nbd_conn *conn)
+{
+	if ((!conn->closing && !conn->disc) || conn->refs || conn->waiting)
+		return;
+	close(conn->fd);
+	free(conn);
+}
+
+/* stop receiving and make the pending socket operations fail */
+static void conn_fail(struct nbd_conn *conn)
+{
+	if (conn->closing)
+		return;
+	conn->closing = 1;
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+static void put_slot(struct nbd_slot *slot)
+{
+	struct nbd_conn *conn = slot->conn;
+	struct nbd_worker *w = conn->w;
+
+	free(slot->tmp);
+	slot->tmp = NULL;
+	slot->conn = NULL;
+	slot->next = w->free_slots;
+	w->free_slots = slot;
+	conn->refs--;
+
+	/*
+	 * hand the slot to the first waiting connection which takes it, those
+	 * closing in the meantime leave it free for the next one
+	 */
+	while (w->free_slots && w->wait_head) {
+		struct nbd_conn *waiting = w->wait_head;
+
+		w->wait_head = waiting->next_waiting;
+		if (!w->wait_head)
+			w->wait_tail = NULL;
+		waiting->waiting = 0;
+		conn_recv_next(waiting);
+		if (waiting != conn)
+			conn_maybe_close(waiting);
+	}
+	conn_maybe_close(conn);
+}
+
+static void post_recv(struct nbd_slot *slot, void *buf, size_t len)
+{
+	struct io_uring_sqe *sqe = get_sqe(slot->conn->w);
+
+	io_uring_prep_recv(sqe, slot->conn->fd, buf, len, MSG_WAITALL);
+	io_uring_sqe_set_data(sqe, slot);
+}
+
+static void conn_recv_next(struct nbd_conn *conn)
+{
+	struct nbd_worker *w = conn->w;
+	struct nbd_slot *slot;
+
+	if (conn->closing || conn->disc || conn->waiting)
+		return;
+	slot = w->free_slots;
+	if (!slot) {
+		conn->waiting = 1;
+		conn->next_waiting = NULL;
+		if (w->wait_tail)
+			w->wait_tail->next_waiting = conn;
+		else
+			w->wait_head = conn;
+		w->wait_tail = conn;
+		return;
+	}
+	w->free_slots = slot->next;
+	slot->next = NULL;
+	slot->conn = conn;
+	conn->refs++;
+
+	slot->state = SLOT_RECV_HDR;
+	slot->done = 0;
+	post_recv(slot, &slot->req, sizeof(slot->req));
+}
+
+static void queue_reply(struct nbd_slot *slot)
+{
+	struct nbd_conn *conn = slot->conn;
+
+	slot->reply.magic = htobe32(NBD_SIMPLE_REPLY_MAGIC);
+	slot->reply.error = htobe32(slot->error);
+	memcpy(slot->reply.cookie, slot->req.cookie, sizeof(slot->reply.cookie));
+	slot->state = SLOT_SEND;
+	slot->done = 0;
+
+	slot->next = NULL;
+	if (conn->send_tail)
+		conn->send_tail->next = slot;
+	else
+		conn->send_head = slot;
+	conn->send_tail = slot;
+	if (!conn->sending)
+		conn_send_next(conn);
+}
+
+/* send the reply at the head of the send queue, resuming after slot->done */
+static void conn_send_next(struct nbd_conn *conn)
+{
+	struct nbd_slot *slot = conn->send_head;
+	struct io_uring_sqe *sqe;
+	size_t skip = slot->done;
+	int nr = 0;
+
+	if (skip < sizeof(slot->reply)) {
+		slot->iov[nr].iov_base = (char *)&slot->reply + skip;
+		slot->iov[nr++].iov_len = sizeof(slot->reply) - skip;
+		skip = 0;
+	} else {
+		skip -= sizeof(slot->reply);
+	}
+	if (slot->type == NBD_CMD_READ && !slot->error) {
+		slot->iov[nr].iov_base = slot->payload + skip;
+		slot->iov[nr++].iov_len = slot->len - skip;
+	}
+	memset(&slot->msg, 0, sizeof(slot->msg));
+	slot->msg.msg_iov = slot->iov;
+	slot->msg.msg_iovlen = nr;
+
+	conn->sending = 1;
+	sqe = get_sqe(conn->w);
+	io_uring_prep_sendmsg(sqe, conn->fd, &slot->msg, MSG_NOSIGNAL);
+	io_uring_sqe_set_data(sqe, slot);
+}
+
+static void handle_send(struct nbd_slot *slot, int res)
+{
+	struct nbd_conn *conn = slot->conn;
+	size_t total = sizeof(slot->reply);
+
+	if (slot->type == NBD_CMD_READ && !slot->error)
+		total += slot->len;
+
+	if (res <= 0) {
+		conn_fail(conn);
+	} else {
+		slot->done += res;
+		if (slot->done < total) {
+			conn_send_next(conn);
+			return;
+		}
+	}
+
+	conn->send_head = slot->next;
+	if (!conn->send_head)
+		conn->send_tail = NULL;
+	conn->sending = 0;
+	/* a failed connection drops its remaining replies */
+	if (conn->closing) {
+		while (conn->send_head) {
+			struct nbd_slot *next = conn->send_head->next;
+
+			put_slot(conn->send_head);
+			conn->send_head = next;
+		}
+		conn->send_tail = NULL;
+	} else if (conn->send_head) {
+		conn_send_next(conn);
+	}
+	put_slot(slot);
+}
+
+static int nbd_errno(int err)
+{
+	switch (err) {
+	case EPERM:
+	case EIO:
+	case ENOMEM:
+	case EINVAL:
+	case ENOSPC:
+	case EOVERFLOW:
+	case ENOTSUP:
+	case ESHUTDOWN:
+		return err;
+	default:
+		return EIO;
+	}
+}
+
+static void post_rw(struct nbd_slot *slot, int write)
+{
+	struct nbd_worker *w = slot->conn->w;
+	const struct nbd_export *exp = w->exp;
+	struct io_uring_sqe *sqe = get_sqe(w);
+	char *buf = slot->payload + slot->done;
+	unsigned int len = slot->len - slot->done;
+	uint64_t off = slot->from + slot->done;
+
+	if (slot->payload == slot->buf && slot->buf_index >= 0) {
+		if (write)
+			io_uring_prep_write_fixed(sqe, exp->fd, buf, len, off,
+						  slot->buf_index);
+		else
+			io_uring_prep_read_fixed(sqe, exp->fd, buf, len, off,
+						 slot->buf_index);
+	} else {
+		if (write)
+			io_uring_prep_write(sqe, exp->fd, buf, len, off);
+		else
+			io_uring_prep_read(sqe, exp->fd, buf, len, off);
+	}
+	if (write && (slot->flags & NBD_CMD_FLAG_FUA))
+		sqe->rw_flags = RWF_DSYNC;
+	io_uring_sqe_set_data(sqe, slot);
+}
+
+static void post_sync(struct nbd_slot *slot, enum slot_state state)
+{
+	struct io_uring_sqe *sqe = get_sqe(slot->conn->w);
+
+	slot->state = state;
+	io_uring_prep_fsync(sqe, slot->conn->w->exp->fd,
+			    IORING_FSYNC_DATASYNC);
+	io_uring_sqe_set_data(sqe, slot);
+}
+
+static void post_fallocate(struct nbd_slot *slot)
+{
+	struct io_uring_sqe *sqe = get_sqe(slot->conn->w);
+	int mode = FALLOC_FL_KEEP_SIZE;
+
+	/* punched holes read back as zeroes too */
+	if (slot->type == NBD_CMD_TRIM ||
+	    !(slot->flags & NBD_CMD_FLAG_NO_HOLE))
+		mode |= FALLOC_FL_PUNCH_HOLE;
+	else
+		mode |= FALLOC_FL_ZERO_RANGE;
+	io_uring_prep_fallocate(sqe, slot->conn->w->exp->fd, mode, slot->from,
+				slot->len);
+	io_uring_sqe_set_data(sqe, slot);
+}
+
+/* WRITE_ZEROES without fallocate() support: write a zeroed buffer */
+static void post_zero_write(struct nbd_slot *slot)
+{
+	struct nbd_worker *w = slot->conn->w;
+	size_t len = slot->len - slot->done;
+	struct io_uring_sqe *sqe = get_sqe(w);
+
+	if (len > w->buf_size)
+		len = w->buf_size;
+	slot->state = SLOT_IO_ZERO;
+	if (slot->buf_index >= 0)
+		io_uring_prep_write_fixed(sqe, w->exp->fd, slot->buf, len,
+					  slot->from + slot->done,
+					  slot->buf_index);
+	else
+		io_uring_prep_write(sqe, w->exp->fd, slot->buf, len,
+				    slot->from + slot->done);
+	io_uring_sqe_set_data(sqe, slot);
+}
+
+static void dispatch(struct nbd_slot *slot)
+{
+	const struct nbd_export *exp = slot->conn->w->exp;
+
+	slot->done = 0;
+	if (slot->error) {
+		queue_reply(slot);
+		return;
+	}
+
+	if (exp->fd < 0) {
+		/* reads and writes went straight to exp->mem */
+		if (slot->type == NBD_CMD_TRIM ||
+		    slot->type == NBD_CMD_WRITE_ZEROES)
+			memset(exp->mem + slot->from, 0, slot->len);
+		queue_reply(slot);
+		return;
+	}
+
+	slot->state = SLOT_IO;
+	switch (slot->type) {
+	case NBD_CMD_READ:
+		post_rw(slot, 0);
+		break;
+	case NBD_CMD_WRITE:
+		post_rw(slot, 1);
+		break;
+	case NBD_CMD_FLUSH:
+		post_sync(slot, SLOT_IO);
+		break;
+	case NBD_CMD_TRIM:
+	case NBD_CMD_WRITE_ZEROES:
+		if (!slot->len) {
+			queue_reply(slot);
+			break;
+		}
+		post_fallocate(slot);
+		break;
+	}
+}
+
+static void handle_io(struct nbd_slot *slot, int res)
+{
+	if (res == -EINTR || res == -EAGAIN) {
+		if (slot->state == SLOT_IO_ZERO)
+			post_zero_write(slot);
+		else if (slot->state == SLOT_IO_SYNC)
+			post_sync(slot, SLOT_IO_SYNC);
+		else if (slot->type == NBD_CMD_READ ||
+			 slot->type == NBD_CMD_WRITE)
+			post_rw(slot, slot->type == NBD_CMD_WRITE);
+		else
+			dispatch(slot);
+		return;
+	}
+
+	switch (slot->state) {
+	case SLOT_IO:
+		if (slot->type == NBD_CMD_READ || slot->type == NBD_CMD_WRITE) {
+			if (res < 0)
+				break;
+			/* beyond the end of a shrunk backing file */
+			if (!res && slot->type == NBD_CMD_READ) {
+				memset(slot->payload + slot->done, 0,
+				       slot->len - slot->done);
+				res = slot->len - slot->done;
+			}
+			slot->done += res;
+			if (slot->done < slot->len && res) {
+				post_rw(slot, slot->type == NBD_CMD_WRITE);
+				return;
+			}
+			res = slot->done == slot->len ? 0 : -EIO;
+			break;
+		}
+		if (slot->type == NBD_CMD_FLUSH)
+			break;
+		/* TRIM is advisory, WRITE_ZEROES falls back to writes */
+		if (res == -EOPNOTSUPP || res == -EINVAL) {
+			if (slot->type == NBD_CMD_TRIM) {
+				res = 0;
+			} else {
+				memset(slot->buf, 0, slot->conn->w->buf_size);
+				slot->done = 0;
+				post_zero_write(slot);
+				return;
+			}
+		}
+		if (!res && (slot->flags & NBD_CMD_FLAG_FUA)) {
+			post_sync(slot, SLOT_IO_SYNC);
+			return;
+		}
+		break;
+	case SLOT_IO_ZERO:
+		if (res <= 0) {
+			res = res ? res : -EIO;
+			break;
+		}
+		slot->done += res;
+		if (slot->done < slot->len) {
+			post_zero_write(slot);
+			return;
+		}
+		if (slot->flags & NBD_CMD_FLAG_FUA) {
+			post_sync(slot, SLOT_IO_SYNC);
+			return;
+		}
+		res = 0;
+		break;
+	default:
+		break;
+	}
+
+	slot->error = res < 0 ? nbd_errno(-res) : 0;
+	queue_reply(slot);
+}
+
+/* point the payload at the memory it is received into or sent from */
+static int setup_payload(struct nbd_slot *slot)
+{
+	const struct nbd_export *exp = slot->conn->w->exp;
+
+	if (exp->fd < 0 && !slot->error) {
+		slot->payload = exp->mem + slot->from;
+	} else if (slot->len <= slot->conn->w->buf_size) {
+		slot->payload = slot->buf;
+	} else {
+		slot->tmp = malloc(slot->len);
+		if (!slot->tmp)
+			return -1;
+		slot->payload = slot->tmp;
+	}
+	return 0;
+}
+
+static void handle_header(struct nbd_slot *slot)
+{
+	struct nbd_conn *conn = slot->conn;
+	const struct nbd_export *exp = conn->w->exp;
+
+	if (be32toh(slot->req.magic) != NBD_REQUEST_MAGIC) {
+		fprintf(stderr, "bad request magic\n");
+		conn_fail(conn);
+		put_slot(slot);
+		return;
+	}
+	slot->type = be16toh(slot->req.type);
+	slot->flags = be16toh(slot->req.flags);
+	slot->from = be64toh(slot->req.from);
+	slot->len = be32toh(slot->req.len);
+	slot->error = 0;
+
+	switch (slot->type) {
+	case NBD_CMD_DISC:
+		conn->disc = 1;
+		put_slot(slot);
+		return;
+	case NBD_CMD_READ:
+	case NBD_CMD_WRITE:
+	case NBD_CMD_TRIM:
+	case NBD_CMD_WRITE_ZEROES:
+		if (slot->from > exp->size || slot->len > exp->size - slot->from)
+			slot->error = EINVAL;
+		else if (slot->type != NBD_CMD_READ &&
+			 (exp->flags & NBD_FLAG_READ_ONLY))
+			slot->error = EPERM;
+		break;
+	case NBD_CMD_FLUSH:
+		if (exp->flags & NBD_FLAG_READ_ONLY)
+			slot->error = EPERM;
+		break;
+	default:
+		slot->error = EINVAL;
+		break;
+	}
+
+	if (slot->type == NBD_CMD_READ || slot->type == NBD_CMD_WRITE) {
+		if (setup_payload(slot)) {
+			fprintf(stderr, "no memory for a %u byte payload\n",
+				slot->len);
+			conn_fail(conn);
+			put_slot(slot);
+			return;
+		}
+	}
+	/* the payload of a write is received even if the write fails */
+	if (slot->type == NBD_CMD_WRITE && slot->len) {
+		slot->state = SLOT_RECV_DATA;
+		slot->done = 0;
+		post_recv(slot, slot->payload, slot->len);
+		return;
+	}
+	conn_recv_next(conn);
+	dispatch(slot);
+}
+
+static void handle_recv(struct nbd_slot *slot, int res)
+{
+	struct nbd_conn *conn = slot->conn;
+	size_t total = slot->state == SLOT_RECV_HDR ? sizeof(slot->req) :
+		slot->len;
+
+	if (res <= 0) {
+		if (res < 0 && res != -ECONNRESET && !conn->closing)
+			fprintf(stderr, "recv: %s\n", strerror(-res));
+		conn_fail(conn);
+		put_slot(slot);
+		return;
+	}
+	slot->done += res;
+	if (slot->done < total) {
+		if (slot->state == SLOT_RECV_HDR)
+			post_recv(slot, (char *)&slot->req + slot->done,
+				  total - slot->done);
+		else
+			post_recv(slot, slot->payload + slot->done,
+				  total - slot->done);
+		return;
+	}
+
+	if (slot->state == SLOT_RECV_HDR) {
+		handle_header(slot);
+	} else {
+		conn_recv_next(conn);
+		dispatch(slot);
+	}
+}
+
+static void post_new_conn_read(struct nbd_worker *w)
+{
+	struct io_uring_sqe *sqe = get_sqe(w);
+
+	io_uring_prep_read(sqe, w->pipe[0], &w->new_fd, sizeof(w->new_fd), 0);
+	io_uring_sqe_set_data(sqe, NULL);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct nbd_worker *w = arg;
+
+	post_new_conn_read(w);
+	for (;;) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, nr = 0;
+		int ret;
+
+		ret = io_uring_submit_and_wait(&w->ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "io_uring_submit_and_wait: %s\n",
+				strerror(-ret));
+			break;
+		}
+
+		io_uring_for_each_cqe(&w->ring, head, cqe) {
+			struct nbd_slot *slot = io_uring_cqe_get_data(cqe);
+
+			nr++;
+			if (!slot) {
+				struct nbd_conn *conn;
+
+				/* the accepting thread closed the pipe */
+				if (cqe->res != sizeof(w->new_fd))
+					goto out;
+				conn = calloc(1, sizeof(*conn));
+				if (!conn) {
+					close(w->new_fd);
+				} else {
+					conn->fd = w->new_fd;
+					conn->w = w;
+					conn_recv_next(conn);
+				}
+				post_new_conn_read(w);
+				continue;
+			}
+
+			switch (slot->state) {
+			case SLOT_RECV_HDR:
+			case SLOT_RECV_DATA:
+				handle_recv(slot, cqe->res);
+				break;
+			case SLOT_IO:
+			case SLOT_IO_SYNC:
+			case SLOT_IO_ZERO:
+				handle_io(slot, cqe->res);
+				break;
+			case SLOT_SEND:
+				handle_send(slot, cqe->res);
+				break;
+			}
+		}
+		io_uring_cq_advance(&w->ring, nr);
+	}
+out:
+	return NULL;
+}
+
+static int worker_init(struct nbd_worker *w, const struct nbd_export *exp,
+		       unsigned int nr_slots, size_t buf_size)
+{
+	struct iovec *iovs;
+	char *bufs;
+	unsigned int i;
+	int ret;
+
+	w->exp = exp;
+	w->nr_slots = nr_slots;
+	w->buf_size = buf_size;
+
+	if (pipe2(w->pipe, O_CLOEXEC)) {
+		perror("pipe2");
+		return -1;
+	}
+	/* every slot has at most one operation in flight, plus the pipe */
+	ret = io_uring_queue_init(nr_slots + 1, &w->ring, 0);
+	if (ret) {
+		fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	w->slots = calloc(nr_slots, sizeof(*w->slots));
+	iovs = calloc(nr_slots, sizeof(*iovs));
+	bufs = mmap(NULL, nr_slots * buf_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!w->slots || !iovs || bufs == MAP_FAILED) {
+		perror("alloc");
+		return -1;
+	}
+	for (i = 0; i < nr_slots; i++) {
+		struct nbd_slot *slot = &w->slots[i];
+
+		slot->buf = bufs + i * buf_size;
+		slot->buf_index = -1;
+		slot->next = w->free_slots;
+		w->free_slots = slot;
+		iovs[i].iov_base = slot->buf;
+		iovs[i].iov_len = buf_size;
+	}
+
+	/* memory backed exports do not use the slot buffers for payloads */
+	if (exp->fd >= 0) {
+		ret = io_uring_register_buffers(&w->ring, iovs, nr_slots);
+		if (ret)
+			fprintf(stderr,
+				"worker %d: io_uring_register_buffers: %s, using unregistered buffers\n",
+				w->idx, strerror(-ret));
+		else
+			for (i = 0; i < nr_slots; i++)
+				w->slots[i].buf_index = i;
+	}
+	free(iovs);
+	return 0;
+}
+
+static int listen_on(const char *host, const char *port, struct pollfd *pfds,
+		     int max)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	}, *res, *ai;
+	int n = 0, ret, one = 1;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		return -1;
+	}
+	for (ai = res; ai && n < max; ai = ai->ai_next) {
+		int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+				ai->ai_protocol);
+
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (ai->ai_family == AF_INET6)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one,
+				   sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) ||
+		    listen(fd, 128)) {
+			close(fd);
+			continue;
+		}
+		pfds[n].fd = fd;
+		pfds[n++].events = POLLIN;
+	}
+	freeaddrinfo(res);
+	if (!n)
+		fprintf(stderr, "cannot listen on port %s\n", port);
+	return n ? n : -1;
+}
+
+static int open_export(struct nbd_export *exp, const char *file,
+		       uint64_t mem_size, int read_only)
+{
+	struct stat st;
+
+	exp->flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+		NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM |
+		NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_CAN_MULTI_CONN;
+	if (read_only)
+		exp->flags |= NBD_FLAG_READ_ONLY;
+
+	if (!file) {
+		exp->fd = -1;
+		exp->size = mem_size;
+		exp->mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				-1, 0);
+		if (exp->mem == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		return 0;
+	}
+
+	exp->fd = open(file, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+	if (exp->fd < 0) {
+		perror(file);
+		return -1;
+	}
+	if (!exp->name[0])
+		exp->name = file;
+	if (fstat(exp->fd, &st)) {
+		perror("fstat");
+		return -1;
+	}
+	exp->size = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(exp->fd, BLKGETSIZE64, &exp->size)) {
+		perror("BLKGETSIZE64");
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [-f FILE | -m SIZE] [-r] [-t THREADS] [-q DEPTH] [-b BUF_SIZE]\n"
+		"       [-n NAME] [-H HOST] [-P PORT] [-p PIDFILE] [-d]\n"
+		"  Serve FILE or SIZE bytes of memory over NBD on PORT (default\n"
+		"  10809) with THREADS (default 4) io_uring workers, each\n"
+		"  handling up to DEPTH (default 64) requests at a time through\n"
+		"  BUF_SIZE (default 1M) byte registered buffers. -r exports\n"
+		"  read-only, -n sets the name listed by NBD_OPT_LIST (any name\n"
+		"  is accepted), -d daemonizes and -p writes the pid to PIDFILE.\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long long parse_size(const char *arg)
+{
+	char *end;
+	unsigned long long v = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		v <<= 10;
+		/* fallthrough */
+	case 'm':
+	case 'M':
+		v <<= 10;
+		/* fallthrough */
+	case 'k':
+	case 'K':
+		v <<= 10;
+		end++;
+		break;
+	}
+	return *end ? 0 : v;
+}
+
+int main(int argc, char **argv)
+{
+	struct nbd_export exp = { .name = "" };
+	const char *file = NULL, *host = NULL, *port = "10809";
+	const char *pidfile = NULL;
+	unsigned long long mem_size = 0;
+	unsigned int nr_workers = 4, depth = 64, next = 0;
+	size_t buf_size = 1 << 20;
+	int read_only = 0, daemonize = 0, opt, nr_listen, i;
+	struct nbd_worker *workers;
+	struct pollfd pfds[8];
+
+	while ((opt = getopt(argc, argv, "b:df:H:m:n:p:P:q:rt:")) != -1) {
+		switch (opt) {
+		case 'b':
+			buf_size = parse_size(optarg);
+			break;
+		case 'd':
+			daemonize = 1;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'm':
+			mem_size = parse_size(optarg);
+			if (!mem_size)
+				usage(argv[0]);
+			break;
+		case 'n':
+			exp.name = optarg;
+			break;
+		case 'p':
+			pidfile = optarg;
+			break;
+		case 'P':
+			port = optarg;
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			read_only = 1;
+			break;
+		case 't':
+			nr_workers = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !file == !mem_size || !nr_workers || !depth ||
+	    depth > 1024 || buf_size < 4096)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	if (open_export(&exp, file, mem_size, read_only))
+		return EXIT_FAILURE;
+	nr_listen = listen_on(host, port, pfds, sizeof(pfds) / sizeof(pfds[0]));
+	if (nr_listen < 0)
+		return EXIT_FAILURE;
+
+	/* before any thread is started */
+	if (daemonize && daemon(1, 0)) {
+		perror("daemon");
+		return EXIT_FAILURE;
+	}
+	if (pidfile) {
+		FILE *f = fopen(pidfile, "w");
+
+		if (!f) {
+			perror(pidfile);
+			return EXIT_FAILURE;
+		}
+		fprintf(f, "%d\n", getpid());
+		fclose(f);
+	}
+
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].idx = i;
+		if (worker_init(&workers[i], &exp, depth, buf_size))
+			return EXIT_FAILURE;
+		errno = pthread_create(&workers[i].thread, NULL, worker_fn,
+				       &workers[i]);
+		if (errno) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (;;) {
+		if (poll(pfds, nr_listen, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < nr_listen; i++) {
+			struct timeval tv = { .tv_sec = HANDSHAKE_TIMEOUT_S };
+			int fd, one = 1;
+
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			fd = accept4(pfds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0)
+				continue;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+				   sizeof(one));
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			if (handshake(&exp, fd)) {
+				close(fd);
+				continue;
+			}
+			/* the kernel client may idle for longer than that */
+			tv.tv_sec = 0;
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			if (write(workers[next].pipe[1], &fd, sizeof(fd)) !=
+			    sizeof(fd)) {
+				perror("write");
+				close(fd);
+				continue;
+			}
+			next = (next + 1) % nr_workers;
+		}
+	}
+	return EXIT_SUCCESS;
+}
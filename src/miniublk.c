@@ -2,7 +2,7 @@
 // Copyright (C) 2023 Ming Lei
 
 /*
- * io_uring based mini ublk implementation with null/loop target,
+ * io_uring based mini ublk implementation with null/loop/nbd target,
  * for test purpose only.
  *
  * So please keep it clean & simple & reliable.
@@ -22,8 +22,16 @@
 #include <sys/syscall.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
-#include <liburing.h>
-#include <linux/ublk_cmd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <endian.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <linux/nbd.h>
+#include "miniublk.h"
 
 #define CTRL_DEV		"/dev/ublk-control"
 #define UBLKC_DEV		"/dev/ublkc"
@@ -68,23 +76,36 @@ struct ublk_io {
 	unsigned int result;
 };
 
-struct ublk_tgt_ops {
-	const char *name;
-	int (*init_tgt)(struct ublk_dev *);
-	void (*deinit_tgt)(struct ublk_dev *);
+/* token bucket, rate is tokens per second and 0 means unlimited */
+struct ublk_tb {
+	double rate;
+	double burst;
+	double tokens;
+	__u64 last_ns;
+};
+
+struct ublk_qos {
+	struct ublk_tb iops;
+	struct ublk_tb bps;
+};
 
-	int (*queue_io)(struct ublk_queue *, int tag);
-	void (*tgt_io_done)(struct ublk_queue *,
-			int tag, const struct io_uring_cqe *);
-	int (*recover_tgt)(struct ublk_dev *);
+struct ublk_qos_params {
+	unsigned long long iops, bps;
+	unsigned long long q_iops, q_bps;
+	unsigned long long iops_burst, bps_burst;
+	unsigned long long q_iops_burst, q_bps_burst;
 };
 
+/* user_data tag of the qos timer, never a valid request tag */
+#define UBLK_QOS_TIMER_TAG	0xffff
+
 struct ublk_tgt {
 	unsigned long dev_size;
 	const struct ublk_tgt_ops *ops;
 	int argc;
 	char **argv;
 	struct ublk_params params;
+	void *data;
 };
 
 struct ublk_queue {
@@ -99,9 +120,20 @@ struct ublk_queue {
 	struct ublk_io ios[UBLK_QUEUE_DEPTH];
 #define UBLKSRV_QUEUE_STOPPING	(1U << 0)
 #define UBLKSRV_QUEUE_IDLE	(1U << 1)
+#define UBLKSRV_QUEUE_QOS	(1U << 2)
+#define UBLKSRV_QUEUE_QOS_TIMER	(1U << 3)
 	unsigned state;
+
+	/* requests held back by qos, released in fifo order by the timer */
+	struct ublk_qos qos;
+	unsigned short deferred[UBLK_QUEUE_DEPTH];
+	unsigned int deferred_head;
+	unsigned int nr_deferred;
+	struct __kernel_timespec qos_ts;
+
 	pid_t tid;
 	pthread_t thread;
+	void *data;
 };
 
 struct ublk_dev {
@@ -109,10 +141,15 @@ struct ublk_dev {
 	struct ublksrv_ctrl_dev_info  dev_info;
 	struct ublk_queue q[UBLK_MAX_QUEUES];
 
-	int fds[2];	/* fds[0] points to /dev/ublkcN */
+	int fds[1 + UBLK_MAX_TGT_FDS];	/* fds[0] points to /dev/ublkcN */
 	int nr_fds;
 	int ctrl_fd;
 	struct io_uring ring;
+
+	struct ublk_qos_params qos_params;
+	/* device wide limits, shared by all queues */
+	struct ublk_qos qos;
+	pthread_spinlock_t qos_lock;
 };
 
 #ifndef offsetof
@@ -144,29 +181,6 @@ static inline unsigned ilog2(unsigned x)
     return sizeof(unsigned) * 8 - 1 - __builtin_clz(x);
 }
 
-static inline int is_target_io(__u64 user_data)
-{
-	return (user_data & (1ULL << 63)) != 0;
-}
-
-static inline __u64 build_user_data(unsigned tag, unsigned op,
-		unsigned tgt_data, unsigned is_target_io)
-{
-	assert(!(tag >> 16) && !(op >> 8) && !(tgt_data >> 16));
-
-	return tag | (op << 16) | (tgt_data << 24) | (__u64)is_target_io << 63;
-}
-
-static inline unsigned int user_data_to_tag(__u64 user_data)
-{
-	return user_data & 0xffff;
-}
-
-static inline unsigned int user_data_to_op(__u64 user_data)
-{
-	return (user_data >> 16) & 0xff;
-}
-
 static void ublk_err(const char *fmt, ...)
 {
 	va_list ap;
@@ -490,6 +504,120 @@ static int ublk_queue_cmd_buf_sz(struct ublk_queue *q)
 	return __ublk_queue_cmd_buf_sz(q->q_depth);
 }
 
+static __u64 ublk_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ublk_tb_init(struct ublk_tb *tb, unsigned long long rate,
+		unsigned long long burst, unsigned long long min_burst)
+{
+	tb->rate = rate;
+	/* default to 100ms worth of tokens, and one request has to fit */
+	tb->burst = burst ? burst : rate / 10;
+	if (tb->burst < min_burst)
+		tb->burst = min_burst;
+	tb->tokens = tb->burst;
+	tb->last_ns = ublk_now_ns();
+}
+
+/* refill @tb, and return how long to wait until @cost tokens are there */
+static __u64 ublk_tb_wait_ns(struct ublk_tb *tb, double cost, __u64 now)
+{
+	if (!tb->rate)
+		return 0;
+
+	tb->tokens += tb->rate * (now - tb->last_ns) / 1e9;
+	if (tb->tokens > tb->burst)
+		tb->tokens = tb->burst;
+	tb->last_ns = now;
+
+	if (tb->tokens >= cost)
+		return 0;
+	return (cost - tb->tokens) * 1e9 / tb->rate + 1;
+}
+
+static __u64 ublk_qos_wait_ns(struct ublk_qos *qos, unsigned int bytes,
+		__u64 now)
+{
+	__u64 iops_wait = ublk_tb_wait_ns(&qos->iops, 1, now);
+	__u64 bps_wait = ublk_tb_wait_ns(&qos->bps, bytes, now);
+
+	return iops_wait > bps_wait ? iops_wait : bps_wait;
+}
+
+static void ublk_qos_charge(struct ublk_qos *qos, unsigned int bytes)
+{
+	if (qos->iops.rate)
+		qos->iops.tokens -= 1;
+	if (qos->bps.rate)
+		qos->bps.tokens -= bytes;
+}
+
+/*
+ * Take tokens for @tag from both the queue and the device buckets, or
+ * return how long to wait before trying again.
+ */
+static __u64 ublk_qos_throttle(struct ublk_queue *q, int tag)
+{
+	struct ublk_dev *dev = q->dev;
+	unsigned int bytes = ublk_get_iod(q, tag)->nr_sectors << 9;
+	__u64 now = ublk_now_ns();
+	__u64 wait;
+
+	wait = ublk_qos_wait_ns(&q->qos, bytes, now);
+	if (wait)
+		return wait;
+
+	pthread_spin_lock(&dev->qos_lock);
+	wait = ublk_qos_wait_ns(&dev->qos, bytes, now);
+	if (!wait)
+		ublk_qos_charge(&dev->qos, bytes);
+	pthread_spin_unlock(&dev->qos_lock);
+
+	if (!wait)
+		ublk_qos_charge(&q->qos, bytes);
+	return wait;
+}
+
+static bool ublk_qos_enabled(const struct ublk_qos_params *p)
+{
+	return p->iops || p->bps || p->q_iops || p->q_bps;
+}
+
+static void ublk_qos_init_dev(struct ublk_dev *dev)
+{
+	const struct ublk_qos_params *p = &dev->qos_params;
+	unsigned int max_io = dev->dev_info.max_io_buf_bytes;
+
+	pthread_spin_init(&dev->qos_lock, PTHREAD_PROCESS_PRIVATE);
+	ublk_tb_init(&dev->qos.iops, p->iops, p->iops_burst, 1);
+	ublk_tb_init(&dev->qos.bps, p->bps, p->bps_burst, max_io);
+}
+
+/*
+ * The device limits are enforced by the device buckets all queues share
+ * under qos_lock. Queue buckets only carry the per-queue limits and have
+ * their own burst sizes.
+ */
+static void ublk_qos_init_queue(struct ublk_queue *q)
+{
+	const struct ublk_qos_params *p = &q->dev->qos_params;
+	unsigned int max_io = q->dev->dev_info.max_io_buf_bytes;
+
+	q->deferred_head = 0;
+	q->nr_deferred = 0;
+	if (!ublk_qos_enabled(p))
+		return;
+
+	q->state |= UBLKSRV_QUEUE_QOS;
+	ublk_tb_init(&q->qos.iops, p->q_iops, p->q_iops_burst, 1);
+	ublk_tb_init(&q->qos.bps, p->q_bps, p->q_bps_burst, max_io);
+}
+
 static void ublk_queue_deinit(struct ublk_queue *q)
 {
 	int i;
@@ -524,6 +652,12 @@ static int ublk_queue_init(struct ublk_queue *q)
 	q->q_depth = depth;
 	q->cmd_inflight = 0;
 	q->tid = gettid();
+	ublk_qos_init_queue(q);
+	/* room for the qos timer next to one command per tag */
+	if (q->state & UBLKSRV_QUEUE_QOS) {
+		ring_depth++;
+		cq_depth++;
+	}
 
 	cmd_buf_size = ublk_queue_cmd_buf_sz(q);
 	off = UBLKSRV_CMD_BUF_OFFSET + q->q_id * ublk_queue_max_cmd_buf_sz();
@@ -663,8 +797,7 @@ static int ublk_queue_io_cmd(struct ublk_queue *q,
 	return 1;
 }
 
-static int ublk_complete_io(struct ublk_queue *q,
-		unsigned tag, int res)
+int ublk_complete_io(struct ublk_queue *q, unsigned tag, int res)
 {
 	struct ublk_io *io = &q->ios[tag];
 
@@ -673,6 +806,98 @@ static int ublk_complete_io(struct ublk_queue *q,
 	return ublk_queue_io_cmd(q, io, tag);
 }
 
+/* target ABI helpers, see miniublk.h */
+const struct ublksrv_ctrl_dev_info *ublk_dev_get_info(const struct ublk_dev *dev)
+{
+	return &dev->dev_info;
+}
+
+struct ublk_params *ublk_dev_get_params(struct ublk_dev *dev)
+{
+	return &dev->tgt.params;
+}
+
+void ublk_dev_get_args(const struct ublk_dev *dev, int *argc, char ***argv)
+{
+	*argc = dev->tgt.argc;
+	*argv = dev->tgt.argv;
+}
+
+void ublk_dev_set_size(struct ublk_dev *dev, unsigned long long bytes)
+{
+	dev->tgt.dev_size = bytes;
+}
+
+void *ublk_dev_get_data(const struct ublk_dev *dev)
+{
+	return dev->tgt.data;
+}
+
+void ublk_dev_set_data(struct ublk_dev *dev, void *data)
+{
+	dev->tgt.data = data;
+}
+
+int ublk_dev_register_fd(struct ublk_dev *dev, int fd)
+{
+	if (dev->nr_fds >= sizeof(dev->fds) / sizeof(dev->fds[0]))
+		return -EMFILE;
+
+	dev->fds[dev->nr_fds] = fd;
+	return dev->nr_fds++;
+}
+
+struct ublk_dev *ublk_queue_get_dev(const struct ublk_queue *q)
+{
+	return q->dev;
+}
+
+int ublk_queue_get_id(const struct ublk_queue *q)
+{
+	return q->q_id;
+}
+
+int ublk_queue_get_depth(const struct ublk_queue *q)
+{
+	return q->q_depth;
+}
+
+struct io_uring *ublk_queue_get_ring(struct ublk_queue *q)
+{
+	return &q->ring;
+}
+
+const struct ublksrv_io_desc *ublk_queue_get_iod(const struct ublk_queue *q,
+		int tag)
+{
+	return ublk_get_iod(q, tag);
+}
+
+void *ublk_queue_get_io_buf(const struct ublk_queue *q, int tag)
+{
+	return q->ios[tag].buf_addr;
+}
+
+void *ublk_queue_get_data(const struct ublk_queue *q)
+{
+	return q->data;
+}
+
+void ublk_queue_set_data(struct ublk_queue *q, void *data)
+{
+	q->data = data;
+}
+
+void ublk_queue_start_tgt_io(struct ublk_queue *q)
+{
+	q->io_inflight++;
+}
+
+void ublk_queue_end_tgt_io(struct ublk_queue *q)
+{
+	q->io_inflight--;
+}
+
 static void ublk_submit_fetch_commands(struct ublk_queue *q)
 {
 	int i = 0;
@@ -683,7 +908,8 @@ static void ublk_submit_fetch_commands(struct ublk_queue *q)
 
 static int ublk_queue_is_idle(struct ublk_queue *q)
 {
-	return !io_uring_sq_ready(&q->ring) && !q->io_inflight;
+	return !io_uring_sq_ready(&q->ring) && !q->io_inflight &&
+		!q->nr_deferred;
 }
 
 static int ublk_queue_is_done(struct ublk_queue *q)
@@ -721,6 +947,68 @@ static void ublk_queue_idle_exit(struct ublk_queue *q)
 	}
 }
 
+static void ublk_qos_arm_timer(struct ublk_queue *q, __u64 wait_ns)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&q->ring);
+
+	/* flush the pending sqes rather than leave the deferred ones stuck */
+	if (!sqe) {
+		io_uring_submit(&q->ring);
+		sqe = io_uring_get_sqe(&q->ring);
+	}
+	if (!sqe) {
+		ublk_err("%s: run out of sqe %d\n", __func__, q->q_id);
+		return;
+	}
+
+	q->qos_ts.tv_sec = wait_ns / 1000000000ULL;
+	q->qos_ts.tv_nsec = wait_ns % 1000000000ULL;
+	io_uring_prep_timeout(sqe, &q->qos_ts, 0, 0);
+	io_uring_sqe_set_data64(sqe,
+			build_user_data(UBLK_QOS_TIMER_TAG, 0, 0, 0));
+	q->state |= UBLKSRV_QUEUE_QOS_TIMER;
+}
+
+/* release deferred requests in order until the buckets run dry again */
+static void ublk_qos_release(struct ublk_queue *q)
+{
+	while (q->nr_deferred) {
+		int tag = q->deferred[q->deferred_head];
+		__u64 wait = ublk_qos_throttle(q, tag);
+
+		if (wait && !(q->state & UBLKSRV_QUEUE_STOPPING)) {
+			ublk_qos_arm_timer(q, wait);
+			return;
+		}
+		q->deferred_head = (q->deferred_head + 1) % UBLK_QUEUE_DEPTH;
+		q->nr_deferred--;
+		q->tgt_ops->queue_io(q, tag);
+	}
+}
+
+static void ublk_queue_dispatch_io(struct ublk_queue *q, int tag)
+{
+	__u64 wait;
+
+	if (!(q->state & UBLKSRV_QUEUE_QOS)) {
+		q->tgt_ops->queue_io(q, tag);
+		return;
+	}
+
+	/* keep fifo order, nobody can overtake deferred requests */
+	if (!q->nr_deferred) {
+		wait = ublk_qos_throttle(q, tag);
+		if (!wait) {
+			q->tgt_ops->queue_io(q, tag);
+			return;
+		}
+		ublk_qos_arm_timer(q, wait);
+	}
+
+	q->deferred[(q->deferred_head + q->nr_deferred) % UBLK_QUEUE_DEPTH] = tag;
+	q->nr_deferred++;
+}
+
 static inline void ublksrv_handle_tgt_cqe(struct ublk_queue *q,
 		struct io_uring_cqe *cqe)
 {
@@ -757,6 +1045,12 @@ static void ublk_handle_cqe(struct io_uring *r,
 		return;
 	}
 
+	if (tag == UBLK_QOS_TIMER_TAG) {
+		q->state &= ~UBLKSRV_QUEUE_QOS_TIMER;
+		ublk_qos_release(q);
+		return;
+	}
+
 	io = &q->ios[tag];
 	q->cmd_inflight--;
 
@@ -767,7 +1061,7 @@ static void ublk_handle_cqe(struct io_uring *r,
 
 	if (cqe->res == UBLK_IO_RES_OK) {
 		ublk_assert(tag < q->q_depth);
-		q->tgt_ops->queue_io(q, tag);
+		ublk_queue_dispatch_io(q, tag);
 	} else {
 		/*
 		 * COMMIT_REQ will be completed immediately since no fetching
@@ -818,6 +1112,8 @@ static int ublk_process_io(struct ublk_queue *q)
 
 	ret = io_uring_submit_and_wait_timeout(&q->ring, &cqe, 1, tsp, NULL);
 	reapped = ublk_reap_events_uring(&q->ring);
+	if (reapped && q->tgt_ops->handle_batch)
+		q->tgt_ops->handle_batch(q, reapped);
 
 	ublk_dbg(UBLK_DBG_QUEUE, "submit result %d, reapped %d stop %d idle %d\n",
 			ret, reapped, (q->state & UBLKSRV_QUEUE_STOPPING),
@@ -845,6 +1141,16 @@ static void *ublk_io_handler_fn(void *data)
 		return NULL;
 	}
 
+	if (q->tgt_ops->init_queue) {
+		ret = q->tgt_ops->init_queue(q);
+		if (ret) {
+			ublk_err("ublk dev %d queue %d init tgt queue failed %d\n",
+					dev_id, q->q_id, ret);
+			ublk_queue_deinit(q);
+			return NULL;
+		}
+	}
+
 	/* submit all io commands to ublk driver */
 	ublk_submit_fetch_commands(q);
 
@@ -857,6 +1163,8 @@ static void *ublk_io_handler_fn(void *data)
 	} while (1);
 
 	ublk_dbg(UBLK_DBG_QUEUE, "ublk dev %d queue %d exited\n", dev_id, q->q_id);
+	if (q->tgt_ops->deinit_queue)
+		q->tgt_ops->deinit_queue(q);
 	ublk_queue_deinit(q);
 	return NULL;
 }
@@ -885,6 +1193,8 @@ static int ublk_start_daemon(struct ublk_dev *dev, bool recovery)
 	if (ret)
 		return ret;
 
+	ublk_qos_init_dev(dev);
+
 	for (i = 0; i < dinfo->nr_hw_queues; i++) {
 		dev->q[i].dev = dev;
 		dev->q[i].q_id = i;
@@ -923,6 +1233,42 @@ static int ublk_start_daemon(struct ublk_dev *dev, bool recovery)
 	return ret;
 }
 
+#define UBLK_QOS_LONGOPTS			\
+	{ "iops",		1,	NULL, 0 },	\
+	{ "bps",		1,	NULL, 0 },	\
+	{ "q_iops",		1,	NULL, 0 },	\
+	{ "q_bps",		1,	NULL, 0 },	\
+	{ "iops_burst",		1,	NULL, 0 },	\
+	{ "bps_burst",		1,	NULL, 0 },	\
+	{ "q_iops_burst",	1,	NULL, 0 },	\
+	{ "q_bps_burst",	1,	NULL, 0 }
+
+static void ublk_parse_qos_opt(const char *name, const char *arg,
+		struct ublk_qos_params *p)
+{
+	unsigned long long *val = NULL;
+
+	if (!strcmp(name, "iops"))
+		val = &p->iops;
+	else if (!strcmp(name, "bps"))
+		val = &p->bps;
+	else if (!strcmp(name, "q_iops"))
+		val = &p->q_iops;
+	else if (!strcmp(name, "q_bps"))
+		val = &p->q_bps;
+	else if (!strcmp(name, "iops_burst"))
+		val = &p->iops_burst;
+	else if (!strcmp(name, "bps_burst"))
+		val = &p->bps_burst;
+	else if (!strcmp(name, "q_iops_burst"))
+		val = &p->q_iops_burst;
+	else if (!strcmp(name, "q_bps_burst"))
+		val = &p->q_bps_burst;
+
+	if (val)
+		*val = strtoull(arg, NULL, 10);
+}
+
 static int cmd_dev_add(int argc, char *argv[])
 {
 	static const struct option longopts[] = {
@@ -933,6 +1279,7 @@ static int cmd_dev_add(int argc, char *argv[])
 		{ "recovery",		0,	NULL, 'r' },
 		{ "debug_mask",	1,	NULL, 0},
 		{ "quiet",	0,	NULL, 0},
+		UBLK_QOS_LONGOPTS,
 		{ NULL }
 	};
 	const struct ublk_tgt_ops *ops;
@@ -943,6 +1290,7 @@ static int cmd_dev_add(int argc, char *argv[])
 	int dev_id = -1;
 	unsigned nr_queues = 2, depth = UBLK_QUEUE_DEPTH;
 	int user_recovery = 0;
+	struct ublk_qos_params qos = { 0 };
 
 	while ((opt = getopt_long(argc, argv, "-:t:n:d:q:r",
 				  longopts, &option_idx)) != -1) {
@@ -967,6 +1315,8 @@ static int cmd_dev_add(int argc, char *argv[])
 				ublk_dbg_mask = strtol(optarg, NULL, 16);
 			if (!strcmp(longopts[option_idx].name, "quiet"))
 				ublk_dbg_mask = 0;
+			ublk_parse_qos_opt(longopts[option_idx].name, optarg,
+					&qos);
 			break;
 		}
 	}
@@ -1002,6 +1352,7 @@ static int cmd_dev_add(int argc, char *argv[])
 	dev->tgt.ops = ops;
 	dev->tgt.argc = argc;
 	dev->tgt.argv = argv;
+	dev->qos_params = qos;
 
 	ret = ublk_ctrl_add_dev(dev);
 	if (ret < 0) {
@@ -1031,6 +1382,7 @@ static int cmd_dev_recover(int argc, char *argv[])
 		{ "number",		1,	NULL, 'n' },
 		{ "debug_mask",	1,	NULL, 0},
 		{ "quiet",	0,	NULL, 0},
+		UBLK_QOS_LONGOPTS,
 		{ NULL }
 	};
 	const struct ublk_tgt_ops *ops;
@@ -1039,6 +1391,7 @@ static int cmd_dev_recover(int argc, char *argv[])
 	int ret, option_idx, opt;
 	const char *tgt_type = NULL;
 	int dev_id = -1;
+	struct ublk_qos_params qos = { 0 };
 
 	while ((opt = getopt_long(argc, argv, "-:t:n:d:q:",
 				  longopts, &option_idx)) != -1) {
@@ -1054,6 +1407,8 @@ static int cmd_dev_recover(int argc, char *argv[])
 				ublk_dbg_mask = strtol(optarg, NULL, 16);
 			if (!strcmp(longopts[option_idx].name, "quiet"))
 				ublk_dbg_mask = 0;
+			ublk_parse_qos_opt(longopts[option_idx].name, optarg,
+					&qos);
 			break;
 		}
 	}
@@ -1092,6 +1447,7 @@ static int cmd_dev_recover(int argc, char *argv[])
 	dev->tgt.ops = ops;
 	dev->tgt.argc = argc;
 	dev->tgt.argv = argv;
+	dev->qos_params = qos;
 	ret = ublk_ctrl_start_user_recover(dev);
 	if (ret < 0) {
 		ublk_err("%s: can't start recovery for %d\n", __func__, dev_id);
@@ -1270,107 +1626,561 @@ static int cmd_dev_list(int argc, char *argv[])
 	return 0;
 }
 
-static int cmd_dev_help(int argc, char *argv[])
+/*
+ * bench: io_uring load generator against /dev/ublkbN, for measuring the
+ * ublk framework overhead without fio.
+ */
+#define UBLK_BENCH_LAT_SUB	16
+#define UBLK_BENCH_LAT_BUCKETS	(64 * UBLK_BENCH_LAT_SUB)
+
+struct ublk_bench_opts {
+	int dev_id;
+	bool rand;
+	int rwmixread;		/* percentage of reads */
+	unsigned int bs;
+	unsigned int qd;
+	int jobs;
+	int cpu;		/* job i runs on cpu + i, -1 means no pinning */
+	unsigned int runtime;
+	unsigned long long dev_size;
+};
+
+struct ublk_bench_job {
+	const struct ublk_bench_opts *opts;
+	pthread_t thread;
+	int idx;
+	int ret;
+
+	unsigned long long ios, bytes, cpu_ns;
+	__u64 lat_min, lat_max, lat_sum;
+	/* log-linear latency histogram, 16 buckets per power of two */
+	unsigned long long lat[UBLK_BENCH_LAT_BUCKETS];
+};
+
+static unsigned int ublk_bench_lat_bucket(__u64 ns)
 {
-	printf("%s add -t {null|loop} [-q nr_queues] [-d depth] [-n dev_id] \n",
-			argv[0]);
-	printf("\t default: nr_queues=2(max 4), depth=128(max 128), dev_id=-1(auto allocation)\n");
-	printf("\t -t loop -f backing_file \n");
-	printf("\t -t null\n");
-	printf("%s del [-n dev_id] -a \n", argv[0]);
-	printf("\t -a delete all devices -n delete specified device\n");
-	printf("%s list [-n dev_id] -a \n", argv[0]);
-	printf("\t -a list all devices, -n list specified device, default -a \n");
-	printf("%s recover -t {null|loop} [-n dev_id] \n", argv[0]);
-	printf("\t -t loop -f backing_file \n");
-	printf("\t -t null\n");
-	return 0;
+	unsigned int exp;
+
+	if (ns < UBLK_BENCH_LAT_SUB)
+		return ns;
+	exp = 63 - __builtin_clzll(ns);
+	return (exp - 3) * UBLK_BENCH_LAT_SUB +
+		((ns >> (exp - 4)) & (UBLK_BENCH_LAT_SUB - 1));
 }
 
-static int ublk_null_tgt_init(struct ublk_dev *dev)
+/* upper bound of the values in @bucket */
+static __u64 ublk_bench_lat_value(unsigned int bucket)
 {
-	const struct ublksrv_ctrl_dev_info *info = &dev->dev_info;
-	unsigned long dev_size = 250UL << 30;
-
-	dev->tgt.dev_size = dev_size;
-	dev->tgt.params = (struct ublk_params) {
-		.types = UBLK_PARAM_TYPE_BASIC,
-		.basic = {
-			.logical_bs_shift	= 9,
-			.physical_bs_shift	= 12,
-			.io_opt_shift		= 12,
-			.io_min_shift		= 9,
-			.max_sectors		= info->max_io_buf_bytes >> 9,
-			.dev_sectors		= dev_size >> 9,
-		},
-	};
+	unsigned int exp = bucket / UBLK_BENCH_LAT_SUB + 3;
+	unsigned int sub = bucket % UBLK_BENCH_LAT_SUB;
 
-	return 0;
+	if (bucket < UBLK_BENCH_LAT_SUB)
+		return bucket;
+	return ((__u64)(UBLK_BENCH_LAT_SUB + sub + 1) << (exp - 4)) - 1;
 }
 
-static int ublk_null_tgt_recover(struct ublk_dev *dev)
+static __u64 ublk_bench_thread_cpu_ns(void)
 {
-	dev->tgt.dev_size = dev->tgt.params.basic.dev_sectors << 9;
-	return 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static int ublk_null_queue_io(struct ublk_queue *q, int tag)
+/* utime + stime of all threads of @pid */
+static __u64 ublk_bench_proc_cpu_ns(int pid)
 {
-	const struct ublksrv_io_desc *iod = ublk_get_iod(q, tag);
+	unsigned long utime, stime;
+	char path[64], buf[1024], *p;
+	FILE *f;
+	int ret;
 
-	ublk_complete_io(q, tag, iod->nr_sectors << 9);
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!p)
+		return 0;
 
-	return 0;
+	/* skip pid and comm, comm may contain spaces */
+	p = strrchr(buf, ')');
+	if (!p)
+		return 0;
+	ret = sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			&utime, &stime);
+	if (ret != 2)
+		return 0;
+	return (utime + stime) * (1000000000ULL / sysconf(_SC_CLK_TCK));
 }
 
-static int loop_queue_tgt_io(struct ublk_queue *q, int tag)
+static __u64 ublk_bench_rand(__u64 *state)
 {
-	const struct ublksrv_io_desc *iod = ublk_get_iod(q, tag);
-	struct io_uring_sqe *sqe = io_uring_get_sqe(&q->ring);
-	unsigned ublk_op = ublksrv_get_op(iod);
+	/* xorshift64 */
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
 
-	if (!sqe)
-		return -ENOMEM;
+static void ublk_bench_prep(const struct ublk_bench_opts *o,
+		struct io_uring_sqe *sqe, int fd, void *buf, int slot,
+		__u64 *rand_state, __u64 *seq_off)
+{
+	unsigned long long nr_blocks = o->dev_size / o->bs;
+	unsigned long long off;
+	bool read = (ublk_bench_rand(rand_state) % 100) < o->rwmixread;
 
-	switch (ublk_op) {
-	case UBLK_IO_OP_FLUSH:
-		io_uring_prep_sync_file_range(sqe, 1 /*fds[1]*/,
-				iod->nr_sectors << 9,
-				iod->start_sector << 9,
-				IORING_FSYNC_DATASYNC);
-		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
-		break;
-	case UBLK_IO_OP_WRITE_ZEROES:
-	case UBLK_IO_OP_DISCARD:
-		return -ENOTSUP;
-	case UBLK_IO_OP_READ:
-		io_uring_prep_read(sqe, 1 /*fds[1]*/,
-				(void *)iod->addr,
-				iod->nr_sectors << 9,
-				iod->start_sector << 9);
-		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
-		break;
-	case UBLK_IO_OP_WRITE:
-		io_uring_prep_write(sqe, 1 /*fds[1]*/,
-				(void *)iod->addr,
-				iod->nr_sectors << 9,
-				iod->start_sector << 9);
-		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
-		break;
-	default:
-		return -EINVAL;
+	if (o->rand) {
+		off = (ublk_bench_rand(rand_state) % nr_blocks) * o->bs;
+	} else {
+		off = *seq_off;
+		*seq_off = (*seq_off + o->bs) % (nr_blocks * o->bs);
 	}
 
-	q->io_inflight++;
-	/* bit63 marks us as tgt io */
-	sqe->user_data = build_user_data(tag, ublk_op, 0, 1);
-
-	ublk_dbg(UBLK_DBG_IO, "%s: tag %d ublk io %x %llx %u\n", __func__, tag,
-			iod->op_flags, iod->start_sector, iod->nr_sectors << 9);
-	return 1;
+	if (read)
+		io_uring_prep_read_fixed(sqe, 0, buf, o->bs, off, slot);
+	else
+		io_uring_prep_write_fixed(sqe, 0, buf, o->bs, off, slot);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data64(sqe, slot);
 }
 
-static int ublk_loop_queue_io(struct ublk_queue *q, int tag)
+static void *ublk_bench_job_fn(void *data)
+{
+	struct ublk_bench_job *job = data;
+	const struct ublk_bench_opts *o = job->opts;
+	__u64 rand_state = 0x9e3779b97f4a7c15ULL * (job->idx + 1);
+	__u64 seq_off = (o->dev_size / o->jobs / o->bs) * o->bs * job->idx;
+	struct io_uring_cqe *cqe;
+	struct iovec *iovs = NULL;
+	__u64 *issue_ns = NULL;
+	struct io_uring ring;
+	char path[64];
+	__u64 start, end, cpu_start, now;
+	unsigned int i, inflight = 0;
+	int fd, ret;
+
+	job->lat_min = ~0ULL;
+
+	if (o->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(o->cpu + job->idx, &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret) {
+			ublk_err("bench job %d: can't run on cpu %d: %s\n",
+					job->idx, o->cpu + job->idx,
+					strerror(ret));
+			job->ret = -ret;
+			return NULL;
+		}
+	}
+
+	snprintf(path, sizeof(path), "/dev/ublkb%d", o->dev_id);
+	fd = open(path, (o->rwmixread == 100 ? O_RDONLY : O_RDWR) | O_DIRECT);
+	if (fd < 0) {
+		ublk_err("bench job %d: can't open %s: %m\n", job->idx, path);
+		job->ret = -errno;
+		return NULL;
+	}
+
+	iovs = calloc(o->qd, sizeof(*iovs));
+	issue_ns = calloc(o->qd, sizeof(*issue_ns));
+	if (!iovs || !issue_ns) {
+		job->ret = -ENOMEM;
+		goto out_free;
+	}
+	for (i = 0; i < o->qd; i++) {
+		if (posix_memalign(&iovs[i].iov_base, getpagesize(), o->bs)) {
+			job->ret = -ENOMEM;
+			goto out_free;
+		}
+		memset(iovs[i].iov_base, 0x5a, o->bs);
+		iovs[i].iov_len = o->bs;
+	}
+
+	ret = io_uring_queue_init(o->qd, &ring, 0);
+	if (ret) {
+		ublk_err("bench job %d: setup io_uring failed %d\n",
+				job->idx, ret);
+		job->ret = ret;
+		goto out_free;
+	}
+	if ((ret = io_uring_register_files(&ring, &fd, 1)) ||
+	    (ret = io_uring_register_buffers(&ring, iovs, o->qd))) {
+		ublk_err("bench job %d: register files/buffers failed %d\n",
+				job->idx, ret);
+		job->ret = ret;
+		goto out_exit;
+	}
+
+	cpu_start = ublk_bench_thread_cpu_ns();
+	start = ublk_now_ns();
+	end = start + o->runtime * 1000000000ULL;
+	for (i = 0; i < o->qd; i++) {
+		ublk_bench_prep(o, io_uring_get_sqe(&ring), fd,
+				iovs[i].iov_base, i, &rand_state, &seq_off);
+		issue_ns[i] = start;
+		inflight++;
+	}
+
+	while (inflight) {
+		unsigned head, nr = 0;
+
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			job->ret = ret;
+			break;
+		}
+
+		now = ublk_now_ns();
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			unsigned int slot = cqe->user_data;
+			__u64 lat = now - issue_ns[slot];
+
+			nr++;
+			inflight--;
+			if (cqe->res != o->bs) {
+				ublk_err("bench job %d: io failed: %d\n",
+						job->idx, cqe->res);
+				job->ret = cqe->res < 0 ? cqe->res : -EIO;
+				end = 0;
+				continue;
+			}
+
+			job->ios++;
+			job->bytes += o->bs;
+			job->lat_sum += lat;
+			if (lat < job->lat_min)
+				job->lat_min = lat;
+			if (lat > job->lat_max)
+				job->lat_max = lat;
+			job->lat[ublk_bench_lat_bucket(lat)]++;
+
+			if (now >= end)
+				continue;
+			ublk_bench_prep(o, io_uring_get_sqe(&ring), fd,
+					iovs[slot].iov_base, slot, &rand_state,
+					&seq_off);
+			issue_ns[slot] = now;
+			inflight++;
+		}
+		io_uring_cq_advance(&ring, nr);
+	}
+	job->cpu_ns = ublk_bench_thread_cpu_ns() - cpu_start;
+
+out_exit:
+	io_uring_queue_exit(&ring);
+out_free:
+	for (i = 0; iovs && i < o->qd; i++)
+		free(iovs[i].iov_base);
+	free(iovs);
+	free(issue_ns);
+	close(fd);
+	return NULL;
+}
+
+static __u64 ublk_bench_percentile(const unsigned long long *lat,
+		unsigned long long total, double pct)
+{
+	unsigned long long want = total * pct / 100, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < UBLK_BENCH_LAT_BUCKETS; i++) {
+		seen += lat[i];
+		if (seen > want)
+			return ublk_bench_lat_value(i);
+	}
+	return ublk_bench_lat_value(UBLK_BENCH_LAT_BUCKETS - 1);
+}
+
+static int cmd_dev_bench(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "number",		1,	NULL, 'n' },
+		{ "rw",			1,	NULL, 'w' },
+		{ "rwmixread",		1,	NULL, 'm' },
+		{ "bs",			1,	NULL, 'b' },
+		{ "depth",		1,	NULL, 'd' },
+		{ "jobs",		1,	NULL, 'j' },
+		{ "cpu",		1,	NULL, 'c' },
+		{ "runtime",		1,	NULL, 'r' },
+		{ "debug_mask",	1,	NULL, 0},
+		{ NULL }
+	};
+	struct ublk_bench_opts o = {
+		.dev_id = -1,
+		.rand = true,
+		.rwmixread = 100,
+		.bs = 4096,
+		.qd = 32,
+		.jobs = 1,
+		.cpu = -1,
+		.runtime = 10,
+	};
+	const char *rw = "randread";
+	int rwmixread = 50;
+	struct ublk_bench_job *jobs;
+	struct ublk_dev *dev;
+	unsigned long long ios = 0, bytes = 0, cpu_ns = 0;
+	unsigned long long lat[UBLK_BENCH_LAT_BUCKETS] = { 0 };
+	__u64 lat_min = ~0ULL, lat_max = 0, lat_sum = 0;
+	__u64 start, elapsed, daemon_cpu;
+	int opt, option_idx, i, j, fd, ret = 0;
+	char path[64];
+
+	while ((opt = getopt_long(argc, argv, "n:w:m:b:d:j:c:r:",
+				  longopts, &option_idx)) != -1) {
+		switch (opt) {
+		case 'n':
+			o.dev_id = strtol(optarg, NULL, 10);
+			break;
+		case 'w':
+			rw = optarg;
+			break;
+		case 'm':
+			rwmixread = strtol(optarg, NULL, 10);
+			break;
+		case 'b':
+			o.bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			o.qd = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			o.jobs = strtol(optarg, NULL, 10);
+			break;
+		case 'c':
+			o.cpu = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			o.runtime = strtoul(optarg, NULL, 10);
+			break;
+		case 0:
+			if (!strcmp(longopts[option_idx].name, "debug_mask"))
+				ublk_dbg_mask = strtol(optarg, NULL, 16);
+			break;
+		}
+	}
+
+	if (!strcmp(rw, "read") || !strcmp(rw, "randread"))
+		o.rwmixread = 100;
+	else if (!strcmp(rw, "write") || !strcmp(rw, "randwrite"))
+		o.rwmixread = 0;
+	else if (!strcmp(rw, "rw") || !strcmp(rw, "randrw"))
+		o.rwmixread = rwmixread;
+	else
+		o.rwmixread = -1;
+	o.rand = !strncmp(rw, "rand", 4);
+
+	if (o.dev_id < 0 || o.rwmixread < 0 || o.rwmixread > 100 ||
+	    !o.bs || o.bs % 512 || !o.qd || o.qd > UBLK_MAX_QUEUE_DEPTH ||
+	    o.jobs <= 0 || !o.runtime) {
+		ublk_err("%s: invalid parameters\n", __func__);
+		return -EINVAL;
+	}
+
+	dev = ublk_ctrl_init();
+	if (!dev)
+		return -ENOMEM;
+	dev->dev_info.dev_id = o.dev_id;
+	ret = ublk_ctrl_get_info(dev);
+	if (ret < 0 || dev->dev_info.state != UBLK_S_DEV_LIVE) {
+		ublk_err("%s: dev %d isn't live\n", __func__, o.dev_id);
+		ret = -ENODEV;
+		goto out_dev;
+	}
+
+	snprintf(path, sizeof(path), "/dev/ublkb%d", o.dev_id);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &o.dev_size) ||
+	    o.dev_size < o.bs) {
+		ublk_err("%s: can't get size of %s\n", __func__, path);
+		if (fd >= 0)
+			close(fd);
+		ret = -ENODEV;
+		goto out_dev;
+	}
+	close(fd);
+
+	jobs = calloc(o.jobs, sizeof(*jobs));
+	if (!jobs) {
+		ret = -ENOMEM;
+		goto out_dev;
+	}
+
+	daemon_cpu = ublk_bench_proc_cpu_ns(dev->dev_info.ublksrv_pid);
+	start = ublk_now_ns();
+	for (i = 0; i < o.jobs; i++) {
+		jobs[i].opts = &o;
+		jobs[i].idx = i;
+		pthread_create(&jobs[i].thread, NULL, ublk_bench_job_fn,
+				&jobs[i]);
+	}
+	for (i = 0; i < o.jobs; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].ret)
+			ret = jobs[i].ret;
+		ios += jobs[i].ios;
+		bytes += jobs[i].bytes;
+		cpu_ns += jobs[i].cpu_ns;
+		lat_sum += jobs[i].lat_sum;
+		if (jobs[i].lat_min < lat_min)
+			lat_min = jobs[i].lat_min;
+		if (jobs[i].lat_max > lat_max)
+			lat_max = jobs[i].lat_max;
+		for (j = 0; j < UBLK_BENCH_LAT_BUCKETS; j++)
+			lat[j] += jobs[i].lat[j];
+	}
+	elapsed = ublk_now_ns() - start;
+	daemon_cpu = ublk_bench_proc_cpu_ns(dev->dev_info.ublksrv_pid) -
+		daemon_cpu;
+	free(jobs);
+
+	if (!ios) {
+		ublk_err("%s: no io completed\n", __func__);
+		if (!ret)
+			ret = -EIO;
+		goto out_dev;
+	}
+
+	printf("dev %d: %s rwmixread %d bs %u depth %u jobs %d runtime %u\n",
+			o.dev_id, rw, o.rwmixread, o.bs, o.qd, o.jobs,
+			o.runtime);
+	printf("\tiops %.0f bw %.2f MiB/s\n", ios * 1e9 / elapsed,
+			bytes * 1e9 / elapsed / (1 << 20));
+	printf("\tlat(us) min %.1f avg %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+			lat_min / 1e3, (double)lat_sum / ios / 1e3,
+			ublk_bench_percentile(lat, ios, 50) / 1e3,
+			ublk_bench_percentile(lat, ios, 90) / 1e3,
+			ublk_bench_percentile(lat, ios, 99) / 1e3,
+			ublk_bench_percentile(lat, ios, 99.9) / 1e3,
+			lat_max / 1e3);
+	printf("\tcpu per io(us) submitter %.2f daemon %.2f\n",
+			(double)cpu_ns / ios / 1e3,
+			(double)daemon_cpu / ios / 1e3);
+out_dev:
+	ublk_ctrl_deinit(dev);
+	return ret;
+}
+
+static int cmd_dev_help(int argc, char *argv[])
+{
+	printf("%s add -t {null|loop|nbd} [-q nr_queues] [-d depth] [-n dev_id] \n",
+			argv[0]);
+	printf("\t default: nr_queues=2(max 4), depth=128(max 128), dev_id=-1(auto allocation)\n");
+	printf("\t -t loop -f backing_file \n");
+	printf("\t -t null\n");
+	printf("\t -t nbd [--host host] [--port port] [--unix path] [--export name]\n");
+	printf("\t    one connection per queue, default localhost:10809\n");
+	printf("\t -t {name|/path/to/target.so} loads an external target, see miniublk.h\n");
+	printf("\t [--iops N] [--bps N] limit the whole device, shared by all queues\n");
+	printf("\t [--q_iops N] [--q_bps N] limit each queue on its own\n");
+	printf("\t [--iops_burst N] [--bps_burst N] device bucket sizes\n");
+	printf("\t [--q_iops_burst N] [--q_bps_burst N] queue bucket sizes\n");
+	printf("\t     bucket sizes default to 100ms worth of tokens\n");
+	printf("%s del [-n dev_id] -a \n", argv[0]);
+	printf("\t -a delete all devices -n delete specified device\n");
+	printf("%s list [-n dev_id] -a \n", argv[0]);
+	printf("\t -a list all devices, -n list specified device, default -a \n");
+	printf("%s recover -t {null|loop|nbd} [-n dev_id] [qos options]\n", argv[0]);
+	printf("\t -t loop -f backing_file \n");
+	printf("\t -t null\n");
+	printf("\t -t nbd [--host host] [--port port] [--unix path] [--export name]\n");
+	printf("%s bench -n dev_id [--rw {read|write|rw|randread|randwrite|randrw}] [--rwmixread pct]\n",
+			argv[0]);
+	printf("\t [--bs bytes] [--depth N] [--jobs N] [--cpu first_cpu] [--runtime secs]\n");
+	printf("\t default: randread, bs=4096, depth=32, jobs=1, no cpu pinning, runtime=10\n");
+	return 0;
+}
+
+static int ublk_null_tgt_init(struct ublk_dev *dev)
+{
+	const struct ublksrv_ctrl_dev_info *info = &dev->dev_info;
+	unsigned long dev_size = 250UL << 30;
+
+	dev->tgt.dev_size = dev_size;
+	dev->tgt.params = (struct ublk_params) {
+		.types = UBLK_PARAM_TYPE_BASIC,
+		.basic = {
+			.logical_bs_shift	= 9,
+			.physical_bs_shift	= 12,
+			.io_opt_shift		= 12,
+			.io_min_shift		= 9,
+			.max_sectors		= info->max_io_buf_bytes >> 9,
+			.dev_sectors		= dev_size >> 9,
+		},
+	};
+
+	return 0;
+}
+
+static int ublk_null_tgt_recover(struct ublk_dev *dev)
+{
+	dev->tgt.dev_size = dev->tgt.params.basic.dev_sectors << 9;
+	return 0;
+}
+
+static int ublk_null_queue_io(struct ublk_queue *q, int tag)
+{
+	const struct ublksrv_io_desc *iod = ublk_get_iod(q, tag);
+
+	ublk_complete_io(q, tag, iod->nr_sectors << 9);
+
+	return 0;
+}
+
+static int loop_queue_tgt_io(struct ublk_queue *q, int tag)
+{
+	const struct ublksrv_io_desc *iod = ublk_get_iod(q, tag);
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&q->ring);
+	unsigned ublk_op = ublksrv_get_op(iod);
+
+	if (!sqe)
+		return -ENOMEM;
+
+	switch (ublk_op) {
+	case UBLK_IO_OP_FLUSH:
+		io_uring_prep_sync_file_range(sqe, 1 /*fds[1]*/,
+				iod->nr_sectors << 9,
+				iod->start_sector << 9,
+				IORING_FSYNC_DATASYNC);
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+		break;
+	case UBLK_IO_OP_WRITE_ZEROES:
+	case UBLK_IO_OP_DISCARD:
+		return -ENOTSUP;
+	case UBLK_IO_OP_READ:
+		io_uring_prep_read(sqe, 1 /*fds[1]*/,
+				(void *)iod->addr,
+				iod->nr_sectors << 9,
+				iod->start_sector << 9);
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+		break;
+	case UBLK_IO_OP_WRITE:
+		io_uring_prep_write(sqe, 1 /*fds[1]*/,
+				(void *)iod->addr,
+				iod->nr_sectors << 9,
+				iod->start_sector << 9);
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	q->io_inflight++;
+	/* bit63 marks us as tgt io */
+	sqe->user_data = build_user_data(tag, ublk_op, 0, 1);
+
+	ublk_dbg(UBLK_DBG_IO, "%s: tag %d ublk io %x %llx %u\n", __func__, tag,
+			iod->op_flags, iod->start_sector, iod->nr_sectors << 9);
+	return 1;
+}
+
+static int ublk_loop_queue_io(struct ublk_queue *q, int tag)
 {
 	int queued = loop_queue_tgt_io(q, tag);
 
@@ -1572,6 +2382,633 @@ static int ublk_loop_tgt_recover(struct ublk_dev *dev)
 	return 0;
 }
 
+/*
+ * nbd target: forward requests to an nbd server, one connection per queue.
+ *
+ * Requests are pipelined, the nbd handle is the request tag. Request
+ * headers and write payload queued during one reap are sent by a single
+ * sendmsg from ->handle_batch(), and one recv for the next reply header
+ * is kept in flight while requests are outstanding.
+ */
+#ifndef NBD_FLAG_SEND_WRITE_ZEROES
+#define NBD_FLAG_SEND_WRITE_ZEROES	(1 << 6)
+#endif
+#define NBD_FLAG_FIXED_NEWSTYLE		(1 << 0)
+#define NBD_FLAG_NO_ZEROES		(1 << 1)
+#define NBD_CMD_WRITE_ZEROES_		6
+#define NBD_CMD_FLAG_NO_HOLE_		(1 << 17)
+#define NBD_INIT_MAGIC			0x4e42444d41474943ULL	/* NBDMAGIC */
+#define NBD_OPTS_MAGIC			0x49484156454F5054ULL	/* IHAVEOPT */
+#define NBD_CLISERV_MAGIC		0x0000420281861253ULL
+#define NBD_OPT_EXPORT_NAME		1
+#define NBD_DEFAULT_PORT		"10809"
+
+/* user_data op of nbd target io */
+#define NBD_TGT_SEND		1
+#define NBD_TGT_RECV_REPLY	2
+#define NBD_TGT_RECV_DATA	3
+
+enum {
+	NBD_TAG_IDLE,
+	NBD_TAG_PENDING,	/* waiting to be sent */
+	NBD_TAG_SENT,		/* waiting for reply */
+};
+
+struct nbd_tgt {
+	__u64 size;
+	__u16 flags;
+	int fds[UBLK_MAX_QUEUES];
+	int fd_idx[UBLK_MAX_QUEUES];	/* fixed file index */
+};
+
+struct nbd_queue {
+	int fd;
+	int fd_idx;
+	bool dead;
+	unsigned int nr_outstanding;
+	unsigned char tag_state[UBLK_QUEUE_DEPTH];
+	struct nbd_request reqs[UBLK_QUEUE_DEPTH];
+
+	unsigned short pending[UBLK_QUEUE_DEPTH];
+	unsigned int nr_pending;
+	bool send_inflight;
+	struct msghdr send_msg;
+	struct iovec send_iov[2 * UBLK_QUEUE_DEPTH];
+
+	bool recv_inflight;
+	struct nbd_reply reply;
+};
+
+static int nbd_xfer(int fd, void *buf, size_t len, bool send)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t ret = send ? write(fd, p, len) : read(fd, p, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret < 0 ? -errno : -ECONNRESET;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int nbd_connect_sock(const char *host, const char *port,
+		const char *unix_path)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	int fd = -1, one = 1, ret;
+
+	if (unix_path) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", unix_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -errno;
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			ret = -errno;
+			close(fd);
+			return ret;
+		}
+		return fd;
+	}
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		ublk_err("%s: %s:%s: %s\n", __func__, host, port,
+				gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	ret = -ECONNREFUSED;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+					sizeof(one));
+			ret = fd;
+			break;
+		}
+		ret = -errno;
+		close(fd);
+	}
+	freeaddrinfo(res);
+	return ret;
+}
+
+/* oldstyle or (fixed) newstyle negotiation with NBD_OPT_EXPORT_NAME */
+static int nbd_handshake(int fd, const char *export, __u64 *size,
+		__u16 *flags)
+{
+	char zeroes[124];
+	__u64 magic;
+	__u32 cflags = 0, u32;
+	__u16 hs_flags;
+	int ret;
+
+	if ((ret = nbd_xfer(fd, &magic, sizeof(magic), false)))
+		return ret;
+	if (be64toh(magic) != NBD_INIT_MAGIC)
+		return -EPROTO;
+	if ((ret = nbd_xfer(fd, &magic, sizeof(magic), false)))
+		return ret;
+
+	if (be64toh(magic) == NBD_CLISERV_MAGIC) {
+		if ((ret = nbd_xfer(fd, size, sizeof(*size), false)) ||
+		    (ret = nbd_xfer(fd, &u32, sizeof(u32), false)) ||
+		    (ret = nbd_xfer(fd, zeroes, sizeof(zeroes), false)))
+			return ret;
+		*size = be64toh(*size);
+		*flags = be32toh(u32);
+		return 0;
+	}
+	if (be64toh(magic) != NBD_OPTS_MAGIC)
+		return -EPROTO;
+
+	if ((ret = nbd_xfer(fd, &hs_flags, sizeof(hs_flags), false)))
+		return ret;
+	hs_flags = be16toh(hs_flags);
+	if (hs_flags & NBD_FLAG_FIXED_NEWSTYLE)
+		cflags |= NBD_FLAG_FIXED_NEWSTYLE;
+	if (hs_flags & NBD_FLAG_NO_ZEROES)
+		cflags |= NBD_FLAG_NO_ZEROES;
+	cflags = htobe32(cflags);
+	if ((ret = nbd_xfer(fd, &cflags, sizeof(cflags), true)))
+		return ret;
+
+	magic = htobe64(NBD_OPTS_MAGIC);
+	u32 = htobe32(NBD_OPT_EXPORT_NAME);
+	if ((ret = nbd_xfer(fd, &magic, sizeof(magic), true)) ||
+	    (ret = nbd_xfer(fd, &u32, sizeof(u32), true)))
+		return ret;
+	u32 = htobe32(strlen(export));
+	if ((ret = nbd_xfer(fd, &u32, sizeof(u32), true)) ||
+	    (ret = nbd_xfer(fd, (void *)export, strlen(export), true)))
+		return ret;
+
+	if ((ret = nbd_xfer(fd, size, sizeof(*size), false)) ||
+	    (ret = nbd_xfer(fd, flags, sizeof(*flags), false)))
+		return ret;
+	*size = be64toh(*size);
+	*flags = be16toh(*flags);
+	if (!(hs_flags & NBD_FLAG_NO_ZEROES))
+		return nbd_xfer(fd, zeroes, sizeof(zeroes), false);
+	return 0;
+}
+
+static void ublk_nbd_tgt_deinit(struct ublk_dev *dev)
+{
+	struct nbd_tgt *nbd = dev->tgt.data;
+	int i;
+
+	if (!nbd)
+		return;
+
+	for (i = 0; i < dev->dev_info.nr_hw_queues; i++) {
+		struct nbd_request req = {
+			.magic = htobe32(NBD_REQUEST_MAGIC),
+			.type = htobe32(NBD_CMD_DISC),
+		};
+
+		if (nbd->fds[i] < 0)
+			continue;
+		nbd_xfer(nbd->fds[i], &req, sizeof(req), true);
+		close(nbd->fds[i]);
+	}
+	free(nbd);
+	dev->tgt.data = NULL;
+}
+
+static int ublk_nbd_setup(struct ublk_dev *dev, bool recovery)
+{
+	static const struct option nbd_longopts[] = {
+		{ "host",		1,	NULL, 'H' },
+		{ "port",		1,	NULL, 'P' },
+		{ "unix",		1,	NULL, 'U' },
+		{ "export",		1,	NULL, 'e' },
+		{ NULL }
+	};
+	const struct ublksrv_ctrl_dev_info *info = &dev->dev_info;
+	char **argv = dev->tgt.argv;
+	int argc = dev->tgt.argc;
+	const char *host = "localhost", *port = NBD_DEFAULT_PORT;
+	const char *unix_path = NULL, *export = "";
+	struct ublk_params *p = &dev->tgt.params;
+	struct nbd_tgt *nbd;
+	int i, opt, ret;
+
+	while ((opt = getopt_long(argc, argv, "-:H:P:U:e:",
+				  nbd_longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'P':
+			port = optarg;
+			break;
+		case 'U':
+			unix_path = optarg;
+			break;
+		case 'e':
+			export = optarg;
+			break;
+		}
+	}
+
+	nbd = calloc(1, sizeof(*nbd));
+	if (!nbd)
+		return -ENOMEM;
+	for (i = 0; i < UBLK_MAX_QUEUES; i++)
+		nbd->fds[i] = -1;
+	dev->tgt.data = nbd;
+
+	/* one connection per queue, so connections never need locking */
+	for (i = 0; i < info->nr_hw_queues; i++) {
+		__u64 size;
+		__u16 flags;
+
+		ret = nbd_connect_sock(host, port, unix_path);
+		if (ret < 0) {
+			ublk_err("%s: connect to %s failed: %s\n", __func__,
+					unix_path ? unix_path : host,
+					strerror(-ret));
+			goto fail;
+		}
+		nbd->fds[i] = ret;
+
+		ret = nbd_handshake(nbd->fds[i], export, &size, &flags);
+		if (ret) {
+			ublk_err("%s: handshake failed: %s\n", __func__,
+					strerror(-ret));
+			goto fail;
+		}
+		if (i && (size != nbd->size || flags != nbd->flags)) {
+			ublk_err("%s: connections disagree on export\n",
+					__func__);
+			ret = -EPROTO;
+			goto fail;
+		}
+		nbd->size = size;
+		nbd->flags = flags;
+
+		ret = ublk_dev_register_fd(dev, nbd->fds[i]);
+		if (ret < 0)
+			goto fail;
+		nbd->fd_idx[i] = ret;
+	}
+
+	if (!(nbd->flags & NBD_FLAG_CAN_MULTI_CONN) && info->nr_hw_queues > 1)
+		ublk_log("%s: server doesn't advertise multi-conn\n", __func__);
+
+	dev->tgt.dev_size = nbd->size;
+	if (recovery) {
+		if (p->basic.dev_sectors << 9 != nbd->size) {
+			ublk_err("%s: device size should be %lld, I got %lld\n",
+					__func__, p->basic.dev_sectors << 9,
+					nbd->size);
+			ret = -EINVAL;
+			goto fail;
+		}
+		return 0;
+	}
+
+	*p = (struct ublk_params) {
+		.types = UBLK_PARAM_TYPE_BASIC,
+		.basic = {
+			.logical_bs_shift	= 9,
+			.physical_bs_shift	= 12,
+			.io_opt_shift		= 12,
+			.io_min_shift		= 9,
+			.max_sectors		= info->max_io_buf_bytes >> 9,
+			.dev_sectors		= nbd->size >> 9,
+		},
+	};
+	if (nbd->flags & NBD_FLAG_READ_ONLY)
+		p->basic.attrs |= UBLK_ATTR_READ_ONLY;
+	if (nbd->flags & NBD_FLAG_SEND_FLUSH)
+		p->basic.attrs |= UBLK_ATTR_VOLATILE_CACHE;
+	if (nbd->flags & NBD_FLAG_SEND_FUA)
+		p->basic.attrs |= UBLK_ATTR_FUA;
+	if (nbd->flags & (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES)) {
+		p->types |= UBLK_PARAM_TYPE_DISCARD;
+		p->discard = (struct ublk_param_discard) {
+			.discard_granularity	= 4096,
+			.max_discard_segments	= 1,
+		};
+		if (nbd->flags & NBD_FLAG_SEND_TRIM)
+			p->discard.max_discard_sectors = UINT_MAX >> 9;
+		if (nbd->flags & NBD_FLAG_SEND_WRITE_ZEROES)
+			p->discard.max_write_zeroes_sectors = UINT_MAX >> 9;
+	}
+	return 0;
+fail:
+	ublk_nbd_tgt_deinit(dev);
+	return ret;
+}
+
+static int ublk_nbd_tgt_init(struct ublk_dev *dev)
+{
+	return ublk_nbd_setup(dev, false);
+}
+
+static int ublk_nbd_tgt_recover(struct ublk_dev *dev)
+{
+	return ublk_nbd_setup(dev, true);
+}
+
+static int ublk_nbd_init_queue(struct ublk_queue *q)
+{
+	struct nbd_tgt *nbd = q->dev->tgt.data;
+	struct nbd_queue *nq = calloc(1, sizeof(*nq));
+
+	if (!nq)
+		return -ENOMEM;
+	nq->fd = nbd->fds[q->q_id];
+	nq->fd_idx = nbd->fd_idx[q->q_id];
+	q->data = nq;
+	return 0;
+}
+
+static void ublk_nbd_deinit_queue(struct ublk_queue *q)
+{
+	free(q->data);
+	q->data = NULL;
+}
+
+static void nbd_complete_io(struct ublk_queue *q, int tag, int res)
+{
+	struct nbd_queue *nq = q->data;
+
+	nq->tag_state[tag] = NBD_TAG_IDLE;
+	nq->nr_outstanding--;
+	ublk_complete_io(q, tag, res);
+	ublk_queue_end_tgt_io(q);
+}
+
+/* the connection is broken, fail everything which isn't completed yet */
+static void nbd_conn_dead(struct ublk_queue *q)
+{
+	struct nbd_queue *nq = q->data;
+	int i;
+
+	if (!nq->dead)
+		ublk_err("%s: dev %d queue %d lost its nbd connection\n",
+				__func__, q->dev->dev_info.dev_id, q->q_id);
+	nq->dead = true;
+	shutdown(nq->fd, SHUT_RDWR);
+	nq->nr_pending = 0;
+
+	for (i = 0; i < q->q_depth; i++)
+		if (nq->tag_state[i] != NBD_TAG_IDLE)
+			nbd_complete_io(q, i, -EIO);
+}
+
+static int ublk_nbd_queue_io(struct ublk_queue *q, int tag)
+{
+	const struct ublksrv_io_desc *iod = ublk_get_iod(q, tag);
+	struct nbd_tgt *nbd = q->dev->tgt.data;
+	struct nbd_queue *nq = q->data;
+	struct nbd_request *req = &nq->reqs[tag];
+	unsigned ublk_op = ublksrv_get_op(iod);
+	__u64 handle = tag;
+	__u32 type;
+
+	switch (ublk_op) {
+	case UBLK_IO_OP_READ:
+		type = NBD_CMD_READ;
+		break;
+	case UBLK_IO_OP_WRITE:
+		type = NBD_CMD_WRITE;
+		break;
+	case UBLK_IO_OP_FLUSH:
+		if (!(nbd->flags & NBD_FLAG_SEND_FLUSH)) {
+			ublk_complete_io(q, tag, 0);
+			return 0;
+		}
+		type = NBD_CMD_FLUSH;
+		break;
+	case UBLK_IO_OP_DISCARD:
+		if (!(nbd->flags & NBD_FLAG_SEND_TRIM))
+			goto unsupported;
+		type = NBD_CMD_TRIM;
+		break;
+	case UBLK_IO_OP_WRITE_ZEROES:
+		if (!(nbd->flags & NBD_FLAG_SEND_WRITE_ZEROES))
+			goto unsupported;
+		type = NBD_CMD_WRITE_ZEROES_;
+		if (iod->op_flags & UBLK_IO_F_NOUNMAP)
+			type |= NBD_CMD_FLAG_NO_HOLE_;
+		break;
+	default:
+		goto unsupported;
+	}
+
+	if (nq->dead) {
+		ublk_complete_io(q, tag, -EIO);
+		return 0;
+	}
+
+	if ((iod->op_flags & UBLK_IO_F_FUA) &&
+	    (nbd->flags & NBD_FLAG_SEND_FUA))
+		type |= NBD_CMD_FLAG_FUA;
+
+	req->magic = htobe32(NBD_REQUEST_MAGIC);
+	req->type = htobe32(type);
+	memcpy(req->handle, &handle, sizeof(handle));
+	req->from = htobe64((__u64)iod->start_sector << 9);
+	req->len = htobe32(iod->nr_sectors << 9);
+
+	/* sent from ->handle_batch() together with everything else */
+	nq->tag_state[tag] = NBD_TAG_PENDING;
+	nq->pending[nq->nr_pending++] = tag;
+	nq->nr_outstanding++;
+	ublk_queue_start_tgt_io(q);
+
+	ublk_dbg(UBLK_DBG_IO, "%s: tag %d nbd cmd %x %llx %u\n", __func__,
+			tag, type, iod->start_sector, iod->nr_sectors << 9);
+	return 0;
+
+unsupported:
+	ublk_complete_io(q, tag, -EOPNOTSUPP);
+	return 0;
+}
+
+static void nbd_queue_send(struct ublk_queue *q)
+{
+	struct nbd_queue *nq = q->data;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&q->ring);
+
+	if (!sqe) {
+		ublk_err("%s: run out of sqe %d\n", __func__, q->q_id);
+		return;
+	}
+
+	io_uring_prep_sendmsg(sqe, nq->fd_idx, &nq->send_msg, MSG_WAITALL);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	sqe->user_data = build_user_data(0, NBD_TGT_SEND, 0, 1);
+	nq->send_inflight = true;
+	ublk_queue_start_tgt_io(q);
+}
+
+/* send every pending request header and write payload in one go */
+static void nbd_flush_pending(struct ublk_queue *q)
+{
+	struct nbd_queue *nq = q->data;
+	int i, nr_iov = 0;
+
+	for (i = 0; i < nq->nr_pending; i++) {
+		int tag = nq->pending[i];
+		const struct ublksrv_io_desc *iod = ublk_get_iod(q, tag);
+
+		nq->send_iov[nr_iov].iov_base = &nq->reqs[tag];
+		nq->send_iov[nr_iov++].iov_len = sizeof(nq->reqs[tag]);
+		if (ublksrv_get_op(iod) == UBLK_IO_OP_WRITE) {
+			nq->send_iov[nr_iov].iov_base = (void *)iod->addr;
+			nq->send_iov[nr_iov++].iov_len = iod->nr_sectors << 9;
+		}
+		nq->tag_state[tag] = NBD_TAG_SENT;
+	}
+	nq->nr_pending = 0;
+
+	memset(&nq->send_msg, 0, sizeof(nq->send_msg));
+	nq->send_msg.msg_iov = nq->send_iov;
+	nq->send_msg.msg_iovlen = nr_iov;
+	nbd_queue_send(q);
+}
+
+static void nbd_queue_recv(struct ublk_queue *q, void *buf, unsigned len,
+		int tag, unsigned op)
+{
+	struct nbd_queue *nq = q->data;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&q->ring);
+
+	if (!sqe) {
+		ublk_err("%s: run out of sqe %d\n", __func__, q->q_id);
+		return;
+	}
+
+	io_uring_prep_recv(sqe, nq->fd_idx, buf, len, MSG_WAITALL);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	sqe->user_data = build_user_data(tag, op, 0, 1);
+	nq->recv_inflight = true;
+	ublk_queue_start_tgt_io(q);
+}
+
+static void ublk_nbd_handle_batch(struct ublk_queue *q, int nr_reaped)
+{
+	struct nbd_queue *nq = q->data;
+
+	if (nq->dead)
+		return;
+
+	if (nq->nr_pending && !nq->send_inflight)
+		nbd_flush_pending(q);
+
+	if (nq->nr_outstanding && !nq->recv_inflight)
+		nbd_queue_recv(q, &nq->reply, sizeof(nq->reply), 0,
+				NBD_TGT_RECV_REPLY);
+}
+
+static void nbd_send_done(struct ublk_queue *q, int res)
+{
+	struct nbd_queue *nq = q->data;
+	struct msghdr *msg = &nq->send_msg;
+
+	nq->send_inflight = false;
+	if (nq->dead)
+		return;
+	if (res <= 0) {
+		nbd_conn_dead(q);
+		return;
+	}
+
+	/* short send, push the rest */
+	while (msg->msg_iovlen && res >= msg->msg_iov->iov_len) {
+		res -= msg->msg_iov->iov_len;
+		msg->msg_iov++;
+		msg->msg_iovlen--;
+	}
+	if (msg->msg_iovlen) {
+		msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + res;
+		msg->msg_iov->iov_len -= res;
+		nbd_queue_send(q);
+	}
+}
+
+static void nbd_reply_done(struct ublk_queue *q, int res)
+{
+	struct nbd_queue *nq = q->data;
+	const struct ublksrv_io_desc *iod;
+	__u64 handle;
+	__u32 error;
+
+	if (res != sizeof(nq->reply) ||
+	    be32toh(nq->reply.magic) != NBD_REPLY_MAGIC) {
+		nbd_conn_dead(q);
+		return;
+	}
+
+	memcpy(&handle, nq->reply.handle, sizeof(handle));
+	if (handle >= q->q_depth || nq->tag_state[handle] != NBD_TAG_SENT) {
+		ublk_err("%s: reply for unknown handle %llu\n", __func__,
+				handle);
+		nbd_conn_dead(q);
+		return;
+	}
+
+	iod = ublk_get_iod(q, handle);
+	error = be32toh(nq->reply.error);
+	if (error) {
+		nbd_complete_io(q, handle, -error);
+	} else if (ublksrv_get_op(iod) == UBLK_IO_OP_READ) {
+		/* the payload follows the reply header */
+		nbd_queue_recv(q, (void *)iod->addr, iod->nr_sectors << 9,
+				handle, NBD_TGT_RECV_DATA);
+	} else {
+		nbd_complete_io(q, handle, iod->nr_sectors << 9);
+	}
+}
+
+static void ublk_nbd_io_done(struct ublk_queue *q, int tag,
+		const struct io_uring_cqe *cqe)
+{
+	struct nbd_queue *nq = q->data;
+	unsigned op = user_data_to_op(cqe->user_data);
+
+	ublk_queue_end_tgt_io(q);
+
+	if (op == NBD_TGT_SEND) {
+		nbd_send_done(q, cqe->res);
+		return;
+	}
+
+	nq->recv_inflight = false;
+	if (nq->dead)
+		return;
+
+	if (op == NBD_TGT_RECV_REPLY) {
+		nbd_reply_done(q, cqe->res);
+	} else {
+		const struct ublksrv_io_desc *iod = ublk_get_iod(q, tag);
+		int len = iod->nr_sectors << 9;
+
+		if (cqe->res != len)
+			nbd_conn_dead(q);
+		else
+			nbd_complete_io(q, tag, len);
+	}
+}
+
 const struct ublk_tgt_ops tgt_ops_list[] = {
 	{
 		.name = "null",
@@ -1588,20 +3025,87 @@ const struct ublk_tgt_ops tgt_ops_list[] = {
 		.tgt_io_done = ublk_loop_io_done,
 		.recover_tgt = ublk_loop_tgt_recover,
 	},
+
+	{
+		.name = "nbd",
+		.init_tgt = ublk_nbd_tgt_init,
+		.deinit_tgt = ublk_nbd_tgt_deinit,
+		.queue_io = ublk_nbd_queue_io,
+		.tgt_io_done = ublk_nbd_io_done,
+		.recover_tgt = ublk_nbd_tgt_recover,
+		.init_queue = ublk_nbd_init_queue,
+		.deinit_queue = ublk_nbd_deinit_queue,
+		.handle_batch = ublk_nbd_handle_batch,
+	},
 };
 
+static const struct ublk_tgt_ops *ublk_load_tgt(const char *name)
+{
+	const struct ublk_tgt_plugin *plugin;
+	const char *dir = getenv("UBLK_TGT_PATH");
+	struct ublk_tgt_ops *ops;
+	char path[PATH_MAX];
+	void *handle;
+
+	if (strchr(name, '/'))
+		snprintf(path, sizeof(path), "%s", name);
+	else if (dir)
+		snprintf(path, sizeof(path), "%s/ublk_tgt_%s.so", dir, name);
+	else
+		snprintf(path, sizeof(path), "ublk_tgt_%s.so", name);
+
+	/* never unloaded, the target is used until the daemon exits */
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		ublk_err("%s: unknown target %s: %s\n", __func__, name,
+				dlerror());
+		return NULL;
+	}
+
+	plugin = dlsym(handle, UBLK_TGT_PLUGIN_SYM);
+	if (!plugin || !plugin->ops) {
+		ublk_err("%s: %s doesn't export %s\n", __func__, path,
+				UBLK_TGT_PLUGIN_SYM);
+		return NULL;
+	}
+
+	if (plugin->abi_version != UBLK_TGT_ABI_VERSION) {
+		ublk_err("%s: %s is built for target ABI %u, not %u\n",
+				__func__, path, plugin->abi_version,
+				UBLK_TGT_ABI_VERSION);
+		return NULL;
+	}
+
+	/* callbacks the target doesn't know about stay NULL */
+	ops = calloc(1, sizeof(*ops));
+	if (!ops)
+		return NULL;
+	memcpy(ops, plugin->ops, plugin->ops_size < sizeof(*ops) ?
+			plugin->ops_size : sizeof(*ops));
+
+	if (!ops->queue_io) {
+		ublk_err("%s: %s has no ->queue_io\n", __func__, path);
+		free(ops);
+		return NULL;
+	}
+
+	ublk_dbg(UBLK_DBG_DEV, "%s: loaded target %s from %s\n", __func__,
+			ops->name, path);
+	return ops;
+}
+
 static const struct ublk_tgt_ops *ublk_find_tgt(const char *name)
 {
-	const struct ublk_tgt_ops *ops;
 	int i;
 
 	if (name == NULL)
 		return NULL;
 
-	for (i = 0; sizeof(tgt_ops_list) / sizeof(*ops); i++)
+	for (i = 0; i < sizeof(tgt_ops_list) / sizeof(tgt_ops_list[0]); i++)
 		if (strcmp(tgt_ops_list[i].name, name) == 0)
 			return &tgt_ops_list[i];
-	return NULL;
+
+	return ublk_load_tgt(name);
 }
 
 int main(int argc, char *argv[])
@@ -1622,6 +3126,8 @@ int main(int argc, char *argv[])
 		ret = cmd_dev_help(argc, argv);
 	else if (!strcmp(cmd, "recover"))
 		ret = cmd_dev_recover(argc, argv);
+	else if (!strcmp(cmd, "bench"))
+		ret = cmd_dev_bench(argc, argv);
 out:
 	if (ret)
 		cmd_dev_help(argc, argv);
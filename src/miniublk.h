@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: GPL-3.0+
+
+/*
+ * miniublk target ABI.
+ *
+ * Besides the builtin null/loop targets, miniublk can load a target from a
+ * shared object at `add`/`recover` time: `-t foo` looks up the builtin list
+ * first, then dlopen()s ublk_tgt_foo.so ($UBLK_TGT_PATH/ublk_tgt_foo.so if
+ * UBLK_TGT_PATH is set); `-t /path/to/foo.so` loads the given file.
+ *
+ * The shared object has to export one `struct ublk_tgt_plugin` named
+ * `ublk_tgt_plugin`, built against UBLK_TGT_ABI_VERSION:
+ *
+ *	static const struct ublk_tgt_ops foo_ops = {
+ *		.name		= "foo",
+ *		.init_tgt	= foo_init_tgt,
+ *		.queue_io	= foo_queue_io,
+ *	};
+ *
+ *	const struct ublk_tgt_plugin ublk_tgt_plugin = {
+ *		.abi_version	= UBLK_TGT_ABI_VERSION,
+ *		.ops_size	= sizeof(struct ublk_tgt_ops),
+ *		.ops		= &foo_ops,
+ *	};
+ *
+ * and is built with `cc -shared -fPIC -o ublk_tgt_foo.so foo.c`. See
+ * ublk_tgt_zero.c for a complete target.
+ *
+ * struct ublk_dev and struct ublk_queue are opaque to targets, which use
+ * the accessors below. All queue helpers have to be called from the queue
+ * thread which owns the queue.
+ */
+
+#ifndef MINIUBLK_H
+#define MINIUBLK_H
+
+#include <assert.h>
+#include <liburing.h>
+#include <linux/ublk_cmd.h>
+
+#define UBLK_TGT_ABI_VERSION	1
+#define UBLK_TGT_PLUGIN_SYM	"ublk_tgt_plugin"
+
+/* max number of files a target can register besides /dev/ublkcN */
+#define UBLK_MAX_TGT_FDS	8
+
+struct ublk_dev;
+struct ublk_queue;
+
+/*
+ * New callbacks are only ever appended, and ops_size tells miniublk which
+ * of them a target knows about.
+ */
+struct ublk_tgt_ops {
+	const char *name;
+	int (*init_tgt)(struct ublk_dev *);
+	void (*deinit_tgt)(struct ublk_dev *);
+
+	int (*queue_io)(struct ublk_queue *, int tag);
+	void (*tgt_io_done)(struct ublk_queue *,
+			int tag, const struct io_uring_cqe *);
+	int (*recover_tgt)(struct ublk_dev *);
+
+	/* called in the queue thread before fetching / after the last io */
+	int (*init_queue)(struct ublk_queue *);
+	void (*deinit_queue)(struct ublk_queue *);
+
+	/*
+	 * called once after each batch of reaped cqes, right before the
+	 * queue submits and waits again
+	 */
+	void (*handle_batch)(struct ublk_queue *, int nr_reaped);
+};
+
+struct ublk_tgt_plugin {
+	unsigned int abi_version;
+	unsigned int ops_size;
+	const struct ublk_tgt_ops *ops;
+};
+
+/*
+ * user_data of target io: bit 63 marks target io, tag, op and 16 bits of
+ * target private data are passed back in the cqe
+ */
+static inline int is_target_io(__u64 user_data)
+{
+	return (user_data & (1ULL << 63)) != 0;
+}
+
+static inline __u64 build_user_data(unsigned tag, unsigned op,
+		unsigned tgt_data, unsigned is_target_io)
+{
+	assert(!(tag >> 16) && !(op >> 8) && !(tgt_data >> 16));
+
+	return tag | (op << 16) | (tgt_data << 24) | (__u64)is_target_io << 63;
+}
+
+static inline unsigned int user_data_to_tag(__u64 user_data)
+{
+	return user_data & 0xffff;
+}
+
+static inline unsigned int user_data_to_op(__u64 user_data)
+{
+	return (user_data >> 16) & 0xff;
+}
+
+static inline unsigned int user_data_to_tgt_data(__u64 user_data)
+{
+	return (user_data >> 24) & 0xffff;
+}
+
+/* device, valid from ->init_tgt()/->recover_tgt() on */
+const struct ublksrv_ctrl_dev_info *ublk_dev_get_info(const struct ublk_dev *dev);
+struct ublk_params *ublk_dev_get_params(struct ublk_dev *dev);
+void ublk_dev_get_args(const struct ublk_dev *dev, int *argc, char ***argv);
+void ublk_dev_set_size(struct ublk_dev *dev, unsigned long long bytes);
+void *ublk_dev_get_data(const struct ublk_dev *dev);
+void ublk_dev_set_data(struct ublk_dev *dev, void *data);
+
+/*
+ * Register @fd as fixed file for all queue rings, has to be called from
+ * ->init_tgt()/->recover_tgt(). Returns the fixed file index to be used
+ * with IOSQE_FIXED_FILE, or -errno.
+ */
+int ublk_dev_register_fd(struct ublk_dev *dev, int fd);
+
+/* queue */
+struct ublk_dev *ublk_queue_get_dev(const struct ublk_queue *q);
+int ublk_queue_get_id(const struct ublk_queue *q);
+int ublk_queue_get_depth(const struct ublk_queue *q);
+struct io_uring *ublk_queue_get_ring(struct ublk_queue *q);
+const struct ublksrv_io_desc *ublk_queue_get_iod(const struct ublk_queue *q,
+		int tag);
+void *ublk_queue_get_io_buf(const struct ublk_queue *q, int tag);
+void *ublk_queue_get_data(const struct ublk_queue *q);
+void ublk_queue_set_data(struct ublk_queue *q, void *data);
+
+/*
+ * Target io accounting: the queue isn't idle, and can't exit, until every
+ * started target io has ended.
+ */
+void ublk_queue_start_tgt_io(struct ublk_queue *q);
+void ublk_queue_end_tgt_io(struct ublk_queue *q);
+
+/* complete the request of @tag with @res (bytes or -errno) */
+int ublk_complete_io(struct ublk_queue *q, unsigned tag, int res);
+
+#endif
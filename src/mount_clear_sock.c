@@ -1,90 +1,354 @@
 // SPDX-License-Identifier: GPL-3.0+
 // Copyright (C) 2019 Sun Ke
 
-#include <assert.h>
+/*
+ * Race control operations on a block device against each other.
+ *
+ * Every operation runs in its own thread. In each round all threads are
+ * released from a barrier at the same time (optionally after a random delay
+ * of up to JITTER microseconds) and run their operation once, so every round
+ * exercises one race window between all of them. By default the operations
+ * are mount + umount and NBD_CLEAR_SOCK, LOOPS times, and only a failing
+ * NBD_CLEAR_SOCK is an error.
+ */
+
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <linux/fs.h>		/* BLKRRPART, BLKFLSBUF, BLKGETSIZE64 */
 #include <linux/nbd.h>
 
-int main(int argc, char **argv)
+/* log2 buckets of microseconds, the last one catches everything above */
+#define NR_LAT_BUCKETS	24
+
+struct lat_hist {
+	unsigned long long buckets[NR_LAT_BUCKETS];
+	unsigned long long count, sum_ns, min_ns, max_ns;
+};
+
+struct race_ctx {
+	const char *dev, *mountpoint, *fstype;
+	int fd;
+	unsigned long long size;	/* for resize */
+
+	pthread_barrier_t barrier;
+	unsigned long long rounds, max_rounds;
+	unsigned long long deadline_ns;
+	unsigned int jitter_us;
+	int stop;
+};
+
+struct race_op {
+	const char *name;
+	/* returns 0 on success or an errno */
+	int (*fn)(struct race_ctx *ctx, struct race_op *op);
+	int fatal;
+
+	pthread_t thread;
+	struct race_ctx *ctx;
+	unsigned int seed;
+	unsigned long long ok, failed;
+	int last_err;
+	struct lat_hist lat;
+	struct lat_hist umount_lat;	/* mount only */
+	int shrunk;			/* resize only */
+};
+
+static unsigned long long now_ns(void)
 {
-	const char *mountpoint, *dev, *fstype;
-	int loops, fd, i;
+	struct timespec ts;
 
-	if (argc != 5) {
-		fprintf(stderr, "usage: %s DEV MOUNTPOINT FSTYPE LOOPS", argv[0]);
-		return EXIT_FAILURE;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lat_add(struct lat_hist *h, unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int b = 0;
+
+	while (us && b < NR_LAT_BUCKETS - 1) {
+		us >>= 1;
+		b++;
 	}
+	h->buckets[b]++;
+	if (!h->count || ns < h->min_ns)
+		h->min_ns = ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->count++;
+	h->sum_ns += ns;
+}
 
-	dev = argv[1];
-	mountpoint = argv[2];
-	fstype = argv[3];
-	loops = atoi(argv[4]);
+static void lat_print(const char *what, const struct lat_hist *h)
+{
+	int b;
 
-	fd = open(dev, O_RDWR);
-	if (fd == -1) {
-		perror("open");
-		return EXIT_FAILURE;
+	if (!h->count)
+		return;
+	printf("%s latency (us): min %.1f avg %.1f max %.1f\n", what,
+	       h->min_ns / 1e3, h->sum_ns / 1e3 / h->count, h->max_ns / 1e3);
+	for (b = 0; b < NR_LAT_BUCKETS; b++) {
+		if (!h->buckets[b])
+			continue;
+		if (b == NR_LAT_BUCKETS - 1)
+			printf("  [%8llu,      inf) %llu\n", 1ULL << (b - 1),
+			       h->buckets[b]);
+		else
+			printf("  [%8llu, %8llu) %llu\n",
+			       b ? 1ULL << (b - 1) : 0, 1ULL << b,
+			       h->buckets[b]);
 	}
+}
+
+static int op_mount(struct race_ctx *ctx, struct race_op *op)
+{
+	unsigned long long start;
 
-	for (i = 0; i < loops; i++) {
-		pid_t mount_pid, clear_sock_pid;
-		int wstatus;
+	if (mount(ctx->dev, ctx->mountpoint, ctx->fstype,
+		  MS_NOSUID | MS_SYNCHRONOUS, 0) == -1)
+		return errno;
+	start = now_ns();
+	if (umount(ctx->mountpoint) == -1)
+		return errno;
+	lat_add(&op->umount_lat, now_ns() - start);
+	return 0;
+}
 
-		mount_pid = fork();
-		if (mount_pid == -1) {
-			perror("fork");
-			return EXIT_FAILURE;
+static int op_clear_sock(struct race_ctx *ctx, struct race_op *op)
+{
+	return ioctl(ctx->fd, NBD_CLEAR_SOCK, 0) == -1 ? errno : 0;
+}
+
+static int op_rrpart(struct race_ctx *ctx, struct race_op *op)
+{
+	return ioctl(ctx->fd, BLKRRPART, 0) == -1 ? errno : 0;
+}
+
+static int op_flsbuf(struct race_ctx *ctx, struct race_op *op)
+{
+	return ioctl(ctx->fd, BLKFLSBUF, 0) == -1 ? errno : 0;
+}
+
+/* alternate between the original size and 1 MiB less */
+static int op_resize(struct race_ctx *ctx, struct race_op *op)
+{
+	unsigned long size = ctx->size - (op->shrunk ? 0 : 1 << 20);
+
+	if (ctx->size <= 1 << 20)
+		return EINVAL;
+	if (ioctl(ctx->fd, NBD_SET_SIZE, size) == -1)
+		return errno;
+	op->shrunk = !op->shrunk;
+	return 0;
+}
+
+static const struct race_op race_ops[] = {
+	{ .name = "mount", .fn = op_mount },
+	{ .name = "clear_sock", .fn = op_clear_sock, .fatal = 1 },
+	{ .name = "rrpart", .fn = op_rrpart },
+	{ .name = "flsbuf", .fn = op_flsbuf },
+	{ .name = "resize", .fn = op_resize },
+};
+
+#define NR_RACE_OPS (sizeof(race_ops) / sizeof(race_ops[0]))
+
+static void *race_thread_fn(void *arg)
+{
+	struct race_op *op = arg;
+	struct race_ctx *ctx = op->ctx;
+
+	for (;;) {
+		unsigned long long start;
+		int err;
+
+		/* the last thread to arrive decides whether to go on */
+		if (pthread_barrier_wait(&ctx->barrier) ==
+		    PTHREAD_BARRIER_SERIAL_THREAD) {
+			if ((ctx->max_rounds && ctx->rounds >= ctx->max_rounds) ||
+			    (ctx->deadline_ns && now_ns() >= ctx->deadline_ns))
+				ctx->stop = 1;
+			else
+				ctx->rounds++;
 		}
-		if (mount_pid == 0) {
-			mount(dev, mountpoint, fstype,
-			      MS_NOSUID | MS_SYNCHRONOUS, 0);
-			umount(mountpoint);
-			exit(EXIT_SUCCESS);
+		pthread_barrier_wait(&ctx->barrier);
+		if (ctx->stop)
+			break;
+
+		if (ctx->jitter_us)
+			usleep(rand_r(&op->seed) % (ctx->jitter_us + 1));
+		start = now_ns();
+		err = op->fn(ctx, op);
+		if (err) {
+			op->failed++;
+			op->last_err = err;
+			if (op->fatal) {
+				fprintf(stderr, "%s: %s\n", op->name,
+					strerror(err));
+				ctx->max_rounds = ctx->rounds;
+			}
+			continue;
 		}
+		op->ok++;
+		lat_add(&op->lat, now_ns() - start);
+	}
+	return NULL;
+}
 
-		clear_sock_pid = fork();
-		if (clear_sock_pid == -1) {
-			perror("fork");
-			return EXIT_FAILURE;
+static int parse_ops(char *list, struct race_op *ops)
+{
+	char *name, *save;
+	int nr = 0, j;
+	size_t i;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < NR_RACE_OPS; i++)
+			if (!strcmp(name, race_ops[i].name))
+				break;
+		if (i == NR_RACE_OPS) {
+			fprintf(stderr, "unknown operation %s\n", name);
+			return -1;
 		}
-		if (clear_sock_pid == 0) {
-			if (ioctl(fd, NBD_CLEAR_SOCK, 0) == -1) {
-				perror("ioctl");
-				exit(EXIT_FAILURE);
+		for (j = 0; j < nr; j++) {
+			if (ops[j].fn == race_ops[i].fn) {
+				fprintf(stderr, "repeated operation %s\n", name);
+				return -1;
 			}
-			exit(EXIT_SUCCESS);
 		}
+		ops[nr++] = race_ops[i];
+	}
+	return nr;
+}
 
-		if (waitpid(mount_pid, &wstatus, 0) == -1) {
-			perror("waitpid");
-			return EXIT_FAILURE;
-		}
-		if (!WIFEXITED(wstatus) ||
-		    WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
-			fprintf(stderr, "mount process failed");
-			return EXIT_FAILURE;
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [-o OPS] [-t SECONDS] [-j JITTER] [-s] DEV MOUNTPOINT FSTYPE LOOPS\n"
+		"  Run the comma separated OPS (default mount,clear_sock) from\n"
+		"  mount, clear_sock, rrpart, flsbuf and resize concurrently on\n"
+		"  DEV, LOOPS times (0: no limit) or for SECONDS, starting each\n"
+		"  after up to JITTER microseconds, and with -s print the race\n"
+		"  windows per second and the latency of each operation.\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct race_ctx ctx = { };
+	struct race_op ops[NR_RACE_OPS];
+	char default_ops[] = "mount,clear_sock";
+	char *op_list = default_ops;
+	unsigned long long start, elapsed_ns;
+	int nr_ops, i, opt, stats = 0, ret = EXIT_SUCCESS;
+	double secs = 0;
+
+	while ((opt = getopt(argc, argv, "j:o:st:")) != -1) {
+		switch (opt) {
+		case 'j':
+			ctx.jitter_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			op_list = optarg;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		case 't':
+			secs = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
 		}
+	}
+	if (argc - optind != 4)
+		usage(argv[0]);
+
+	ctx.dev = argv[optind];
+	ctx.mountpoint = argv[optind + 1];
+	ctx.fstype = argv[optind + 2];
+	ctx.max_rounds = strtoull(argv[optind + 3], NULL, 0);
+	if (!ctx.max_rounds && secs <= 0)
+		usage(argv[0]);
+
+	nr_ops = parse_ops(op_list, ops);
+	if (nr_ops <= 0)
+		usage(argv[0]);
+
+	ctx.fd = open(ctx.dev, O_RDWR);
+	if (ctx.fd == -1) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	/* only needed by resize, which fails with EINVAL without it */
+	if (ioctl(ctx.fd, BLKGETSIZE64, &ctx.size) == -1)
+		ctx.size = 0;
+
+	errno = pthread_barrier_init(&ctx.barrier, NULL, nr_ops);
+	if (errno) {
+		perror("pthread_barrier_init");
+		return EXIT_FAILURE;
+	}
 
-		if (waitpid(clear_sock_pid, &wstatus, 0) == -1) {
-			perror("waitpid");
+	start = now_ns();
+	if (secs > 0)
+		ctx.deadline_ns = start + secs * 1e9;
+	for (i = 0; i < nr_ops; i++) {
+		ops[i].ctx = &ctx;
+		ops[i].seed = i + 1;
+		errno = pthread_create(&ops[i].thread, NULL, race_thread_fn,
+				       &ops[i]);
+		if (errno) {
+			perror("pthread_create");
 			return EXIT_FAILURE;
 		}
-		if (!WIFEXITED(wstatus) ||
-		    WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
-			fprintf(stderr, "NBD_CLEAR_SOCK process failed");
-			return EXIT_FAILURE;
+	}
+	for (i = 0; i < nr_ops; i++)
+		pthread_join(ops[i].thread, NULL);
+	elapsed_ns = now_ns() - start;
+
+	for (i = 0; i < nr_ops; i++) {
+		if (ops[i].fatal && ops[i].failed)
+			ret = EXIT_FAILURE;
+		/* leave the device at its original size */
+		if (ops[i].fn == op_resize && ops[i].shrunk)
+			ioctl(ctx.fd, NBD_SET_SIZE, (unsigned long)ctx.size);
+	}
+
+	if (stats) {
+		printf("%llu race windows of %d operations in %.3f s, %.0f windows/s\n",
+		       ctx.rounds, nr_ops, elapsed_ns / 1e9,
+		       elapsed_ns ? ctx.rounds * 1e9 / elapsed_ns : 0.0);
+		for (i = 0; i < nr_ops; i++) {
+			struct race_op *op = &ops[i];
+
+			printf("%s: %llu ok, %llu failed", op->name, op->ok,
+			       op->failed);
+			if (op->failed)
+				printf(", last error: %s",
+				       strerror(op->last_err));
+			printf("\n");
+			if (op->fn == op_mount) {
+				lat_print("mount+umount", &op->lat);
+				lat_print("umount", &op->umount_lat);
+			} else {
+				lat_print(op->name, &op->lat);
+			}
 		}
 	}
 
-	close(fd);
-	return EXIT_SUCCESS;
+	pthread_barrier_destroy(&ctx.barrier);
+	close(ctx.fd);
+	return ret;
 }
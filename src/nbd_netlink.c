@@ -0,0 +1,738 @@
+// SPDX-License-Identifier: GPL-3.0+
+
+/*
+ * Configure nbd devices over the nbd generic netlink family.
+ *
+ * connect opens SOCKETS connections to an NBD server, does the fixed newstyle
+ * handshake on each of them and hands all of them to the kernel in a single
+ * NBD_CMD_CONNECT together with the block size, timeouts and flags.
+ * reconfigure does the same with NBD_CMD_RECONFIGURE on a live device, where
+ * the kernel uses the new sockets to replace dead connections and ignores
+ * the rest. Both report the handshake and netlink command latency and can
+ * then sample TCP_INFO of their copies of the sockets to show how the
+ * traffic of the device is split over its connections.
+ *
+ * libnl is not needed, the messages are built by hand.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/genetlink.h>
+#include <linux/nbd-netlink.h>
+#include <linux/nbd.h>
+#include <linux/netlink.h>
+#include <linux/tcp.h>		/* struct tcp_info with tcpi_bytes_acked */
+#include <sys/socket.h>
+
+#define NBD_OPTS_MAGIC		0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+#define NBD_FLAG_C_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_C_NO_ZEROES		(1 << 1)
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_GO		7
+#define NBD_REP_ACK		1
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_INFO_EXPORT		0
+
+#define MAX_SOCKETS		256
+#define NL_BUF_SIZE		16384
+
+struct nbd_nl_opts {
+	int index;			/* -1 lets the kernel choose */
+	int nr_socks;
+	unsigned long long block_size;
+	unsigned long long timeout;
+	unsigned long long dead_conn_timeout;
+	long long server_flags;		/* -1 uses what the server advertises */
+	unsigned long long client_flags;
+	const char *name;
+	int sample_secs;
+};
+
+struct nbd_conn_info {
+	int fds[MAX_SOCKETS];
+	int nr;
+	uint64_t size;
+	uint16_t flags;
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t ret = recv(fd, p, len, 0);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int send_opt(int fd, uint32_t opt, const void *data, uint32_t len)
+{
+	struct {
+		uint64_t magic;
+		uint32_t opt;
+		uint32_t len;
+	} __attribute__((packed)) hdr = {
+		.magic = htobe64(NBD_OPTS_MAGIC),
+		.opt = htobe32(opt),
+		.len = htobe32(len),
+	};
+
+	if (write_all(fd, &hdr, sizeof(hdr)))
+		return -1;
+	return len ? write_all(fd, data, len) : 0;
+}
+
+/*
+ * Fixed newstyle handshake with NBD_OPT_GO, or NBD_OPT_EXPORT_NAME if the
+ * server does not know NBD_OPT_GO. Returns 0 in the transmission phase.
+ */
+static int nbd_handshake(int fd, const char *name, uint64_t *size,
+			 uint16_t *flags)
+{
+	struct {
+		uint64_t magic;
+		uint64_t opts_magic;
+		uint16_t flags;
+	} __attribute__((packed)) greeting;
+	struct {
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__((packed)) reply;
+	char zeroes[124];
+	uint32_t name_len = strlen(name), client_flags;
+	char go[4 + 4096 + 2];
+	uint16_t hs_flags;
+
+	if (name_len > 4096) {
+		fprintf(stderr, "export name too long\n");
+		return -1;
+	}
+	if (read_all(fd, &greeting, sizeof(greeting)))
+		goto io_err;
+	if (be64toh(greeting.opts_magic) != NBD_OPTS_MAGIC) {
+		fprintf(stderr, "server does not speak newstyle NBD\n");
+		return -1;
+	}
+	hs_flags = be16toh(greeting.flags);
+	if (!(hs_flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+		fprintf(stderr, "server does not speak fixed newstyle NBD\n");
+		return -1;
+	}
+	client_flags = htobe32(NBD_FLAG_C_FIXED_NEWSTYLE |
+			       (hs_flags & NBD_FLAG_C_NO_ZEROES));
+	if (write_all(fd, &client_flags, sizeof(client_flags)))
+		goto io_err;
+
+	/* name length, name, no information requests */
+	*(uint32_t *)go = htobe32(name_len);
+	memcpy(go + 4, name, name_len);
+	memset(go + 4 + name_len, 0, 2);
+	if (send_opt(fd, NBD_OPT_GO, go, 4 + name_len + 2))
+		goto io_err;
+
+	for (;;) {
+		struct {
+			uint64_t magic;
+			uint32_t opt;
+			uint32_t type;
+			uint32_t len;
+		} __attribute__((packed)) rep;
+		char data[4096];
+		uint32_t type, len;
+
+		if (read_all(fd, &rep, sizeof(rep)) ||
+		    be64toh(rep.magic) != NBD_REP_MAGIC)
+			goto io_err;
+		type = be32toh(rep.type);
+		len = be32toh(rep.len);
+		if (len > sizeof(data) || read_all(fd, data, len))
+			goto io_err;
+
+		if (type == NBD_REP_ACK)
+			return 0;
+		if (type == NBD_REP_INFO && len >= 12 &&
+		    be16toh(*(uint16_t *)data) == NBD_INFO_EXPORT) {
+			uint64_t v;
+
+			memcpy(&v, data + 2, sizeof(v));
+			*size = be64toh(v);
+			*flags = be16toh(*(uint16_t *)(data + 10));
+			continue;
+		}
+		if (type == NBD_REP_ERR_UNSUP)
+			break;
+		if (type & 0x80000000) {
+			fprintf(stderr, "NBD_OPT_GO failed with reply %#x\n",
+				type);
+			return -1;
+		}
+	}
+
+	/* old servers */
+	if (send_opt(fd, NBD_OPT_EXPORT_NAME, name, name_len) ||
+	    read_all(fd, &reply, sizeof(reply)) ||
+	    (!(hs_flags & NBD_FLAG_C_NO_ZEROES) &&
+	     read_all(fd, zeroes, sizeof(zeroes))))
+		goto io_err;
+	*size = be64toh(reply.size);
+	*flags = be16toh(reply.flags);
+	return 0;
+
+io_err:
+	fprintf(stderr, "handshake failed\n");
+	return -1;
+}
+
+static int open_socks(const char *host, const char *port,
+		      const struct nbd_nl_opts *o, struct nbd_conn_info *c)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	}, *res, *ai;
+	int ret, i, one = 1;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(ret));
+		return -1;
+	}
+
+	c->nr = 0;
+	for (i = 0; i < o->nr_socks; i++) {
+		int fd = -1;
+
+		for (ai = res; ai; ai = ai->ai_next) {
+			fd = socket(ai->ai_family,
+				    ai->ai_socktype | SOCK_CLOEXEC,
+				    ai->ai_protocol);
+			if (fd < 0)
+				continue;
+			if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+				break;
+			close(fd);
+			fd = -1;
+		}
+		if (fd < 0) {
+			fprintf(stderr, "cannot connect to %s:%s\n", host,
+				port);
+			goto err;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c->fds[c->nr++] = fd;
+		if (nbd_handshake(fd, o->name, &c->size, &c->flags))
+			goto err;
+	}
+	freeaddrinfo(res);
+	return 0;
+
+err:
+	freeaddrinfo(res);
+	while (c->nr)
+		close(c->fds[--c->nr]);
+	return -1;
+}
+
+static struct nlattr *nla_put(struct nlmsghdr *nlh, int type,
+			      const void *data, int len)
+{
+	struct nlattr *nla = (struct nlattr *)((char *)nlh +
+					       NLMSG_ALIGN(nlh->nlmsg_len));
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	if (len)
+		memcpy((char *)nla + NLA_HDRLEN, data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+	return nla;
+}
+
+static void nla_put_u32(struct nlmsghdr *nlh, int type, uint32_t v)
+{
+	nla_put(nlh, type, &v, sizeof(v));
+}
+
+static void nla_put_u64(struct nlmsghdr *nlh, int type, uint64_t v)
+{
+	nla_put(nlh, type, &v, sizeof(v));
+}
+
+static struct nlattr *nla_nest_start(struct nlmsghdr *nlh, int type)
+{
+	return nla_put(nlh, type | NLA_F_NESTED, NULL, 0);
+}
+
+static void nla_nest_end(struct nlmsghdr *nlh, struct nlattr *nest)
+{
+	nest->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+}
+
+static struct nlattr *nla_find(void *attrs, int len, int type)
+{
+	struct nlattr *nla;
+
+	for (nla = attrs; len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+	     nla->nla_len <= len;
+	     len -= NLA_ALIGN(nla->nla_len),
+	     nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len)))
+		if ((nla->nla_type & NLA_TYPE_MASK) == type)
+			return nla;
+	return NULL;
+}
+
+#define NLA_DATA(nla)	((void *)((char *)(nla) + NLA_HDRLEN))
+#define NLA_PAYLOAD(nla)	((nla)->nla_len - NLA_HDRLEN)
+
+static struct nlmsghdr *genl_msg_init(char *buf, int family, int cmd)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct genlmsghdr *genl = NLMSG_DATA(nlh);
+
+	memset(buf, 0, NL_BUF_SIZE);
+	nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	nlh->nlmsg_type = family;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	genl->cmd = cmd;
+	genl->version = family == GENL_ID_CTRL ? 1 : NBD_GENL_VERSION;
+	return nlh;
+}
+
+/*
+ * Send a request and wait for its ack. The last non-error reply, if any, is
+ * left in reply. Returns 0 or a negative errno.
+ */
+static int genl_transact(int sock, struct nlmsghdr *req, char *reply)
+{
+	static uint32_t seq;
+	char buf[NL_BUF_SIZE];
+	int got_reply = 0;
+
+	req->nlmsg_seq = ++seq;
+	if (send(sock, req, req->nlmsg_len, 0) < 0)
+		return -errno;
+
+	for (;;) {
+		struct nlmsghdr *nlh;
+		int len = recv(sock, buf, sizeof(buf), 0);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != req->nlmsg_seq)
+				continue;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+				return err->error;
+			}
+			if (reply && !got_reply &&
+			    nlh->nlmsg_len <= NL_BUF_SIZE) {
+				memcpy(reply, nlh, nlh->nlmsg_len);
+				got_reply = 1;
+			}
+		}
+	}
+}
+
+/* open a generic netlink socket, returns the nbd family id in *family */
+static int nbd_genl_open(int *family)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	char buf[NL_BUF_SIZE], reply[NL_BUF_SIZE];
+	struct nlmsghdr *nlh;
+	struct nlattr *nla;
+	int sock, ret;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("bind");
+		goto err;
+	}
+
+	nlh = genl_msg_init(buf, GENL_ID_CTRL, CTRL_CMD_GETFAMILY);
+	nla_put(nlh, CTRL_ATTR_FAMILY_NAME, NBD_GENL_FAMILY_NAME,
+		sizeof(NBD_GENL_FAMILY_NAME));
+	ret = genl_transact(sock, nlh, reply);
+	if (ret) {
+		fprintf(stderr, "nbd generic netlink family: %s\n",
+			strerror(-ret));
+		goto err;
+	}
+	nlh = (struct nlmsghdr *)reply;
+	nla = nla_find((char *)NLMSG_DATA(nlh) + GENL_HDRLEN,
+		       nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+		       CTRL_ATTR_FAMILY_ID);
+	if (!nla) {
+		fprintf(stderr, "no nbd generic netlink family id\n");
+		goto err;
+	}
+	*family = *(uint16_t *)NLA_DATA(nla);
+	return sock;
+
+err:
+	close(sock);
+	return -1;
+}
+
+static void put_config(struct nlmsghdr *nlh, const struct nbd_nl_opts *o,
+		       const struct nbd_conn_info *c)
+{
+	struct nlattr *socks;
+	int i;
+
+	if (o->timeout)
+		nla_put_u64(nlh, NBD_ATTR_TIMEOUT, o->timeout);
+	if (o->dead_conn_timeout)
+		nla_put_u64(nlh, NBD_ATTR_DEAD_CONN_TIMEOUT,
+			    o->dead_conn_timeout);
+	if (!c->nr)
+		return;
+	socks = nla_nest_start(nlh, NBD_ATTR_SOCKETS);
+	for (i = 0; i < c->nr; i++) {
+		struct nlattr *item = nla_nest_start(nlh, NBD_SOCK_ITEM);
+
+		nla_put_u32(nlh, NBD_SOCK_FD, c->fds[i]);
+		nla_nest_end(nlh, item);
+	}
+	nla_nest_end(nlh, socks);
+}
+
+struct tcp_sample {
+	uint64_t sent, received;
+};
+
+static int tcp_sample(int fd, struct tcp_sample *s)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+		return -1;
+	s->sent = ti.tcpi_bytes_acked;
+	s->received = ti.tcpi_bytes_received;
+	return 0;
+}
+
+/* the kernel holds its own references, our copies only serve TCP_INFO */
+static void sample_split(const struct nbd_conn_info *c, int secs)
+{
+	struct tcp_sample start[MAX_SOCKETS], end[MAX_SOCKETS];
+	uint64_t total_sent = 0, total_received = 0;
+	double t;
+	int i;
+
+	for (i = 0; i < c->nr; i++)
+		tcp_sample(c->fds[i], &start[i]);
+	t = now_ms();
+	sleep(secs);
+	t = (now_ms() - t) / 1e3;
+	for (i = 0; i < c->nr; i++) {
+		tcp_sample(c->fds[i], &end[i]);
+		total_sent += end[i].sent - start[i].sent;
+		total_received += end[i].received - start[i].received;
+	}
+
+	printf("%-6s %12s %12s %7s %7s\n", "socket", "sent MiB/s",
+	       "recv MiB/s", "sent%", "recv%");
+	for (i = 0; i < c->nr; i++) {
+		uint64_t sent = end[i].sent - start[i].sent;
+		uint64_t received = end[i].received - start[i].received;
+
+		printf("%-6d %12.1f %12.1f %7.1f %7.1f\n", i,
+		       sent / t / (1 << 20), received / t / (1 << 20),
+		       total_sent ? sent * 100.0 / total_sent : 0.0,
+		       total_received ? received * 100.0 / total_received :
+		       0.0);
+	}
+	printf("%-6s %12.1f %12.1f\n", "total", total_sent / t / (1 << 20),
+	       total_received / t / (1 << 20));
+}
+
+static int cmd_connect(int sock, int family, const struct nbd_nl_opts *o,
+		       const char *host, const char *port, int reconfigure)
+{
+	char buf[NL_BUF_SIZE], reply[NL_BUF_SIZE];
+	struct nbd_conn_info c = { .nr = 0 };
+	struct nlmsghdr *nlh;
+	double t, handshake_ms, cmd_ms;
+	int ret, index = o->index;
+
+	t = now_ms();
+	if (open_socks(host, port, o, &c))
+		return -1;
+	handshake_ms = now_ms() - t;
+
+	nlh = genl_msg_init(buf, family, reconfigure ? NBD_CMD_RECONFIGURE :
+			    NBD_CMD_CONNECT);
+	if (index >= 0)
+		nla_put_u32(nlh, NBD_ATTR_INDEX, index);
+	if (!reconfigure) {
+		nla_put_u64(nlh, NBD_ATTR_SIZE_BYTES, c.size);
+		nla_put_u64(nlh, NBD_ATTR_BLOCK_SIZE_BYTES, o->block_size);
+		nla_put_u64(nlh, NBD_ATTR_SERVER_FLAGS,
+			    o->server_flags >= 0 ? o->server_flags : c.flags);
+	}
+	if (o->client_flags)
+		nla_put_u64(nlh, NBD_ATTR_CLIENT_FLAGS, o->client_flags);
+	put_config(nlh, o, &c);
+
+	t = now_ms();
+	ret = genl_transact(sock, nlh, reply);
+	cmd_ms = now_ms() - t;
+	if (ret) {
+		fprintf(stderr, "%s: %s\n",
+			reconfigure ? "NBD_CMD_RECONFIGURE" : "NBD_CMD_CONNECT",
+			strerror(-ret));
+		goto close;
+	}
+	if (!reconfigure) {
+		struct nlattr *nla;
+
+		nlh = (struct nlmsghdr *)reply;
+		nla = nla_find((char *)NLMSG_DATA(nlh) + GENL_HDRLEN,
+			       nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+			       NBD_ATTR_INDEX);
+		if (nla)
+			index = *(uint32_t *)NLA_DATA(nla);
+	}
+
+	printf("%s /dev/nbd%d: %d sockets, size %llu, flags %#x, handshake %.3f ms, %s %.3f ms\n",
+	       reconfigure ? "reconfigured" : "connected", index, c.nr,
+	       (unsigned long long)c.size,
+	       (unsigned int)(o->server_flags >= 0 ? o->server_flags : c.flags),
+	       handshake_ms, reconfigure ? "NBD_CMD_RECONFIGURE" :
+	       "NBD_CMD_CONNECT", cmd_ms);
+	fflush(stdout);
+	if (o->sample_secs)
+		sample_split(&c, o->sample_secs);
+
+close:
+	while (c.nr)
+		close(c.fds[--c.nr]);
+	return ret ? -1 : 0;
+}
+
+static int cmd_disconnect(int sock, int family, int index)
+{
+	char buf[NL_BUF_SIZE];
+	struct nlmsghdr *nlh;
+	double t;
+	int ret;
+
+	nlh = genl_msg_init(buf, family, NBD_CMD_DISCONNECT);
+	nla_put_u32(nlh, NBD_ATTR_INDEX, index);
+	t = now_ms();
+	ret = genl_transact(sock, nlh, NULL);
+	if (ret) {
+		fprintf(stderr, "NBD_CMD_DISCONNECT: %s\n", strerror(-ret));
+		return -1;
+	}
+	printf("disconnected /dev/nbd%d: NBD_CMD_DISCONNECT %.3f ms\n", index,
+	       now_ms() - t);
+	return 0;
+}
+
+static int cmd_status(int sock, int family, int index)
+{
+	char buf[NL_BUF_SIZE], reply[NL_BUF_SIZE];
+	struct nlmsghdr *nlh;
+	struct nlattr *list, *item;
+	int ret, len;
+
+	nlh = genl_msg_init(buf, family, NBD_CMD_STATUS);
+	if (index >= 0)
+		nla_put_u32(nlh, NBD_ATTR_INDEX, index);
+	memset(reply, 0, sizeof(reply));
+	ret = genl_transact(sock, nlh, reply);
+	if (ret) {
+		fprintf(stderr, "NBD_CMD_STATUS: %s\n", strerror(-ret));
+		return -1;
+	}
+
+	nlh = (struct nlmsghdr *)reply;
+	if (!nlh->nlmsg_len)
+		return 0;
+	list = nla_find((char *)NLMSG_DATA(nlh) + GENL_HDRLEN,
+			nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+			NBD_ATTR_DEVICE_LIST);
+	if (!list)
+		return 0;
+	item = NLA_DATA(list);
+	for (len = NLA_PAYLOAD(list);
+	     len >= NLA_HDRLEN && item->nla_len >= NLA_HDRLEN &&
+	     item->nla_len <= len;
+	     len -= NLA_ALIGN(item->nla_len),
+	     item = (struct nlattr *)((char *)item + NLA_ALIGN(item->nla_len))) {
+		struct nlattr *idx, *connected;
+
+		idx = nla_find(NLA_DATA(item), NLA_PAYLOAD(item),
+			       NBD_DEVICE_INDEX);
+		connected = nla_find(NLA_DATA(item), NLA_PAYLOAD(item),
+				     NBD_DEVICE_CONNECTED);
+		if (!idx || !connected)
+			continue;
+		printf("nbd%u %s\n", *(uint32_t *)NLA_DATA(idx),
+		       *(uint8_t *)NLA_DATA(connected) ? "connected" :
+		       "disconnected");
+	}
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s connect [OPTIONS] HOST PORT\n"
+		"       %s reconfigure -i INDEX [OPTIONS] HOST PORT\n"
+		"       %s disconnect -i INDEX\n"
+		"       %s status [-i INDEX]\n"
+		"  -i INDEX       nbd device index (connect: any free device)\n"
+		"  -C SOCKETS     number of connections (default 1)\n"
+		"  -b BLOCK_SIZE  block size (default 4096, connect only)\n"
+		"  -t TIMEOUT     request timeout in seconds\n"
+		"  -D TIMEOUT     dead connection timeout in seconds\n"
+		"  -F FLAGS       server flags instead of the advertised ones\n"
+		"  -d             destroy the device on disconnect\n"
+		"  -c             disconnect when the last opener closes\n"
+		"  -N NAME        export name (default \"\")\n"
+		"  -s SECONDS     sample the traffic split over the sockets\n",
+		progname, progname, progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct nbd_nl_opts o = {
+		.index = -1,
+		.nr_socks = 1,
+		.block_size = 4096,
+		.server_flags = -1,
+		.name = "",
+	};
+	const char *cmd;
+	int sock, family, opt, ret;
+
+	if (argc < 2)
+		usage(argv[0]);
+	cmd = argv[1];
+	optind = 2;
+	while ((opt = getopt(argc, argv, "b:cC:dD:F:i:N:s:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			o.block_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			o.client_flags |= NBD_CFLAG_DISCONNECT_ON_CLOSE;
+			break;
+		case 'C':
+			o.nr_socks = atoi(optarg);
+			break;
+		case 'd':
+			o.client_flags |= NBD_CFLAG_DESTROY_ON_DISCONNECT;
+			break;
+		case 'D':
+			o.dead_conn_timeout = strtoull(optarg, NULL, 0);
+			break;
+		case 'F':
+			o.server_flags = strtoll(optarg, NULL, 0);
+			break;
+		case 'i':
+			o.index = atoi(optarg);
+			break;
+		case 'N':
+			o.name = optarg;
+			break;
+		case 's':
+			o.sample_secs = atoi(optarg);
+			break;
+		case 't':
+			o.timeout = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (o.nr_socks < 0 || o.nr_socks > MAX_SOCKETS || o.sample_secs < 0)
+		usage(argv[0]);
+
+	if (!strcmp(cmd, "connect") || !strcmp(cmd, "reconfigure")) {
+		int reconfigure = cmd[0] == 'r';
+
+		if (argc - optind != 2 || (reconfigure && o.index < 0) ||
+		    (!reconfigure && !o.nr_socks))
+			usage(argv[0]);
+		sock = nbd_genl_open(&family);
+		if (sock < 0)
+			return EXIT_FAILURE;
+		ret = cmd_connect(sock, family, &o, argv[optind],
+				  argv[optind + 1], reconfigure);
+	} else if (!strcmp(cmd, "disconnect")) {
+		if (argc != optind || o.index < 0)
+			usage(argv[0]);
+		sock = nbd_genl_open(&family);
+		if (sock < 0)
+			return EXIT_FAILURE;
+		ret = cmd_disconnect(sock, family, o.index);
+	} else if (!strcmp(cmd, "status")) {
+		if (argc != optind)
+			usage(argv[0]);
+		sock = nbd_genl_open(&family);
+		if (sock < 0)
+			return EXIT_FAILURE;
+		ret = cmd_status(sock, family, o.index);
+	} else {
+		usage(argv[0]);
+	}
+	close(sock);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
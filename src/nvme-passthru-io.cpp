@@ -0,0 +1,495 @@
+// SPDX-License-Identifier: GPL-2.0+
+
+/*
+ * Issue NVMe read and write commands to an NVMe generic char device
+ * (/dev/ngXnY) through IORING_OP_URING_CMD, with the data scattered over
+ * several misaligned user buffer segments, and report throughput and
+ * latency percentiles. Optionally tags every LBA written so that a later
+ * read pass can check what came back.
+ */
+
+#include <algorithm>   // std::sort()
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>     // strtoul()
+#include <cstring>     // memset()
+#include <ctime>       // clock_gettime()
+#include <fcntl.h>     // O_RDWR
+#include <getopt.h>    // getopt_long()
+#include <iomanip>
+#include <iostream>
+#include <liburing.h>
+#include <linux/nvme_ioctl.h>
+#include <random>
+#include <sys/ioctl.h>
+#include <sys/mman.h>  // mmap()
+#include <sys/uio.h>   // struct iovec
+#include <unistd.h>    // open()
+#include <vector>
+
+enum {
+	nvme_cmd_write = 0x01,
+	nvme_cmd_read = 0x02,
+	nvme_admin_identify = 0x06,
+};
+
+static const size_t page_size = 4096;
+
+class file_descriptor {
+public:
+	file_descriptor(int fd = -1)
+		: m_fd(fd)
+	{ }
+	~file_descriptor()
+	{ if (m_fd >= 0) close(m_fd); }
+	operator int() const
+	{ return m_fd; }
+
+private:
+	file_descriptor(const file_descriptor &);
+	file_descriptor &operator=(const file_descriptor &);
+
+	int m_fd;
+};
+
+struct ns_info {
+	uint32_t nsid;
+	uint32_t lba_size;
+	uint64_t nr_lbas;
+};
+
+/* Identify Namespace (CNS 0) for the LBA size and the namespace size. */
+static bool identify_ns(int fd, ns_info &ns)
+{
+	struct nvme_passthru_cmd cmd;
+	std::vector<uint8_t> id(4096);
+	unsigned lbaf;
+	int ret;
+
+	ret = ioctl(fd, NVME_IOCTL_ID);
+	if (ret <= 0) {
+		std::cerr << "NVME_IOCTL_ID failed: " << strerror(errno)
+			  << '\n';
+		return false;
+	}
+	ns.nsid = ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = nvme_admin_identify;
+	cmd.nsid = ns.nsid;
+	cmd.addr = (uintptr_t)id.data();
+	cmd.data_len = id.size();
+	ret = ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	if (ret) {
+		std::cerr << "Identify Namespace failed: "
+			  << (ret < 0 ? strerror(errno) : "NVMe status")
+			  << '\n';
+		return false;
+	}
+
+	ns.nr_lbas = 0;
+	for (int i = 7; i >= 0; i--)
+		ns.nr_lbas = ns.nr_lbas << 8 | id[i];
+	/* FLBAS bits 3:0 and 6:5 select the LBA format */
+	lbaf = (id[26] & 0xf) | ((id[26] >> 5) & 0x3) << 4;
+	if (id[128 + lbaf * 4] | id[128 + lbaf * 4 + 1]) {
+		std::cerr << "Namespaces with metadata are not supported\n";
+		return false;
+	}
+	ns.lba_size = 1u << id[128 + lbaf * 4 + 2];
+	return true;
+}
+
+struct options {
+	bool write = false;
+	bool random = false;
+	bool fixed = false;
+	bool iopoll = false;
+	bool verify = false;
+	unsigned bs = 4096;
+	unsigned depth = 16;
+	unsigned segs = 1;
+	unsigned misalign = 0;
+	unsigned long count = 10000;
+	unsigned long seed = 1;
+	uint64_t offset = 0;
+	uint64_t size = 0;
+};
+
+/*
+ * One outstanding command: its buffer segments, each starting <misalign>
+ * bytes into its own page run, with an unused page between segments so that
+ * no two segments are virtually contiguous.
+ */
+struct io_slot {
+	uint8_t *base;
+	size_t region_len;
+	std::vector<struct iovec> iov;
+	uint64_t slba;
+	uint64_t start_ns;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t round_up(size_t v, size_t align)
+{
+	return (v + align - 1) / align * align;
+}
+
+static void layout_slot(io_slot &slot, uint8_t *base, const options &o)
+{
+	size_t seg_len = o.bs / o.segs;
+	size_t step = round_up(seg_len + o.bs % o.segs + o.misalign,
+			       page_size) + page_size;
+
+	slot.base = base;
+	slot.region_len = step * o.segs;
+	slot.iov.resize(o.segs);
+	for (unsigned i = 0; i < o.segs; i++) {
+		slot.iov[i].iov_base = base + i * step + o.misalign;
+		slot.iov[i].iov_len = seg_len;
+	}
+	slot.iov.back().iov_len += o.bs % o.segs;
+}
+
+/* The pattern byte at byte offset @pos of the namespace. */
+static uint8_t tag_byte(uint64_t pos)
+{
+	uint64_t word = (pos & ~7ull) ^ 0xa5a5000000000000ull;
+
+	return word >> (pos & 7) * 8;
+}
+
+static void fill_tags(const io_slot &slot, uint64_t pos)
+{
+	for (auto &v : slot.iov) {
+		uint8_t *p = (uint8_t *)v.iov_base;
+
+		for (size_t i = 0; i < v.iov_len; i++)
+			p[i] = tag_byte(pos++);
+	}
+}
+
+static bool check_tags(const io_slot &slot, uint64_t pos, unsigned lba_size)
+{
+	for (auto &v : slot.iov) {
+		const uint8_t *p = (const uint8_t *)v.iov_base;
+
+		for (size_t i = 0; i < v.iov_len; i++, pos++) {
+			if (p[i] == tag_byte(pos))
+				continue;
+			std::cerr << "Mismatch at LBA " << pos / lba_size
+				  << " offset " << pos % lba_size
+				  << ": expected 0x" << std::hex
+				  << (unsigned)tag_byte(pos) << " got 0x"
+				  << (unsigned)p[i] << std::dec << '\n';
+			return false;
+		}
+	}
+	return true;
+}
+
+static void prep_cmd(struct io_uring_sqe *sqe, int fd, unsigned idx,
+		     const io_slot &slot, const ns_info &ns, const options &o)
+{
+	struct nvme_uring_cmd *cmd;
+	uint32_t nlb = o.bs / ns.lba_size - 1;
+
+	memset(sqe, 0, 2 * sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->user_data = idx;
+
+	cmd = (struct nvme_uring_cmd *)sqe->cmd;
+	cmd->opcode = o.write ? nvme_cmd_write : nvme_cmd_read;
+	cmd->nsid = ns.nsid;
+	cmd->cdw10 = slot.slba & 0xffffffff;
+	cmd->cdw11 = slot.slba >> 32;
+	cmd->cdw12 = nlb;
+	if (o.segs > 1) {
+		sqe->cmd_op = NVME_URING_CMD_IO_VEC;
+		cmd->addr = (uintptr_t)slot.iov.data();
+		cmd->data_len = slot.iov.size();
+	} else {
+		sqe->cmd_op = NVME_URING_CMD_IO;
+		cmd->addr = (uintptr_t)slot.iov[0].iov_base;
+		cmd->data_len = o.bs;
+		if (o.fixed) {
+			sqe->uring_cmd_flags = IORING_URING_CMD_FIXED;
+			sqe->buf_index = idx;
+		}
+	}
+}
+
+static void print_latency(std::vector<uint64_t> &lat)
+{
+	std::sort(lat.begin(), lat.end());
+	uint64_t sum = 0;
+	for (auto l : lat)
+		sum += l;
+	auto pct = [&](double p) {
+		return lat[std::min(lat.size() - 1,
+				    (size_t)(lat.size() * p / 100))] / 1e3;
+	};
+
+	std::cout << std::fixed << std::setprecision(1)
+		  << "latency (us): min " << lat.front() / 1e3
+		  << " avg " << sum / lat.size() / 1e3
+		  << " p50 " << pct(50) << " p90 " << pct(90)
+		  << " p99 " << pct(99) << " p99.9 " << pct(99.9)
+		  << " max " << lat.back() / 1e3 << '\n';
+}
+
+static int run(int fd, const ns_info &ns, const options &o)
+{
+	uint64_t first = o.offset / ns.lba_size;
+	uint64_t nlb = o.bs / ns.lba_size;
+	uint64_t nr_cmds;
+	std::mt19937_64 rng(o.seed);
+	std::vector<io_slot> slots(o.depth);
+	std::vector<unsigned> free_slots;
+	std::vector<uint64_t> lat;
+	struct io_uring ring;
+	uint8_t *arena;
+	size_t slot_len;
+	unsigned long submitted = 0, completed = 0, next = 0;
+	uint64_t start;
+	unsigned flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+	int ret;
+
+	nr_cmds = (o.size ? o.size : ns.nr_lbas * ns.lba_size - o.offset) /
+		o.bs;
+	if (o.offset % ns.lba_size || o.bs % ns.lba_size ||
+	    first + nlb > ns.nr_lbas || !nr_cmds) {
+		std::cerr << "Offset and block size have to be multiples of "
+			  << ns.lba_size << " bytes within the namespace\n";
+		return 1;
+	}
+	nr_cmds = std::min(nr_cmds, (ns.nr_lbas - first) / nlb);
+
+	if (o.iopoll)
+		flags |= IORING_SETUP_IOPOLL;
+	ret = io_uring_queue_init(o.depth, &ring, flags);
+	if (ret) {
+		std::cerr << "io_uring_queue_init failed: " << strerror(-ret)
+			  << '\n';
+		return 1;
+	}
+
+	layout_slot(slots[0], NULL, o);
+	slot_len = slots[0].region_len;
+	arena = (uint8_t *)mmap(NULL, slot_len * o.depth,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED) {
+		std::cerr << "mmap failed: " << strerror(errno) << '\n';
+		io_uring_queue_exit(&ring);
+		return 1;
+	}
+	for (unsigned i = 0; i < o.depth; i++) {
+		layout_slot(slots[i], arena + i * slot_len, o);
+		free_slots.push_back(o.depth - 1 - i);
+	}
+
+	if (o.fixed) {
+		std::vector<struct iovec> bufs(o.depth);
+
+		for (unsigned i = 0; i < o.depth; i++) {
+			bufs[i].iov_base = slots[i].base;
+			bufs[i].iov_len = slots[i].region_len;
+		}
+		ret = io_uring_register_buffers(&ring, bufs.data(), o.depth);
+		if (ret) {
+			std::cerr << "io_uring_register_buffers failed: "
+				  << strerror(-ret) << '\n';
+			goto out;
+		}
+	}
+
+	lat.reserve(o.count);
+	start = now_ns();
+	while (completed < o.count) {
+		struct io_uring_cqe *cqe;
+		unsigned head, seen = 0;
+
+		while (submitted < o.count && !free_slots.empty()) {
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+			unsigned idx = free_slots.back();
+			io_slot &slot = slots[idx];
+			uint64_t n;
+
+			if (!sqe)
+				break;
+			free_slots.pop_back();
+			n = o.random ? rng() % nr_cmds : next++ % nr_cmds;
+			slot.slba = first + n * nlb;
+			if (o.write && o.verify)
+				fill_tags(slot, slot.slba * ns.lba_size);
+			prep_cmd(sqe, fd, idx, slot, ns, o);
+			slot.start_ns = now_ns();
+			submitted++;
+		}
+
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0) {
+			std::cerr << "io_uring_submit_and_wait failed: "
+				  << strerror(-ret) << '\n';
+			goto out;
+		}
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			unsigned idx = cqe->user_data;
+			io_slot &slot = slots[idx];
+
+			seen++;
+			completed++;
+			lat.push_back(now_ns() - slot.start_ns);
+			if (cqe->res) {
+				std::cerr << (o.write ? "Write" : "Read")
+					  << " of LBA " << slot.slba
+					  << " failed: ";
+				if (cqe->res < 0)
+					std::cerr << strerror(-cqe->res);
+				else
+					std::cerr << "NVMe status 0x"
+						  << std::hex << cqe->res
+						  << std::dec;
+				std::cerr << '\n';
+				ret = -EIO;
+				break;
+			}
+			if (!o.write && o.verify &&
+			    !check_tags(slot, slot.slba * ns.lba_size,
+					ns.lba_size)) {
+				ret = -EIO;
+				break;
+			}
+			free_slots.push_back(idx);
+		}
+		io_uring_cq_advance(&ring, seen);
+		if (ret < 0)
+			goto out;
+	}
+
+	{
+		double secs = (now_ns() - start) / 1e9;
+
+		std::cout << std::fixed << std::setprecision(1)
+			  << (o.write ? "write" : "read") << ": " << completed
+			  << " commands of " << o.bs << " bytes in "
+			  << o.segs << (o.segs > 1 ? " segments" : " segment")
+			  << " in " << secs << " s, " << completed / secs
+			  << " IOPS, "
+			  << completed * o.bs / secs / (1 << 20) << " MiB/s\n";
+		print_latency(lat);
+	}
+	ret = 0;
+
+out:
+	/* IOPOLL commands can only be reaped by polling, don't leave any */
+	while (submitted > completed && ret < 0) {
+		struct io_uring_cqe *cqe;
+
+		if (io_uring_wait_cqe(&ring, &cqe))
+			break;
+		io_uring_cqe_seen(&ring, cqe);
+		completed++;
+	}
+	io_uring_queue_exit(&ring);
+	munmap(arena, slot_len * o.depth);
+	return ret ? 1 : 0;
+}
+
+static void usage()
+{
+	std::cout << "Usage: [-h] [-w] [-r] [-b <block_size>] [-d <queue_depth>] [-n <count>] [-o <offset>] [-s <size>]\n"
+		"       [--segs <n>] [--misalign <bytes>] [--fixed] [--iopoll] [--verify] [--seed <seed>] <ngdev>\n"
+		"  Submit <count> (default 10000) NVMe read or, with -w, write commands\n"
+		"  of <block_size> (default 4096) bytes through IORING_OP_URING_CMD,\n"
+		"  keeping up to <queue_depth> (default 16) outstanding, and print\n"
+		"  throughput and latency percentiles.\n"
+		"  -r: pick LBAs at random instead of sequentially, within <size>\n"
+		"      bytes (default: up to the end of the namespace) at <offset>.\n"
+		"  --segs: split the data over <n> user buffer segments which are\n"
+		"      not virtually contiguous, using NVME_URING_CMD_IO_VEC.\n"
+		"  --misalign: start every segment <bytes> past a page boundary.\n"
+		"  --fixed: use registered buffers. Only for a single segment.\n"
+		"  --iopoll: set up the ring with IORING_SETUP_IOPOLL.\n"
+		"  --verify: tag written data with its byte offset and check the\n"
+		"      tags on reads. Exits with 1 on a mismatch.\n";
+}
+
+int main(int argc, char **argv)
+{
+	enum {
+		OPT_SEGS = 256,
+		OPT_MISALIGN,
+		OPT_FIXED,
+		OPT_IOPOLL,
+		OPT_VERIFY,
+		OPT_SEED,
+	};
+	static const struct option longopts[] = {
+		{ "segs",	required_argument,	NULL, OPT_SEGS },
+		{ "misalign",	required_argument,	NULL, OPT_MISALIGN },
+		{ "fixed",	no_argument,		NULL, OPT_FIXED },
+		{ "iopoll",	no_argument,		NULL, OPT_IOPOLL },
+		{ "verify",	no_argument,		NULL, OPT_VERIFY },
+		{ "seed",	required_argument,	NULL, OPT_SEED },
+		{ NULL, 0, NULL, 0 }
+	};
+	options o;
+	ns_info ns;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "b:d:hn:o:rs:w", longopts,
+				NULL)) != EOF) {
+		switch (c) {
+		case 'b': o.bs = strtoul(optarg, NULL, 0); break;
+		case 'd': o.depth = strtoul(optarg, NULL, 0); break;
+		case 'n': o.count = strtoul(optarg, NULL, 0); break;
+		case 'o': o.offset = strtoull(optarg, NULL, 0); break;
+		case 'r': o.random = true; break;
+		case 's': o.size = strtoull(optarg, NULL, 0); break;
+		case 'w': o.write = true; break;
+		case OPT_SEGS: o.segs = strtoul(optarg, NULL, 0); break;
+		case OPT_MISALIGN: o.misalign = strtoul(optarg, NULL, 0); break;
+		case OPT_FIXED: o.fixed = true; break;
+		case OPT_IOPOLL: o.iopoll = true; break;
+		case OPT_VERIFY: o.verify = true; break;
+		case OPT_SEED: o.seed = strtoul(optarg, NULL, 0); break;
+		default: usage(); return 1;
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage();
+		return 1;
+	}
+	if (!o.bs || !o.depth || !o.count || !o.segs || o.segs > o.bs ||
+	    o.misalign >= page_size) {
+		std::cerr << "Invalid block size, queue depth, count, segment count or misalignment\n";
+		return 1;
+	}
+	if (o.fixed && o.segs > 1) {
+		std::cerr << "--fixed only supports a single segment\n";
+		return 1;
+	}
+
+	file_descriptor fd(open(argv[optind], O_RDWR));
+	if (fd < 0) {
+		std::cerr << "Failed to open " << argv[optind] << ": "
+			  << strerror(errno) << '\n';
+		return 1;
+	}
+	if (!identify_ns(fd, ns))
+		return 1;
+
+	return run(fd, ns, o);
+}
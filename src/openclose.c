@@ -1,41 +1,259 @@
 // SPDX-License-Identifier: GPL-3.0+
 // Copyright (C) 2017 Omar Sandoval
 
-/* Open and close a file repeatedly. */
+/*
+ * Open and close a file repeatedly.
+ *
+ * Without options this opens and closes one path REPEAT times. Options let
+ * several threads do so across several paths, add open flags, interleave
+ * BLKRRPART partition rescans with the opens, and print open and close
+ * latency histograms and an ops/s summary.
+ */
 
+#define _GNU_SOURCE		/* O_DIRECT */
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/fs.h>		/* BLKRRPART */
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-int main(int argc, char **argv)
+/* log2 buckets of microseconds, the last one catches everything above */
+#define NR_LAT_BUCKETS	24
+
+struct lat_hist {
+	unsigned long long buckets[NR_LAT_BUCKETS];
+	unsigned long long count, sum_ns, min_ns, max_ns;
+};
+
+struct oc_thread {
+	pthread_t thread;
+	const char *path;
+	int flags;
+	int repeat;
+	int rrpart_every;
+	int err;
+
+	struct lat_hist open_lat, close_lat;
+	unsigned long long busy;		/* O_EXCL opens which got EBUSY */
+	unsigned long long rrpart_ok, rrpart_failed;
+};
+
+static unsigned long long now_ns(void)
 {
-	int i, n;
+	struct timespec ts;
 
-	if (argc != 3) {
-		fprintf(stderr, "usage: %s PATH REPEAT\n", argv[0]);
-		return EXIT_FAILURE;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lat_add(struct lat_hist *h, unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int b = 0;
+
+	while (us && b < NR_LAT_BUCKETS - 1) {
+		us >>= 1;
+		b++;
 	}
+	h->buckets[b]++;
+	if (!h->count || ns < h->min_ns)
+		h->min_ns = ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->count++;
+	h->sum_ns += ns;
+}
+
+static void lat_merge(struct lat_hist *to, const struct lat_hist *from)
+{
+	int b;
+
+	if (!from->count)
+		return;
+	for (b = 0; b < NR_LAT_BUCKETS; b++)
+		to->buckets[b] += from->buckets[b];
+	if (!to->count || from->min_ns < to->min_ns)
+		to->min_ns = from->min_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+	to->count += from->count;
+	to->sum_ns += from->sum_ns;
+}
 
-	n = atoi(argv[2]);
+static void lat_print(const char *what, const struct lat_hist *h)
+{
+	int b;
+
+	if (!h->count)
+		return;
+	printf("%s latency (us): min %.1f avg %.1f max %.1f\n", what,
+	       h->min_ns / 1e3, h->sum_ns / 1e3 / h->count, h->max_ns / 1e3);
+	for (b = 0; b < NR_LAT_BUCKETS; b++) {
+		if (!h->buckets[b])
+			continue;
+		if (b == NR_LAT_BUCKETS - 1)
+			printf("  [%8llu,      inf) %llu\n", 1ULL << (b - 1),
+			       h->buckets[b]);
+		else
+			printf("  [%8llu, %8llu) %llu\n",
+			       b ? 1ULL << (b - 1) : 0, 1ULL << b,
+			       h->buckets[b]);
+	}
+}
 
-	for (i = 0; i < n; i++) {
-		int fd;
+static void *oc_thread_fn(void *arg)
+{
+	struct oc_thread *t = arg;
+	unsigned long long start;
+	int i, fd;
 
-		fd = open(argv[1], O_RDWR);
+	for (i = 0; i < t->repeat; i++) {
+		start = now_ns();
+		fd = open(t->path, t->flags);
 		if (fd == -1) {
+			if (errno == EBUSY && (t->flags & O_EXCL)) {
+				t->busy++;
+				continue;
+			}
+			t->err = errno;
 			perror("open");
-			return EXIT_FAILURE;
+			return NULL;
 		}
+		lat_add(&t->open_lat, now_ns() - start);
 
+		if (t->rrpart_every && i % t->rrpart_every == 0) {
+			if (ioctl(fd, BLKRRPART) == 0)
+				t->rrpart_ok++;
+			else
+				t->rrpart_failed++;
+		}
+
+		start = now_ns();
 		if (close(fd) == -1) {
-			perror("open");
+			t->err = errno;
+			perror("close");
+			return NULL;
+		}
+		lat_add(&t->close_lat, now_ns() - start);
+	}
+	return NULL;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [-t THREADS] [-x] [-d] [-r] [-p N] [-s] PATH [PATH...] REPEAT\n"
+		"  -t: open and close from THREADS threads, REPEAT times each,\n"
+		"      thread i using the (i %% number of paths)th path\n"
+		"  -x: open with O_EXCL, opens failing with EBUSY are counted\n"
+		"  -d: open with O_DIRECT\n"
+		"  -r: open read-only instead of read-write\n"
+		"  -p: issue BLKRRPART after every Nth open of each thread\n"
+		"  -s: print an ops/s summary and latency histograms\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int nr_threads = 1, flags = O_RDWR, rrpart_every = 0, stats = 0;
+	struct lat_hist open_lat = { }, close_lat = { };
+	unsigned long long busy = 0, rrpart_ok = 0, rrpart_failed = 0;
+	unsigned long long start, elapsed_ns;
+	struct oc_thread *threads;
+	int i, n, opt, nr_paths, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "dp:rst:x")) != -1) {
+		switch (opt) {
+		case 'd':
+			flags |= O_DIRECT;
+			break;
+		case 'p':
+			rrpart_every = atoi(optarg);
+			break;
+		case 'r':
+			flags = (flags & ~O_RDWR) | O_RDONLY;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'x':
+			flags |= O_EXCL;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	nr_paths = argc - optind - 1;
+	if (nr_paths < 1 || nr_threads < 1 || rrpart_every < 0)
+		usage(argv[0]);
+
+	n = atoi(argv[argc - 1]);
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		struct oc_thread *t = &threads[i];
+
+		t->path = argv[optind + i % nr_paths];
+		t->flags = flags;
+		t->repeat = n;
+		t->rrpart_every = rrpart_every;
+		if (nr_threads == 1) {
+			oc_thread_fn(t);
+			break;
+		}
+		errno = pthread_create(&t->thread, NULL, oc_thread_fn, t);
+		if (errno) {
+			perror("pthread_create");
 			return EXIT_FAILURE;
 		}
 	}
+	for (i = 0; nr_threads > 1 && i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed_ns = now_ns() - start;
+
+	for (i = 0; i < nr_threads; i++) {
+		struct oc_thread *t = &threads[i];
+
+		if (t->err)
+			ret = EXIT_FAILURE;
+		lat_merge(&open_lat, &t->open_lat);
+		lat_merge(&close_lat, &t->close_lat);
+		busy += t->busy;
+		rrpart_ok += t->rrpart_ok;
+		rrpart_failed += t->rrpart_failed;
+	}
+
+	if (stats) {
+		printf("%llu opens on %d threads, %d paths in %.3f s, %.0f ops/s\n",
+		       open_lat.count, nr_threads, nr_paths, elapsed_ns / 1e9,
+		       elapsed_ns ? open_lat.count * 1e9 / elapsed_ns : 0.0);
+		if (flags & O_EXCL)
+			printf("%llu opens failed with EBUSY\n", busy);
+		if (rrpart_every)
+			printf("BLKRRPART: %llu ok, %llu failed\n", rrpart_ok,
+			       rrpart_failed);
+		lat_print("open", &open_lat);
+		lat_print("close", &close_lat);
+	}
 
-	return EXIT_SUCCESS;
+	free(threads);
+	return ret;
 }
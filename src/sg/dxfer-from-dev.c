@@ -1,6 +1,11 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
@@ -10,7 +15,96 @@
 
 #include <scsi/sg.h>
 
-int main(int argc, char **argv)
+/*
+ * Without options, write a single 42 byte SG_DXFER_FROM_DEV request through
+ * the old sg_header interface and check that it is accepted.
+ *
+ * With options, run an asynchronous stress engine instead: THREADS threads
+ * each keep DEPTH sg_io_hdr commands outstanding on each of their FDS file
+ * descriptors, submitted with write() and reaped with poll() and read().
+ * The commands mix TEST UNIT READY (SG_DXFER_NONE), INQUIRY and READ(10)
+ * (SG_DXFER_FROM_DEV and SG_DXFER_TO_FROM_DEV) and, with -w, WRITE(10)
+ * (SG_DXFER_TO_DEV), and the reserved buffer size of a random fd is changed
+ * every RESV_EVERY completions. Every command carries a pack_id unique to
+ * its fd and the slot it uses as usr_ptr, so completions with an unknown or
+ * already reaped pack_id, with a usr_ptr not matching the pack_id, and
+ * commands that never complete are detected.
+ */
+
+#define MAX_DEPTH	16	/* SG_MAX_QUEUE */
+#define SENSE_LEN	32
+
+enum cmd_kind {
+	CMD_TUR,
+	CMD_INQUIRY,
+	CMD_READ,
+	CMD_READ_TO_FROM,
+	CMD_WRITE,
+	NR_CMD_KINDS,
+};
+
+static const char * const cmd_names[NR_CMD_KINDS] = {
+	[CMD_TUR] = "TEST UNIT READY (none)",
+	[CMD_INQUIRY] = "INQUIRY (from_dev)",
+	[CMD_READ] = "READ(10) (from_dev)",
+	[CMD_READ_TO_FROM] = "READ(10) (to_from_dev)",
+	[CMD_WRITE] = "WRITE(10) (to_dev)",
+};
+
+static const int resv_sizes[] = { 0, 4096, 32768, 131072, 1048576 };
+
+struct sg_stress_opts {
+	const char *dev;
+	int nr_threads, nr_fds, depth;
+	int secs;
+	unsigned int max_bytes;
+	int write;
+	int resv_every;
+	unsigned int timeout_ms;
+
+	unsigned int block_size;
+	unsigned long long nr_blocks;	/* 0 if READ CAPACITY failed */
+};
+
+struct sg_slot {
+	int busy;
+	int pack_id;
+	enum cmd_kind kind;
+	unsigned char cdb[10];
+	unsigned char sense[SENSE_LEN];
+	unsigned char *buf;
+	struct sg_io_hdr hdr;
+};
+
+struct sg_stress_fd {
+	int fd;
+	int next_seq;
+	int outstanding;
+	struct sg_slot slots[MAX_DEPTH];
+};
+
+struct sg_stress_thread {
+	pthread_t thread;
+	const struct sg_stress_opts *o;
+	unsigned int seed;
+	struct sg_stress_fd *fds;
+	int err;
+
+	unsigned long long cmds[NR_CMD_KINDS], bytes;
+	unsigned long long cmd_errors;
+	unsigned long long lost, duplicated, unknown, mismatched;
+	unsigned long long resv_ok, resv_busy, resv_failed;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int legacy_dxfer_from_dev(const char *dev)
 {
 	int fd;
 	int rc;
@@ -18,12 +112,7 @@ int main(int argc, char **argv)
 	int tout = 10800000;
 	char buf[42] = { 0 };
 
-	if (argc != 2) {
-		printf("usage: %s /dev/sgX\n", argv[0]);
-		return 1;
-	}
-
-	fd = open(argv[1], O_RDWR);
+	fd = open(dev, O_RDWR);
 	if (fd < 0) {
 		perror("open");
 		return 1;
@@ -56,3 +145,450 @@ out_close:
 	close(fd);
 	return (rc ? 1 : 0);
 }
+
+static void put_be32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned int get_be32(const unsigned char *p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* synchronous READ CAPACITY(10) to find the range READ/WRITE may use */
+static void read_capacity(struct sg_stress_opts *o)
+{
+	unsigned char cdb[10] = { 0x25 }, data[8], sense[SENSE_LEN];
+	struct sg_io_hdr hdr = {
+		.interface_id = 'S',
+		.dxfer_direction = SG_DXFER_FROM_DEV,
+		.cmd_len = sizeof(cdb),
+		.mx_sb_len = sizeof(sense),
+		.dxfer_len = sizeof(data),
+		.dxferp = data,
+		.cmdp = cdb,
+		.sbp = sense,
+		.timeout = 30000,
+	};
+	int fd;
+
+	o->nr_blocks = 0;
+	fd = open(o->dev, O_RDWR);
+	if (fd < 0)
+		return;
+	if (!ioctl(fd, SG_IO, &hdr) && !hdr.status && !hdr.host_status &&
+	    !hdr.driver_status) {
+		o->nr_blocks = (unsigned long long)get_be32(data) + 1;
+		o->block_size = get_be32(data + 4);
+		if (!o->block_size || o->block_size > o->max_bytes)
+			o->nr_blocks = 0;
+	}
+	close(fd);
+	if (!o->nr_blocks)
+		fprintf(stderr,
+			"READ CAPACITY failed, only TEST UNIT READY and INQUIRY\n");
+}
+
+static void prep_cmd(struct sg_stress_thread *t, struct sg_stress_fd *f,
+		     int idx)
+{
+	const struct sg_stress_opts *o = t->o;
+	struct sg_slot *s = &f->slots[idx];
+	struct sg_io_hdr *hdr = &s->hdr;
+	int nr_kinds = o->nr_blocks ? (o->write ? 5 : 4) : 2;
+	unsigned int blocks = 0;
+
+	s->kind = rand_r(&t->seed) % nr_kinds;
+	memset(s->cdb, 0, sizeof(s->cdb));
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->interface_id = 'S';
+	hdr->cmdp = s->cdb;
+	hdr->sbp = s->sense;
+	hdr->mx_sb_len = sizeof(s->sense);
+	hdr->dxferp = s->buf;
+	hdr->timeout = o->timeout_ms;
+	hdr->usr_ptr = s;
+
+	switch (s->kind) {
+	case CMD_TUR:
+		hdr->cmd_len = 6;
+		hdr->dxfer_direction = SG_DXFER_NONE;
+		hdr->dxferp = NULL;
+		break;
+	case CMD_INQUIRY:
+		hdr->cmd_len = 6;
+		s->cdb[0] = 0x12;
+		s->cdb[4] = 96;
+		hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+		hdr->dxfer_len = 96;
+		break;
+	case CMD_READ:
+	case CMD_READ_TO_FROM:
+	case CMD_WRITE: {
+		unsigned long long lba, max_lba = o->nr_blocks;
+		unsigned int max_blocks = o->max_bytes / o->block_size;
+
+		if (max_blocks > 0xffff)
+			max_blocks = 0xffff;
+		blocks = 1 + rand_r(&t->seed) % max_blocks;
+		if (blocks > max_lba)
+			blocks = max_lba;
+		/* READ CAPACITY(10) limits max_lba to 2^32 */
+		lba = (((unsigned long long)rand_r(&t->seed) << 31) |
+		       rand_r(&t->seed)) % (max_lba - blocks + 1);
+		hdr->cmd_len = 10;
+		s->cdb[0] = s->kind == CMD_WRITE ? 0x2a : 0x28;
+		put_be32(s->cdb + 2, lba);
+		s->cdb[7] = blocks >> 8;
+		s->cdb[8] = blocks;
+		hdr->dxfer_len = blocks * o->block_size;
+		hdr->dxfer_direction = s->kind == CMD_WRITE ? SG_DXFER_TO_DEV :
+			s->kind == CMD_READ ? SG_DXFER_FROM_DEV :
+			SG_DXFER_TO_FROM_DEV;
+		break;
+	}
+	default:
+		break;
+	}
+
+	/* pack_ids of a slot are idx, idx + MAX_DEPTH, ... */
+	s->pack_id = f->next_seq++ * MAX_DEPTH + idx;
+	hdr->pack_id = s->pack_id;
+}
+
+/* returns 0, or -1 if the command could not be queued right now */
+static int submit(struct sg_stress_thread *t, struct sg_stress_fd *f, int idx)
+{
+	struct sg_slot *s = &f->slots[idx];
+
+	prep_cmd(t, f, idx);
+	if (write(f->fd, &s->hdr, sizeof(s->hdr)) < 0) {
+		/* the queue of the fd is full */
+		if (errno == EDOM || errno == EAGAIN)
+			return -1;
+		if (!t->err) {
+			t->err = errno;
+			perror("write");
+		}
+		return -1;
+	}
+	s->busy = 1;
+	f->outstanding++;
+	return 0;
+}
+
+static void fill(struct sg_stress_thread *t, struct sg_stress_fd *f,
+		 int stopping)
+{
+	int i;
+
+	for (i = 0; i < t->o->depth && !stopping && !t->err; i++)
+		if (!f->slots[i].busy && submit(t, f, i))
+			break;
+}
+
+/* read all completions of an fd, returns the number reaped */
+static int reap(struct sg_stress_thread *t, struct sg_stress_fd *f)
+{
+	struct sg_io_hdr hdr;
+	int n = 0;
+
+	for (;;) {
+		struct sg_slot *s;
+		int idx;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.interface_id = 'S';
+		hdr.pack_id = -1;	/* any */
+		if (read(f->fd, &hdr, sizeof(hdr)) < 0) {
+			if (errno != EAGAIN && errno != EINTR && !t->err) {
+				t->err = errno;
+				perror("read");
+			}
+			return n;
+		}
+		n++;
+
+		idx = hdr.pack_id >= 0 ? hdr.pack_id % MAX_DEPTH : -1;
+		s = idx >= 0 && idx < t->o->depth ? &f->slots[idx] : NULL;
+		if (!s || hdr.pack_id >= f->next_seq * MAX_DEPTH) {
+			t->unknown++;
+			fprintf(stderr, "fd %d: unknown pack_id %d\n", f->fd,
+				hdr.pack_id);
+			continue;
+		}
+		if (!s->busy || s->pack_id != hdr.pack_id) {
+			t->duplicated++;
+			fprintf(stderr, "fd %d: pack_id %d reaped twice\n",
+				f->fd, hdr.pack_id);
+			continue;
+		}
+		if (hdr.usr_ptr != s) {
+			t->mismatched++;
+			fprintf(stderr, "fd %d: pack_id %d has a foreign usr_ptr\n",
+				f->fd, hdr.pack_id);
+		}
+		s->busy = 0;
+		f->outstanding--;
+
+		if (hdr.status || hdr.host_status || hdr.driver_status) {
+			t->cmd_errors++;
+		} else {
+			t->cmds[s->kind]++;
+			t->bytes += s->hdr.dxfer_len - hdr.resid;
+		}
+	}
+}
+
+static void change_resv(struct sg_stress_thread *t)
+{
+	struct sg_stress_fd *f = &t->fds[rand_r(&t->seed) % t->o->nr_fds];
+	int size = resv_sizes[rand_r(&t->seed) %
+			      (sizeof(resv_sizes) / sizeof(resv_sizes[0]))];
+
+	if (!ioctl(f->fd, SG_SET_RESERVED_SIZE, &size))
+		t->resv_ok++;
+	else if (errno == EBUSY)
+		t->resv_busy++;
+	else
+		t->resv_failed++;
+}
+
+static void *stress_thread_fn(void *arg)
+{
+	struct sg_stress_thread *t = arg;
+	const struct sg_stress_opts *o = t->o;
+	double end = now() + o->secs;
+	/* after the run, wait this long for the outstanding commands */
+	double drain_end = 0;
+	unsigned long long reaped = 0;
+	struct pollfd *pfds;
+	int i, stopping = 0;
+
+	pfds = calloc(o->nr_fds, sizeof(*pfds));
+	if (!pfds) {
+		t->err = ENOMEM;
+		return NULL;
+	}
+	for (i = 0; i < o->nr_fds; i++) {
+		pfds[i].fd = t->fds[i].fd;
+		pfds[i].events = POLLIN;
+		fill(t, &t->fds[i], 0);
+	}
+
+	for (;;) {
+		int outstanding = 0;
+
+		if (!stopping && (now() >= end || t->err)) {
+			stopping = 1;
+			drain_end = now() + o->timeout_ms / 1e3 + 5;
+		}
+		for (i = 0; i < o->nr_fds; i++)
+			outstanding += t->fds[i].outstanding;
+		if (stopping && (!outstanding || now() >= drain_end))
+			break;
+
+		if (poll(pfds, o->nr_fds, 100) < 0) {
+			if (errno == EINTR)
+				continue;
+			t->err = errno;
+			perror("poll");
+			break;
+		}
+		for (i = 0; i < o->nr_fds; i++) {
+			int n;
+
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			n = reap(t, &t->fds[i]);
+			if (o->resv_every && !stopping &&
+			    (reaped + n) / o->resv_every > reaped / o->resv_every)
+				change_resv(t);
+			reaped += n;
+		}
+		/* also retries fds whose queue was full on the last attempt */
+		for (i = 0; i < o->nr_fds; i++)
+			fill(t, &t->fds[i], stopping);
+	}
+
+	for (i = 0; i < o->nr_fds; i++)
+		t->lost += t->fds[i].outstanding;
+	free(pfds);
+	return NULL;
+}
+
+static int sg_stress(struct sg_stress_opts *o)
+{
+	unsigned long long cmds[NR_CMD_KINDS] = { }, total = 0, bytes = 0;
+	unsigned long long cmd_errors = 0, lost = 0, duplicated = 0;
+	unsigned long long unknown = 0, mismatched = 0;
+	unsigned long long resv_ok = 0, resv_busy = 0, resv_failed = 0;
+	struct sg_stress_thread *threads;
+	double start, elapsed;
+	int i, j, k, ret = 0;
+
+	read_capacity(o);
+
+	threads = calloc(o->nr_threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < o->nr_threads; i++) {
+		struct sg_stress_thread *t = &threads[i];
+
+		t->o = o;
+		t->seed = i + 1;
+		t->fds = calloc(o->nr_fds, sizeof(*t->fds));
+		if (!t->fds) {
+			perror("calloc");
+			return 1;
+		}
+		for (j = 0; j < o->nr_fds; j++) {
+			struct sg_stress_fd *f = &t->fds[j];
+
+			f->fd = open(o->dev, O_RDWR | O_NONBLOCK);
+			if (f->fd < 0) {
+				perror("open");
+				return 1;
+			}
+			for (k = 0; k < o->depth; k++) {
+				if (posix_memalign((void **)&f->slots[k].buf,
+						   4096, o->max_bytes)) {
+					perror("posix_memalign");
+					return 1;
+				}
+				memset(f->slots[k].buf, 0, o->max_bytes);
+			}
+		}
+	}
+
+	start = now();
+	for (i = 0; i < o->nr_threads; i++) {
+		errno = pthread_create(&threads[i].thread, NULL,
+				       stress_thread_fn, &threads[i]);
+		if (errno) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < o->nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now() - start;
+
+	for (i = 0; i < o->nr_threads; i++) {
+		struct sg_stress_thread *t = &threads[i];
+
+		for (k = 0; k < NR_CMD_KINDS; k++) {
+			cmds[k] += t->cmds[k];
+			total += t->cmds[k];
+		}
+		bytes += t->bytes;
+		cmd_errors += t->cmd_errors;
+		lost += t->lost;
+		duplicated += t->duplicated;
+		unknown += t->unknown;
+		mismatched += t->mismatched;
+		resv_ok += t->resv_ok;
+		resv_busy += t->resv_busy;
+		resv_failed += t->resv_failed;
+		if (t->err)
+			ret = 1;
+		for (j = 0; j < o->nr_fds; j++) {
+			close(t->fds[j].fd);
+			for (k = 0; k < o->depth; k++)
+				free(t->fds[j].slots[k].buf);
+		}
+		free(t->fds);
+	}
+	free(threads);
+
+	printf("%llu commands on %d threads x %d fds x %d deep in %.3f s, %.0f cmds/s, %.1f MiB/s\n",
+	       total, o->nr_threads, o->nr_fds, o->depth, elapsed,
+	       total / elapsed, bytes / elapsed / (1 << 20));
+	for (k = 0; k < NR_CMD_KINDS; k++)
+		if (cmds[k])
+			printf("  %-24s %llu\n", cmd_names[k], cmds[k]);
+	printf("%llu command errors\n", cmd_errors);
+	printf("SG_SET_RESERVED_SIZE: %llu ok, %llu busy, %llu failed\n",
+	       resv_ok, resv_busy, resv_failed);
+	printf("pack_id: %llu lost, %llu duplicated, %llu unknown, %llu mismatched\n",
+	       lost, duplicated, unknown, mismatched);
+
+	if (lost || duplicated || unknown || mismatched || resv_failed)
+		ret = 1;
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
+
+static void usage(const char *progname)
+{
+	printf("usage: %s /dev/sgX\n"
+	       "       %s [-t THREADS] [-f FDS] [-q DEPTH] [-d SECONDS] [-b MAX_BYTES]\n"
+	       "          [-r RESV_EVERY] [-T TIMEOUT_MS] [-w] /dev/sgX\n"
+	       "  With options, keep DEPTH (default 8, at most 16) commands\n"
+	       "  outstanding on each of FDS (default 2) fds in each of THREADS\n"
+	       "  (default 4) threads for SECONDS (default 10). -w adds\n"
+	       "  WRITE(10) commands, which overwrite data on the device.\n",
+	       progname, progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sg_stress_opts o = {
+		.nr_threads = 4,
+		.nr_fds = 2,
+		.depth = 8,
+		.secs = 10,
+		.max_bytes = 65536,
+		.resv_every = 64,
+		.timeout_ms = 30000,
+	};
+	int opt;
+
+	if (argc == 2 && argv[1][0] != '-')
+		return legacy_dxfer_from_dev(argv[1]);
+
+	while ((opt = getopt(argc, argv, "b:d:f:q:r:t:T:w")) != -1) {
+		switch (opt) {
+		case 'b':
+			o.max_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			o.secs = atoi(optarg);
+			break;
+		case 'f':
+			o.nr_fds = atoi(optarg);
+			break;
+		case 'q':
+			o.depth = atoi(optarg);
+			break;
+		case 'r':
+			o.resv_every = atoi(optarg);
+			break;
+		case 't':
+			o.nr_threads = atoi(optarg);
+			break;
+		case 'T':
+			o.timeout_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			o.write = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || o.nr_threads < 1 || o.nr_fds < 1 ||
+	    o.depth < 1 || o.depth > MAX_DEPTH || o.secs < 1 ||
+	    o.max_bytes < 512 || o.resv_every < 0)
+		usage(argv[0]);
+	o.dev = argv[optind];
+
+	return sg_stress(&o);
+}
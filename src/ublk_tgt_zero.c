@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: GPL-3.0+
+
+/*
+ * External miniublk target, loaded with `miniublk add -t zero`: reads
+ * return zeroes and writes are dropped. Requests are collected by
+ * ->queue_io() and completed from ->handle_batch(), so the optional queue
+ * callbacks of the target ABI get exercised as well.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miniublk.h"
+
+#define ZERO_DEV_SIZE	(1ULL << 30)
+
+struct zero_queue {
+	int nr_pending;
+	int pending[];
+};
+
+static int zero_init_tgt(struct ublk_dev *dev)
+{
+	const struct ublksrv_ctrl_dev_info *info = ublk_dev_get_info(dev);
+	struct ublk_params *p = ublk_dev_get_params(dev);
+
+	ublk_dev_set_size(dev, ZERO_DEV_SIZE);
+	*p = (struct ublk_params) {
+		.types = UBLK_PARAM_TYPE_BASIC,
+		.basic = {
+			.logical_bs_shift	= 9,
+			.physical_bs_shift	= 12,
+			.io_opt_shift		= 12,
+			.io_min_shift		= 9,
+			.max_sectors		= info->max_io_buf_bytes >> 9,
+			.dev_sectors		= ZERO_DEV_SIZE >> 9,
+		},
+	};
+	return 0;
+}
+
+static int zero_recover_tgt(struct ublk_dev *dev)
+{
+	ublk_dev_set_size(dev, ublk_dev_get_params(dev)->basic.dev_sectors << 9);
+	return 0;
+}
+
+static int zero_init_queue(struct ublk_queue *q)
+{
+	struct zero_queue *zq;
+
+	zq = calloc(1, sizeof(*zq) +
+			ublk_queue_get_depth(q) * sizeof(zq->pending[0]));
+	if (!zq)
+		return -ENOMEM;
+	ublk_queue_set_data(q, zq);
+	return 0;
+}
+
+static void zero_deinit_queue(struct ublk_queue *q)
+{
+	free(ublk_queue_get_data(q));
+	ublk_queue_set_data(q, NULL);
+}
+
+static int zero_queue_io(struct ublk_queue *q, int tag)
+{
+	const struct ublksrv_io_desc *iod = ublk_queue_get_iod(q, tag);
+	struct zero_queue *zq = ublk_queue_get_data(q);
+
+	if (ublksrv_get_op(iod) == UBLK_IO_OP_READ)
+		memset(ublk_queue_get_io_buf(q, tag), 0, iod->nr_sectors << 9);
+	zq->pending[zq->nr_pending++] = tag;
+	return 0;
+}
+
+static void zero_handle_batch(struct ublk_queue *q, int nr_reaped)
+{
+	struct zero_queue *zq = ublk_queue_get_data(q);
+	int i;
+
+	for (i = 0; i < zq->nr_pending; i++) {
+		int tag = zq->pending[i];
+
+		ublk_complete_io(q, tag,
+				ublk_queue_get_iod(q, tag)->nr_sectors << 9);
+	}
+	zq->nr_pending = 0;
+}
+
+static const struct ublk_tgt_ops zero_ops = {
+	.name		= "zero",
+	.init_tgt	= zero_init_tgt,
+	.queue_io	= zero_queue_io,
+	.recover_tgt	= zero_recover_tgt,
+	.init_queue	= zero_init_queue,
+	.deinit_queue	= zero_deinit_queue,
+	.handle_batch	= zero_handle_batch,
+};
+
+const struct ublk_tgt_plugin ublk_tgt_plugin = {
+	.abi_version	= UBLK_TGT_ABI_VERSION,
+	.ops_size	= sizeof(struct ublk_tgt_ops),
+	.ops		= &zero_ops,
+};
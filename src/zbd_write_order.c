@@ -0,0 +1,453 @@
+// SPDX-License-Identifier: GPL-3.0+
+
+/*
+ * Zoned block device write ordering load generator.
+ *
+ * Writes N sequential write required zones at once, one thread and one
+ * io_uring per zone, each keeping up to <depth> O_DIRECT writes in flight
+ * at the zone write pointer. Every zone has its own write pointer tracker:
+ * writes are issued back to back from the zone start, the tracker only
+ * advances over completed writes, and once a zone is done its reported
+ * write pointer has to match the tracker. Write errors, which are what a
+ * reordered write to a sequential zone ends in, are counted per zone.
+ * Optionally reads the zones back to check that every block holds the data
+ * written for it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <liburing.h>
+#include <linux/blkzoned.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SECTOR_SHIFT	9
+
+struct zbd_wo_opts {
+	const char *dev;
+	unsigned long long start;	/* sector */
+	unsigned int nr_zones;
+	unsigned int depth;
+	unsigned int bs;
+	unsigned long long size;	/* bytes per zone, 0: zone capacity */
+	int verify;
+};
+
+struct zbd_wo_zone {
+	pthread_t thread;
+	unsigned int idx;
+	struct blk_zone zone;
+	int fd;
+	const struct zbd_wo_opts *opts;
+
+	/* byte offsets from the zone start */
+	unsigned long long end;
+	unsigned long long submitted;
+	unsigned long long wp;		/* completed */
+
+	unsigned long long errors;
+	int first_error;
+	/* the ring failed with writes in flight, wp is meaningless */
+	int aborted;
+	unsigned long long elapsed_ns;
+	int wp_ok;
+	int data_ok;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* every 512-byte sector starts with its own sector number and zone index */
+static void zbd_wo_fill(void *buf, unsigned int len, unsigned long long sector,
+			unsigned int idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < len >> SECTOR_SHIFT; i++) {
+		uint64_t *p = (uint64_t *)((char *)buf + (i << SECTOR_SHIFT));
+
+		p[0] = sector + i;
+		p[1] = idx;
+	}
+}
+
+static int zbd_wo_check(const void *buf, unsigned int len,
+			unsigned long long sector, unsigned int idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < len >> SECTOR_SHIFT; i++) {
+		const uint64_t *p = (const uint64_t *)((const char *)buf +
+						       (i << SECTOR_SHIFT));
+
+		if (p[0] != sector + i || p[1] != idx) {
+			fprintf(stderr,
+				"zone %u: sector %llu holds sector %llu of zone %llu\n",
+				idx, sector + i, (unsigned long long)p[0],
+				(unsigned long long)p[1]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int zbd_wo_report(int fd, unsigned long long sector,
+			 struct blk_zone *zone)
+{
+	struct {
+		struct blk_zone_report rep;
+		struct blk_zone zone;
+	} r;
+
+	memset(&r, 0, sizeof(r));
+	r.rep.sector = sector;
+	r.rep.nr_zones = 1;
+	if (ioctl(fd, BLKREPORTZONE, &r) < 0)
+		return -errno;
+	if (r.rep.nr_zones != 1)
+		return -ENOENT;
+	if (!(r.rep.flags & BLK_ZONE_REP_CAPACITY))
+		r.zone.capacity = r.zone.len;
+	*zone = r.zone;
+	return 0;
+}
+
+/* one write slot: its buffer and the zone range its write covers */
+struct zbd_wo_io {
+	void *buf;
+	unsigned long long off;
+	unsigned int len;
+	int done;
+};
+
+static void zbd_wo_prep(struct zbd_wo_zone *z, struct io_uring *ring,
+			struct zbd_wo_io *io, unsigned int tag)
+{
+	unsigned long long pos = (z->zone.start << SECTOR_SHIFT) + z->submitted;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+	io->off = z->submitted;
+	io->len = z->opts->bs;
+	if (io->len > z->end - z->submitted)
+		io->len = z->end - z->submitted;
+	io->done = 0;
+	zbd_wo_fill(io->buf, io->len, pos >> SECTOR_SHIFT, z->idx);
+	io_uring_prep_write(sqe, z->fd, io->buf, io->len, pos);
+	io_uring_sqe_set_data64(sqe, tag);
+	z->submitted += io->len;
+}
+
+static void *zbd_wo_zone_fn(void *data)
+{
+	struct zbd_wo_zone *z = data;
+	const struct zbd_wo_opts *o = z->opts;
+	unsigned int *free_tags, nr_free = 0, i;
+	unsigned int inflight = 0;
+	struct zbd_wo_io *ios;
+	struct io_uring ring;
+	char *bufs = NULL;
+	unsigned long long start;
+	int ret;
+
+	free_tags = calloc(o->depth, sizeof(*free_tags));
+	ios = calloc(o->depth, sizeof(*ios));
+	if (!free_tags || !ios ||
+	    posix_memalign((void **)&bufs, 4096, (size_t)o->depth * o->bs)) {
+		z->first_error = -ENOMEM;
+		goto free;
+	}
+	for (i = 0; i < o->depth; i++) {
+		ios[i].buf = bufs + (size_t)i * o->bs;
+		free_tags[nr_free++] = o->depth - 1 - i;
+	}
+
+	ret = io_uring_queue_init(o->depth, &ring, 0);
+	if (ret) {
+		z->first_error = ret;
+		goto free;
+	}
+
+	start = now_ns();
+	while (inflight || (!z->errors && z->submitted < z->end)) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, nr = 0;
+
+		/* no new writes after an error, the zone is broken anyway */
+		while (!z->errors && z->submitted < z->end && nr_free) {
+			unsigned int tag = free_tags[--nr_free];
+
+			zbd_wo_prep(z, &ring, &ios[tag], tag);
+			inflight++;
+		}
+
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0) {
+			z->first_error = ret;
+			z->aborted = 1;
+			break;
+		}
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			struct zbd_wo_io *io = &ios[cqe->user_data];
+
+			nr++;
+			inflight--;
+			if (cqe->res != io->len) {
+				if (!z->errors++)
+					z->first_error = cqe->res < 0 ?
+						cqe->res : -EIO;
+				free_tags[nr_free++] = cqe->user_data;
+				continue;
+			}
+			io->done = 1;
+		}
+		io_uring_cq_advance(&ring, nr);
+
+		/*
+		 * Writes complete in any order. The tracker only moves over
+		 * completed writes which start right at it, so that it ends
+		 * where the zone write pointer has to be.
+		 */
+		do {
+			for (i = 0; i < o->depth; i++)
+				if (ios[i].done && ios[i].off == z->wp)
+					break;
+			if (i < o->depth) {
+				z->wp += ios[i].len;
+				ios[i].done = 0;
+				free_tags[nr_free++] = i;
+			}
+		} while (i < o->depth);
+	}
+	z->elapsed_ns = now_ns() - start;
+	io_uring_queue_exit(&ring);
+
+free:
+	free(bufs);
+	free(ios);
+	free(free_tags);
+	return NULL;
+}
+
+static int zbd_wo_verify(struct zbd_wo_zone *z)
+{
+	unsigned long long off;
+	unsigned int bs = z->opts->bs;
+	void *buf;
+	int ret = 0;
+
+	if (posix_memalign(&buf, 4096, bs))
+		return -ENOMEM;
+	for (off = 0; off < z->wp && !ret; off += bs) {
+		unsigned int len = bs;
+		unsigned long long pos = (z->zone.start << SECTOR_SHIFT) + off;
+
+		if (len > z->wp - off)
+			len = z->wp - off;
+		if (pread(z->fd, buf, len, pos) != len) {
+			fprintf(stderr, "zone %u: read at %llu failed\n",
+				z->idx, pos);
+			ret = -EIO;
+			break;
+		}
+		ret = zbd_wo_check(buf, len, pos >> SECTOR_SHIFT, z->idx);
+	}
+	free(buf);
+	return ret;
+}
+
+static int zbd_wo_find_zones(int fd, struct zbd_wo_opts *o,
+			     struct zbd_wo_zone *zones)
+{
+	unsigned long long sector = o->start;
+	unsigned int n = 0;
+	struct blk_zone zone;
+	int ret;
+
+	while (n < o->nr_zones) {
+		ret = zbd_wo_report(fd, sector, &zone);
+		if (ret == -ENOENT)
+			break;
+		if (ret)
+			return ret;
+		sector = zone.start + zone.len;
+		if (zone.type != BLK_ZONE_TYPE_SEQWRITE_REQ)
+			continue;
+		zones[n].zone = zone;
+		zones[n].idx = n;
+		n++;
+	}
+	return n;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"usage: %s [-o <sector>] [-z <zones>] [-d <depth>] [-b <block size>]\n"
+		"          [-s <bytes per zone>] [-v] <device>\n"
+		"  Reset <zones> (default 4) sequential write required zones from\n"
+		"  the one containing <sector> on, write them all at once with one\n"
+		"  thread per zone keeping <depth> (default 32) writes of <block\n"
+		"  size> (default 65536) bytes in flight, up to the zone capacity\n"
+		"  or <bytes per zone>, and check each zone write pointer. -v also\n"
+		"  reads the data back. Exits with 1 on any error or mismatch.\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct zbd_wo_opts o = {
+		.nr_zones = 4,
+		.depth = 32,
+		.bs = 65536,
+	};
+	unsigned long long bytes = 0, elapsed_ns = 0, errors = 0;
+	struct zbd_wo_zone *zones;
+	int fd, opt, nr, i, failed = 0;
+
+	while ((opt = getopt(argc, argv, "b:d:o:s:vz:")) != -1) {
+		switch (opt) {
+		case 'b':
+			o.bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			o.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			o.start = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			o.size = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			o.verify = 1;
+			break;
+		case 'z':
+			o.nr_zones = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || !o.nr_zones || !o.depth ||
+	    o.depth > 0xffff || !o.bs || o.bs % 4096)
+		usage(argv[0]);
+	o.dev = argv[optind];
+
+	fd = open(o.dev, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+
+	zones = calloc(o.nr_zones, sizeof(*zones));
+	if (!zones)
+		return EXIT_FAILURE;
+	nr = zbd_wo_find_zones(fd, &o, zones);
+	if (nr <= 0) {
+		fprintf(stderr, "no sequential write required zone found\n");
+		return EXIT_FAILURE;
+	}
+	if (nr < o.nr_zones)
+		fprintf(stderr, "only %d sequential write required zones\n", nr);
+
+	for (i = 0; i < nr; i++) {
+		struct zbd_wo_zone *z = &zones[i];
+		struct blk_zone_range range = {
+			.sector = z->zone.start,
+			.nr_sectors = z->zone.len,
+		};
+
+		if (ioctl(fd, BLKRESETZONE, &range) < 0) {
+			perror("BLKRESETZONE");
+			return EXIT_FAILURE;
+		}
+		z->fd = fd;
+		z->opts = &o;
+		z->end = z->zone.capacity << SECTOR_SHIFT;
+		if (o.size && o.size < z->end)
+			z->end = o.size;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&zones[i].thread, NULL, zbd_wo_zone_fn,
+				   &zones[i])) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < nr; i++)
+		pthread_join(zones[i].thread, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct zbd_wo_zone *z = &zones[i];
+		unsigned long long expected, reported;
+		struct blk_zone zone;
+
+		if (z->aborted) {
+			printf("zone %u (sector %llu): aborted after %llu bytes: %s\n",
+			       z->idx, (unsigned long long)z->zone.start, z->wp,
+			       strerror(-z->first_error));
+			failed = 1;
+			continue;
+		}
+		if (zbd_wo_report(fd, z->zone.start, &zone) < 0) {
+			perror("BLKREPORTZONE");
+			return EXIT_FAILURE;
+		}
+		expected = z->zone.start + (z->wp >> SECTOR_SHIFT);
+		/* a full zone reports its write pointer past the zone end */
+		reported = zone.cond == BLK_ZONE_COND_FULL ?
+			z->zone.start + z->zone.capacity : zone.wp;
+		z->wp_ok = reported == expected;
+		z->data_ok = !o.verify || !zbd_wo_verify(z);
+
+		printf("zone %u (sector %llu): %llu bytes, %.1f MiB/s, wp %s",
+		       z->idx, (unsigned long long)z->zone.start, z->wp,
+		       z->elapsed_ns ?
+		       z->wp * 1e9 / z->elapsed_ns / (1 << 20) : 0.0,
+		       z->wp_ok ? "ok" : "mismatch");
+		if (!z->wp_ok)
+			printf(" (reported %llu, expected %llu)", reported,
+			       expected);
+		if (o.verify)
+			printf(", data %s", z->data_ok ? "ok" : "mismatch");
+		if (z->errors)
+			printf(", %llu write errors, first: %s", z->errors,
+			       strerror(-z->first_error));
+		else if (z->first_error)
+			printf(", %s", strerror(-z->first_error));
+		printf("\n");
+
+		bytes += z->wp;
+		errors += z->errors;
+		if (z->elapsed_ns > elapsed_ns)
+			elapsed_ns = z->elapsed_ns;
+		if (!z->wp_ok || !z->data_ok || z->errors || z->first_error ||
+		    z->wp != z->end)
+			failed = 1;
+	}
+	printf("%d zones, depth %u: %llu bytes, %.1f MiB/s, %llu write errors\n",
+	       nr, o.depth, bytes,
+	       elapsed_ns ? bytes * 1e9 / elapsed_ns / (1 << 20) : 0.0,
+	       errors);
+
+	free(zones);
+	close(fd);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
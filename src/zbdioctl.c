@@ -1,16 +1,27 @@
 // SPDX-License-Identifier: GPL-3.0+
 // Copyright (C) 2018 Western Digital Corporation or its affiliates.
+#define _GNU_SOURCE		/* O_DIRECT */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #ifdef HAVE_LINUX_BLKZONED_H
 #include <linux/blkzoned.h>
 #endif
+#include <linux/fs.h>		/* BLKSSZGET */
 #include <linux/types.h>
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
 #ifndef BLKGETZONESZ
 #define BLKGETZONESZ	_IOR(0x12, 132, __u32)
 #endif
@@ -37,15 +48,966 @@ void usage(const char *progname)
 		fprintf(stderr, "\t%s\n", requests[i].name);
 		i++;
 	}
+#ifdef BLKREPORTZONE
+	fprintf(stderr, "\treport [-o <sector>] [-c <count>] [-C <cond>[,<cond>...]] [-b] <device file>\n"
+		"\t\tReport <count> zones (default all) from the zone containing\n"
+		"\t\t<sector>, one per line as decimal <start> <len> <cap> <wp>\n"
+		"\t\t<type> <cond>, tab separated, in sectors. -C only prints\n"
+		"\t\tzones in one of the given conditions, by number or name\n"
+		"\t\t(not_wp, empty, imp_open, exp_open, closed, read_only,\n"
+		"\t\tfull, offline). -b writes struct blk_zone records instead.\n"
+		"\treset|finish|open|close [-o <sector>] [-c <count>] [-z <list>]\n"
+		"\t\t[-j <threads>] [-m <zones>] <device file>\n"
+		"\t\tApply the zone operation to <count> zones (default all)\n"
+		"\t\tfrom the zone containing <sector>, or to the zones of\n"
+		"\t\t<list>, zone numbers and ranges such as 0,4-7. Zones the\n"
+		"\t\toperation doesn't apply to are skipped. Contiguous zones\n"
+		"\t\tare merged into one ioctl of up to <zones> zones, ioctls\n"
+		"\t\tare run on <threads> (default 4) threads and per-ioctl\n"
+		"\t\tlatency is reported. finish and open account for the\n"
+		"\t\tzones already open or active and fail rather than exceed\n"
+		"\t\tmax_open_zones/max_active_zones; opened zones stay open.\n"
+		"\tverify [-b] [-w <write log>] [-r] <snapshot> <device file>\n"
+		"\t\tCompare the zones of a saved report (-b: binary) with\n"
+		"\t\ta fresh one, after applying the writes of <write log>,\n"
+		"\t\tone \"<sector> <nr_sectors>\" line per write in issue\n"
+		"\t\torder, to the saved state. With -r, the logged writes\n"
+		"\t\tmust have written the pattern data of the pattern request:\n"
+		"\t\tthe last block written by the log in every sequential zone\n"
+		"\t\tis read back and compared. Exits with 1 on any mismatch.\n"
+		"\tpattern <sector> <nr_sectors>\n"
+		"\t\tWrite the data verify -r expects at <sector> to stdout:\n"
+		"\t\tevery 64-bit little endian word of a 512 byte sector holds\n"
+		"\t\tthe sector number.\n");
+#endif
 	exit(EXIT_FAILURE);
 }
 
+#ifdef BLKREPORTZONE
+/* zones per BLKREPORTZONE call */
+#define ZONE_REPORT_BATCH	4096
+
+static const char *const zone_cond_names[] = {
+	[BLK_ZONE_COND_NOT_WP]		= "not_wp",
+	[BLK_ZONE_COND_EMPTY]		= "empty",
+	[BLK_ZONE_COND_IMP_OPEN]	= "imp_open",
+	[BLK_ZONE_COND_EXP_OPEN]	= "exp_open",
+	[BLK_ZONE_COND_CLOSED]		= "closed",
+	[BLK_ZONE_COND_READONLY]	= "read_only",
+	[BLK_ZONE_COND_FULL]		= "full",
+	[BLK_ZONE_COND_OFFLINE]		= "offline",
+};
+
+typedef int (*zone_cb)(const struct blk_zone *z, void *arg);
+
+/*
+ * Call @cb for up to @nr_zones zones from the one containing @sector on,
+ * ZONE_REPORT_BATCH zones per ioctl. Zone capacity is set to the zone
+ * length if the kernel doesn't report it. Stops at the first non-zero
+ * return value of @cb and returns it, or -errno.
+ */
+static int for_each_zone(int fd, __u64 sector, __u64 nr_zones, zone_cb cb,
+			 void *arg)
+{
+	struct blk_zone_report *rep;
+	unsigned int i;
+	int ret = 0;
+
+	rep = malloc(sizeof(*rep) +
+		     ZONE_REPORT_BATCH * sizeof(struct blk_zone));
+	if (!rep)
+		return -ENOMEM;
+
+	while (nr_zones) {
+		rep->sector = sector;
+		rep->nr_zones = nr_zones < ZONE_REPORT_BATCH ?
+			nr_zones : ZONE_REPORT_BATCH;
+		rep->flags = 0;
+		if (ioctl(fd, BLKREPORTZONE, rep) < 0) {
+			ret = -errno;
+			break;
+		}
+		if (!rep->nr_zones)
+			break;
+
+		for (i = 0; i < rep->nr_zones; i++) {
+			struct blk_zone *z = &rep->zones[i];
+
+			if (!(rep->flags & BLK_ZONE_REP_CAPACITY))
+				z->capacity = z->len;
+			ret = cb(z, arg);
+			if (ret)
+				goto out;
+		}
+		sector = rep->zones[i - 1].start + rep->zones[i - 1].len;
+		nr_zones -= rep->nr_zones;
+	}
+out:
+	free(rep);
+	return ret;
+}
+
+static int parse_zone_conds(char *arg, unsigned int *mask)
+{
+	char *tok, *end;
+	unsigned int c;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		c = strtoul(tok, &end, 0);
+		if (*end) {
+			for (c = 0; c < ARRAY_SIZE(zone_cond_names); c++)
+				if (zone_cond_names[c] &&
+				    !strcmp(tok, zone_cond_names[c]))
+					break;
+		}
+		if (c >= ARRAY_SIZE(zone_cond_names)) {
+			fprintf(stderr, "unknown zone condition %s\n", tok);
+			return -1;
+		}
+		*mask |= 1U << c;
+	}
+	return 0;
+}
+
+struct report_args {
+	unsigned int conds;
+	int binary;
+};
+
+static int print_zone(const struct blk_zone *z, void *arg)
+{
+	const struct report_args *args = arg;
+
+	if (args->conds && !(args->conds & (1U << z->cond)))
+		return 0;
+	if (args->binary) {
+		if (fwrite(z, sizeof(*z), 1, stdout) != 1)
+			return -EIO;
+		return 0;
+	}
+	if (printf("%llu\t%llu\t%llu\t%llu\t%u\t%u\n",
+		   (unsigned long long)z->start, (unsigned long long)z->len,
+		   (unsigned long long)z->capacity,
+		   (unsigned long long)z->wp, z->type, z->cond) < 0)
+		return -EIO;
+	return 0;
+}
+
+static int cmd_report(int argc, char **argv, const char *progname)
+{
+	struct report_args args = { };
+	unsigned long long sector = 0, nr_zones = ~0ULL;
+	int c, fd, ret;
+
+	while ((c = getopt(argc, argv, "bc:C:o:")) != -1) {
+		switch (c) {
+		case 'b':
+			args.binary = 1;
+			break;
+		case 'c':
+			nr_zones = strtoull(optarg, NULL, 0);
+			break;
+		case 'C':
+			if (parse_zone_conds(optarg, &args.conds))
+				return EXIT_FAILURE;
+			break;
+		case 'o':
+			sector = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	if (argc - optind != 1)
+		usage(progname);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+
+	/* one write() per few thousand zones rather than per line */
+	setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+	ret = for_each_zone(fd, sector, nr_zones, print_zone, &args);
+	if (!ret && fflush(stdout))
+		ret = -errno;
+	close(fd);
+	if (ret) {
+		fprintf(stderr, "report: %s\n", strerror(-ret));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#define COND(c)	(1U << BLK_ZONE_COND_##c)
+
+static const struct zone_op {
+	const char *name;
+	unsigned long code;
+	/* conditions the operation is a no-op or invalid in */
+	unsigned int skip_conds;
+	/* whether the operation can take zone resources */
+	int limited;
+} zone_ops[] = {
+	{ "reset", BLKRESETZONE,
+	  COND(NOT_WP) | COND(EMPTY) | COND(READONLY) | COND(OFFLINE), 0 },
+	{ "finish", BLKFINISHZONE,
+	  COND(NOT_WP) | COND(FULL) | COND(READONLY) | COND(OFFLINE), 1 },
+	{ "open", BLKOPENZONE,
+	  COND(NOT_WP) | COND(EXP_OPEN) | COND(FULL) | COND(READONLY) |
+	  COND(OFFLINE), 1 },
+	{ "close", BLKCLOSEZONE,
+	  ~(COND(IMP_OPEN) | COND(EXP_OPEN)), 0 },
+};
+
+/*
+ * Zone resources bounded by max_open_zones and max_active_zones. Implicitly
+ * open zones don't count as open: the device closes one of them to make room
+ * for an explicit open. Explicitly opening one still takes an open zone.
+ */
+enum { RES_OPEN, RES_ACTIVE, NR_ZONE_RES };
+
+#define OPEN_CONDS	COND(EXP_OPEN)
+#define ACTIVE_CONDS	(COND(IMP_OPEN) | COND(EXP_OPEN) | COND(CLOSED))
+
+static int count_in_use(const struct blk_zone *z, void *arg)
+{
+	unsigned int *in_use = arg;
+
+	in_use[RES_OPEN] += !!(OPEN_CONDS & (1U << z->cond));
+	in_use[RES_ACTIVE] += !!(ACTIVE_CONDS & (1U << z->cond));
+	return 0;
+}
+
+/*
+ * Add the resources applying @op to @z takes before the ioctl to @claim, and
+ * those it gives back once the ioctl is done to @release. Opening an empty,
+ * implicitly open or closed zone keeps an open zone and an empty one also an
+ * active zone.
+ * Finishing an empty zone needs an active zone while it runs, and finishing
+ * an open or closed one frees its resources.
+ */
+static void zone_op_res(const struct zone_op *op, const struct blk_zone *z,
+			unsigned int *claim, unsigned int *release)
+{
+	unsigned int cond = 1U << z->cond;
+
+	if (op->code == BLKOPENZONE) {
+		claim[RES_OPEN] += !!(cond & (COND(EMPTY) | COND(IMP_OPEN) |
+					      COND(CLOSED)));
+		claim[RES_ACTIVE] += !!(cond & COND(EMPTY));
+	} else if (op->code == BLKFINISHZONE) {
+		claim[RES_ACTIVE] += !!(cond & COND(EMPTY));
+		release[RES_ACTIVE] += !!(cond & (COND(EMPTY) | ACTIVE_CONDS));
+		release[RES_OPEN] += !!(cond & OPEN_CONDS);
+	}
+}
+
+struct zone_list {
+	struct blk_zone *zones;
+	unsigned int nr, alloc;
+};
+
+static int collect_zone(const struct blk_zone *z, void *arg)
+{
+	struct zone_list *l = arg;
+
+	if (l->nr == l->alloc) {
+		struct blk_zone *zones;
+
+		l->alloc = l->alloc ? 2 * l->alloc : ZONE_REPORT_BATCH;
+		zones = realloc(l->zones, l->alloc * sizeof(*zones));
+		if (!zones)
+			return -ENOMEM;
+		l->zones = zones;
+	}
+	l->zones[l->nr++] = *z;
+	return 0;
+}
+
+/* Mark the zones of a list like "0,4-7" in @sel. */
+static int parse_zone_list(const char *arg, unsigned char *sel,
+			   unsigned int nr_zones)
+{
+	unsigned long first, last;
+	char *end;
+
+	for (;;) {
+		first = last = strtoul(arg, &end, 0);
+		if (end == arg)
+			return -1;
+		if (*end == '-') {
+			arg = end + 1;
+			last = strtoul(arg, &end, 0);
+			if (end == arg)
+				return -1;
+		}
+		if (first > last || last >= nr_zones) {
+			fprintf(stderr, "invalid zone range %lu-%lu\n", first,
+				last);
+			return -1;
+		}
+		memset(sel + first, 1, last - first + 1);
+		if (!*end)
+			return 0;
+		if (*end != ',')
+			return -1;
+		arg = end + 1;
+	}
+}
+
+/* A queue limit of the disk @fd or the disk containing it, 0 if none. */
+static unsigned int queue_limit(int fd, const char *name)
+{
+	static const char *const dirs[] = { "queue", "../queue" };
+	unsigned int i, val = 0;
+	char path[128];
+	struct stat st;
+	FILE *f;
+
+	if (fstat(fd, &st) < 0)
+		return 0;
+	for (i = 0; i < ARRAY_SIZE(dirs); i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s/%s",
+			 major(st.st_rdev), minor(st.st_rdev), dirs[i], name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%u", &val) != 1)
+			val = 0;
+		fclose(f);
+		break;
+	}
+	return val;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct zone_mgmt_job {
+	struct blk_zone_range range;
+	unsigned int nr_zones;
+	unsigned int claim[NR_ZONE_RES], release[NR_ZONE_RES];
+	int ok;
+	unsigned long long lat_ns;
+};
+
+/*
+ * Jobs are handed out in order. For each limited resource, a job only starts
+ * once the zones the device has in use plus the claims of the jobs before it
+ * leave room for its claim. If a job can't fit and no job is in flight to
+ * free resources, the operation fails rather than exceeding the limit.
+ */
+struct zone_mgmt {
+	int fd;
+	unsigned long code;
+	struct zone_mgmt_job *jobs;
+	unsigned int nr_jobs, next, done, running;
+	unsigned int limit[NR_ZONE_RES], avail[NR_ZONE_RES];
+	int err;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static const char *const zone_res_limits[NR_ZONE_RES] = {
+	[RES_OPEN]	= "max_open_zones",
+	[RES_ACTIVE]	= "max_active_zones",
+};
+
+/* The first resource @job doesn't fit in, or -1. Called with m->lock. */
+static int job_short_res(const struct zone_mgmt *m,
+			 const struct zone_mgmt_job *job)
+{
+	int r;
+
+	for (r = 0; r < NR_ZONE_RES; r++)
+		if (m->limit[r] && m->avail[r] < job->claim[r])
+			return r;
+	return -1;
+}
+
+static void *zone_mgmt_worker(void *arg)
+{
+	struct zone_mgmt *m = arg;
+	struct zone_mgmt_job *job;
+	unsigned long long t;
+	int ret, r;
+
+	for (;;) {
+		pthread_mutex_lock(&m->lock);
+		if (m->err || m->next == m->nr_jobs) {
+			pthread_mutex_unlock(&m->lock);
+			return NULL;
+		}
+		job = &m->jobs[m->next++];
+		while (!m->err && (r = job_short_res(m, job)) >= 0) {
+			if (!m->running) {
+				m->err = ETOOMANYREFS;
+				fprintf(stderr,
+					"sector %llu, %llu sectors: would exceed %s (%u)\n",
+					(unsigned long long)job->range.sector,
+					(unsigned long long)job->range.nr_sectors,
+					zone_res_limits[r], m->limit[r]);
+				pthread_cond_broadcast(&m->cond);
+				break;
+			}
+			pthread_cond_wait(&m->cond, &m->lock);
+		}
+		if (m->err) {
+			pthread_mutex_unlock(&m->lock);
+			return NULL;
+		}
+		for (r = 0; r < NR_ZONE_RES; r++)
+			m->avail[r] -= job->claim[r];
+		m->running++;
+		pthread_mutex_unlock(&m->lock);
+
+		t = now_ns();
+		ret = ioctl(m->fd, m->code, &job->range);
+		job->lat_ns = now_ns() - t;
+		job->ok = ret >= 0;
+
+		pthread_mutex_lock(&m->lock);
+		m->running--;
+		/* a failed ioctl may have changed some zones, keep the claim */
+		if (ret >= 0)
+			for (r = 0; r < NR_ZONE_RES; r++)
+				m->avail[r] += job->release[r];
+		pthread_cond_broadcast(&m->cond);
+		if (ret < 0 && !m->err) {
+			m->err = errno;
+			fprintf(stderr, "sector %llu, %llu sectors: %s\n",
+				(unsigned long long)job->range.sector,
+				(unsigned long long)job->range.nr_sectors,
+				strerror(errno));
+		} else if (ret >= 0) {
+			m->done++;
+		}
+		pthread_mutex_unlock(&m->lock);
+	}
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_zone_mgmt_stats(const char *name, struct zone_mgmt *m,
+				  unsigned int nr_zones, unsigned int threads,
+				  unsigned long long elapsed_ns)
+{
+	unsigned long long *lat, sum = 0;
+	unsigned int i;
+
+	printf("%s: %u zones in %u ioctls on %u threads, %.3f s\n", name,
+	       nr_zones, m->nr_jobs, threads, elapsed_ns / 1e9);
+	if (!m->done)
+		return;
+
+	lat = malloc(m->done * sizeof(*lat));
+	if (!lat)
+		return;
+	for (i = 0; i < m->done; i++) {
+		lat[i] = m->jobs[i].lat_ns;
+		sum += lat[i];
+	}
+	qsort(lat, m->done, sizeof(*lat), cmp_lat);
+	printf("latency (us): min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+	       lat[0] / 1e3, sum / m->done / 1e3, lat[m->done / 2] / 1e3,
+	       lat[(unsigned long long)m->done * 99 / 100] / 1e3,
+	       lat[m->done - 1] / 1e3);
+	free(lat);
+}
+
+static int cmd_zone_mgmt(const struct zone_op *op, int argc, char **argv,
+			 const char *progname)
+{
+	unsigned long long sector = 0, nr_zones = ~0ULL;
+	unsigned int threads = 4, max_per_ioctl = ~0U, nr_selected = 0;
+	unsigned int i, r, in_use[NR_ZONE_RES] = { };
+	struct zone_list l = { };
+	struct zone_mgmt m = { };
+	struct zone_mgmt_job *job = NULL;
+	const char *list = NULL;
+	unsigned char *sel = NULL;
+	unsigned long long start;
+	pthread_t *tids = NULL;
+	int c, fd, ret = EXIT_FAILURE;
+
+	while ((c = getopt(argc, argv, "c:j:m:o:z:")) != -1) {
+		switch (c) {
+		case 'c':
+			nr_zones = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			max_per_ioctl = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			sector = strtoull(optarg, NULL, 0);
+			break;
+		case 'z':
+			list = optarg;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	if (argc - optind != 1 || !threads || !max_per_ioctl)
+		usage(progname);
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+
+	if (list) {
+		sector = 0;
+		nr_zones = ~0ULL;
+	}
+	c = for_each_zone(fd, sector, nr_zones, collect_zone, &l);
+	if (c) {
+		fprintf(stderr, "report: %s\n", strerror(-c));
+		goto out;
+	}
+	sel = calloc(l.nr + 1, 1);
+	if (!sel)
+		goto out;
+	if (!list)
+		memset(sel, 1, l.nr);
+	else if (parse_zone_list(list, sel, l.nr))
+		usage(progname);
+
+	if (op->limited) {
+		for (r = 0; r < NR_ZONE_RES; r++)
+			m.limit[r] = queue_limit(fd, zone_res_limits[r]);
+		/* the limits are device wide, count all zones in use */
+		if (m.limit[RES_OPEN] || m.limit[RES_ACTIVE]) {
+			if (!sector && nr_zones == ~0ULL) {
+				for (i = 0; i < l.nr; i++)
+					count_in_use(&l.zones[i], in_use);
+				c = 0;
+			} else {
+				c = for_each_zone(fd, 0, ~0ULL, count_in_use,
+						  in_use);
+			}
+			if (c) {
+				fprintf(stderr, "report: %s\n", strerror(-c));
+				goto out;
+			}
+		}
+		for (r = 0; r < NR_ZONE_RES; r++) {
+			if (!m.limit[r])
+				continue;
+			m.avail[r] = m.limit[r] > in_use[r] ?
+				m.limit[r] - in_use[r] : 0;
+			if (m.avail[r] && max_per_ioctl > m.avail[r])
+				max_per_ioctl = m.avail[r];
+		}
+	}
+
+	/* merge runs of contiguous zones into one range per ioctl */
+	m.jobs = calloc(l.nr ? l.nr : 1, sizeof(*m.jobs));
+	if (!m.jobs)
+		goto out;
+	for (i = 0; i < l.nr; i++) {
+		const struct blk_zone *z = &l.zones[i];
+
+		if (!sel[i] || (op->skip_conds & (1U << z->cond)))
+			continue;
+		nr_selected++;
+		if (job && job->nr_zones < max_per_ioctl &&
+		    job->range.sector + job->range.nr_sectors == z->start) {
+			job->range.nr_sectors += z->len;
+			job->nr_zones++;
+		} else {
+			job = &m.jobs[m.nr_jobs++];
+			job->range.sector = z->start;
+			job->range.nr_sectors = z->len;
+			job->nr_zones = 1;
+		}
+		zone_op_res(op, z, job->claim, job->release);
+	}
+
+	m.fd = fd;
+	m.code = op->code;
+	pthread_mutex_init(&m.lock, NULL);
+	pthread_cond_init(&m.cond, NULL);
+	if (threads > m.nr_jobs)
+		threads = m.nr_jobs ? m.nr_jobs : 1;
+	tids = calloc(threads, sizeof(*tids));
+	if (!tids)
+		goto out;
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		c = pthread_create(&tids[i], NULL, zone_mgmt_worker, &m);
+		if (c) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(c));
+			pthread_mutex_lock(&m.lock);
+			m.err = c;
+			pthread_mutex_unlock(&m.lock);
+			break;
+		}
+	}
+	threads = i;
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	/* the stats only need the latencies of the successful ioctls */
+	for (i = 0, c = 0; i < m.next; i++)
+		if (m.jobs[i].ok)
+			m.jobs[c++] = m.jobs[i];
+	print_zone_mgmt_stats(op->name, &m, nr_selected, threads,
+			      now_ns() - start);
+	if (!m.err)
+		ret = EXIT_SUCCESS;
+
+out:
+	free(tids);
+	free(m.jobs);
+	free(sel);
+	free(l.zones);
+	close(fd);
+	return ret;
+}
+
+/* Load a report saved by "zbdioctl report", with -b if @binary. */
+static int load_zones(const char *path, int binary, struct zone_list *l)
+{
+	unsigned long long start, len, cap, wp;
+	unsigned int type, cond;
+	struct blk_zone z;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	for (;;) {
+		if (binary) {
+			if (fread(&z, sizeof(z), 1, f) != 1)
+				break;
+		} else {
+			ret = fscanf(f, "%llu %llu %llu %llu %u %u", &start,
+				     &len, &cap, &wp, &type, &cond);
+			if (ret != 6) {
+				ret = ret == EOF ? 0 : -EINVAL;
+				break;
+			}
+			memset(&z, 0, sizeof(z));
+			z.start = start;
+			z.len = len;
+			z.capacity = cap;
+			z.wp = wp;
+			z.type = type;
+			z.cond = cond;
+		}
+		ret = collect_zone(&z, l);
+		if (ret)
+			break;
+	}
+	if (!ret && ferror(f))
+		ret = -EIO;
+	fclose(f);
+	return ret;
+}
+
+static struct blk_zone *find_zone(struct zone_list *l, unsigned long long sector)
+{
+	unsigned int lo = 0, hi = l->nr;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		struct blk_zone *z = &l->zones[mid];
+
+		if (sector < z->start)
+			hi = mid;
+		else if (sector >= z->start + z->len)
+			lo = mid + 1;
+		else
+			return z;
+	}
+	return NULL;
+}
+
+/* Fill @buf with the pattern data of @nr_sectors sectors from @sector. */
+static void fill_pattern(void *buf, unsigned long long sector,
+			 unsigned int nr_sectors)
+{
+	__u64 *p = buf;
+	unsigned int i, j;
+
+	for (i = 0; i < nr_sectors; i++, sector++)
+		for (j = 0; j < 512 / sizeof(*p); j++)
+			*p++ = htole64(sector);
+}
+
+static int cmd_pattern(int argc, char **argv, const char *progname)
+{
+	unsigned long long sector, nr_sectors;
+	unsigned int n;
+	char buf[64 * 512];
+
+	if (argc != 3)
+		usage(progname);
+	sector = strtoull(argv[1], NULL, 0);
+	nr_sectors = strtoull(argv[2], NULL, 0);
+	for (; nr_sectors; sector += n, nr_sectors -= n) {
+		n = nr_sectors < sizeof(buf) / 512 ? nr_sectors :
+			sizeof(buf) / 512;
+		fill_pattern(buf, sector, n);
+		if (fwrite(buf, 512, n, stdout) != n) {
+			perror("pattern");
+			return EXIT_FAILURE;
+		}
+	}
+	return fflush(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Move the write pointers and conditions of the saved zones over the
+ * writes of the log. Writes which don't start at the write pointer of a
+ * sequential zone are counted as mismatches, the device must have failed
+ * them. The end of the last logged write of each zone goes to @log_end.
+ */
+static int apply_write_log(const char *path, struct zone_list *l,
+			   unsigned long long *log_end,
+			   unsigned int *mismatches)
+{
+	unsigned long long sector, nr_sectors;
+	struct blk_zone *z;
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	while ((ret = fscanf(f, "%lli %lli", &sector, &nr_sectors)) == 2) {
+		z = find_zone(l, sector);
+		if (!z || sector + nr_sectors > z->start + z->capacity) {
+			printf("write %llu+%llu: not within a zone capacity\n",
+			       sector, nr_sectors);
+			(*mismatches)++;
+			continue;
+		}
+		if (z->type == BLK_ZONE_TYPE_CONVENTIONAL)
+			continue;
+		if (sector != z->wp) {
+			printf("write %llu+%llu: not at the write pointer %llu\n",
+			       sector, nr_sectors, (unsigned long long)z->wp);
+			(*mismatches)++;
+			continue;
+		}
+		z->wp += nr_sectors;
+		log_end[z - l->zones] = z->wp;
+		if (z->wp == z->start + z->capacity) {
+			z->cond = BLK_ZONE_COND_FULL;
+			z->wp = z->start + z->len;
+		} else if (z->cond != BLK_ZONE_COND_EXP_OPEN) {
+			z->cond = BLK_ZONE_COND_IMP_OPEN;
+		}
+	}
+	fclose(f);
+	return ret == EOF ? 0 : -EINVAL;
+}
+
+/* implicitly open zones may get closed by the device at any time */
+static int same_cond(unsigned int a, unsigned int b)
+{
+	if (a == BLK_ZONE_COND_CLOSED)
+		a = BLK_ZONE_COND_IMP_OPEN;
+	if (b == BLK_ZONE_COND_CLOSED)
+		b = BLK_ZONE_COND_IMP_OPEN;
+	return a == b;
+}
+
+/*
+ * Check that the logical block ending at sector @end holds the pattern data,
+ * using @buf and @expected of @lbs bytes. Returns 0, 1 if it doesn't or -1
+ * with errno set if reading it failed.
+ */
+static int check_block(int fd, unsigned long long end, void *buf,
+		       void *expected, unsigned int lbs)
+{
+	unsigned long long sector = end - lbs / 512;
+
+	errno = 0;
+	if (pread(fd, buf, lbs, sector << 9) != lbs) {
+		if (!errno)
+			errno = EIO;
+		return -1;
+	}
+	fill_pattern(expected, sector, lbs / 512);
+	return memcmp(buf, expected, lbs) != 0;
+}
+
+static int cmd_verify(int argc, char **argv, const char *progname)
+{
+	struct zone_list saved = { }, cur = { };
+	const char *write_log = NULL;
+	unsigned long long *log_end = NULL;
+	unsigned int i, lbs = 512, mismatches = 0;
+	int c, fd, dfd = -1, binary = 0, read_back = 0;
+	int ret = EXIT_FAILURE;
+	void *buf = NULL, *expected = NULL;
+
+	while ((c = getopt(argc, argv, "brw:")) != -1) {
+		switch (c) {
+		case 'b':
+			binary = 1;
+			break;
+		case 'r':
+			read_back = 1;
+			break;
+		case 'w':
+			write_log = optarg;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+	if (argc - optind != 2)
+		usage(progname);
+
+	c = load_zones(argv[optind], binary, &saved);
+	if (c) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-c));
+		return EXIT_FAILURE;
+	}
+	log_end = calloc(saved.nr + 1, sizeof(*log_end));
+	if (!log_end) {
+		perror("calloc");
+		goto free;
+	}
+	if (write_log) {
+		c = apply_write_log(write_log, &saved, log_end, &mismatches);
+		if (c) {
+			fprintf(stderr, "%s: %s\n", write_log, strerror(-c));
+			goto free;
+		}
+	}
+
+	fd = open(argv[optind + 1], O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		goto free;
+	}
+	c = saved.nr ? for_each_zone(fd, saved.zones[0].start, saved.nr,
+				     collect_zone, &cur) : 0;
+	if (c) {
+		fprintf(stderr, "report: %s\n", strerror(-c));
+		goto close;
+	}
+	if (read_back) {
+		dfd = open(argv[optind + 1], O_RDONLY | O_DIRECT);
+		if (dfd < 0 || ioctl(dfd, BLKSSZGET, &lbs) < 0 ||
+		    posix_memalign(&buf, 4096, lbs) ||
+		    !(expected = malloc(lbs))) {
+			perror("read back");
+			goto close;
+		}
+	}
+
+	if (cur.nr < saved.nr) {
+		printf("%u zones reported, %u saved\n", cur.nr, saved.nr);
+		mismatches++;
+	}
+	for (i = 0; i < saved.nr && i < cur.nr; i++) {
+		const struct blk_zone *s = &saved.zones[i], *z = &cur.zones[i];
+
+		if (s->start != z->start || s->len != z->len ||
+		    s->type != z->type) {
+			printf("zone %u: start %llu len %llu type %u, saved start %llu len %llu type %u\n",
+			       i, (unsigned long long)z->start,
+			       (unsigned long long)z->len, z->type,
+			       (unsigned long long)s->start,
+			       (unsigned long long)s->len, s->type);
+			mismatches++;
+			continue;
+		}
+		if (s->capacity != z->capacity) {
+			printf("zone %u: capacity %llu, expected %llu\n", i,
+			       (unsigned long long)z->capacity,
+			       (unsigned long long)s->capacity);
+			mismatches++;
+		}
+		if (!same_cond(s->cond, z->cond)) {
+			printf("zone %u: condition %u, expected %u\n", i,
+			       z->cond, s->cond);
+			mismatches++;
+		}
+		/* the write pointer of a full zone is undefined */
+		if (z->type != BLK_ZONE_TYPE_CONVENTIONAL &&
+		    z->cond != BLK_ZONE_COND_FULL && s->wp != z->wp) {
+			printf("zone %u: write pointer %llu, expected %llu\n",
+			       i, (unsigned long long)z->wp,
+			       (unsigned long long)s->wp);
+			mismatches++;
+		}
+		if (!read_back || !log_end[i])
+			continue;
+		c = check_block(dfd, log_end[i], buf, expected, lbs);
+		if (c < 0) {
+			printf("zone %u: reading the last written block failed: %s\n",
+			       i, strerror(errno));
+			mismatches++;
+		} else if (c) {
+			printf("zone %u: block at sector %llu doesn't hold the written data\n",
+			       i, log_end[i] - lbs / 512);
+			mismatches++;
+		}
+	}
+	printf("%u zones verified, %u mismatches\n", i, mismatches);
+	if (!mismatches)
+		ret = EXIT_SUCCESS;
+
+close:
+	if (dfd >= 0)
+		close(dfd);
+	close(fd);
+free:
+	free(expected);
+	free(buf);
+	free(log_end);
+	free(cur.zones);
+	free(saved.zones);
+	return ret;
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	int i = 0, fd, ret;
 	unsigned int val;
 	unsigned long code = 0;
 
+#ifdef BLKREPORTZONE
+	if (argc >= 2 && strcmp(argv[1], "report") == 0)
+		return cmd_report(argc - 1, argv + 1, argv[0]);
+	if (argc >= 2 && strcmp(argv[1], "verify") == 0)
+		return cmd_verify(argc - 1, argv + 1, argv[0]);
+	if (argc >= 2 && strcmp(argv[1], "pattern") == 0)
+		return cmd_pattern(argc - 1, argv + 1, argv[0]);
+	for (i = 0; argc >= 2 && i < ARRAY_SIZE(zone_ops); i++)
+		if (strcmp(argv[1], zone_ops[i].name) == 0)
+			return cmd_zone_mgmt(&zone_ops[i], argc - 1, argv + 1,
+					     argv[0]);
+	i = 0;
+#endif
+
 	if (argc != 3)
 		usage(argv[0]);
 